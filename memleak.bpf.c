@@ -3,6 +3,7 @@
 #include "vmlinux.h"
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
+#include <bpf/usdt.bpf.h>
 
 #include "maps.bpf.h"
 #include "memleak.h"
@@ -15,6 +16,36 @@ const volatile __u64 sample_rate = 1;
 const volatile bool trace_all = false;
 const volatile __u64 stack_flags = 0;
 const volatile bool wa_missing_free = false;
+const volatile __u64 stack_budget = 0;
+const volatile __u64 alert_size = 0;
+const volatile bool tag_enabled = false;
+const volatile bool tag_tls = false;
+const volatile __u64 tag_addr = 0;
+const volatile bool windows_enabled = false;
+const volatile bool free_stacks_enabled = false;
+const volatile bool realloc_chains_enabled = false;
+const volatile bool cohorts_enabled = false;
+const volatile bool remote_frees_enabled = false;
+const volatile bool multi_session = false;
+const volatile u32 kernel_session = 0;
+const volatile bool follow_children = false;
+const volatile bool follow_exe = false;
+const volatile u64 follow_exe_ino = 0;
+const volatile u32 follow_exe_dev = 0;
+const volatile bool pidns_filter = false;
+const volatile u64 pidns_dev = 0;
+const volatile u64 pidns_ino = 0;
+const volatile bool dwarf_unwind = false;
+const volatile u64 unwind_sample = 1;
+
+/*
+ * Set from userspace between the capture window and the observation period
+ * of the duty-cycled mode: new allocations are ignored and frees outside of
+ * the address range of the tracked allocations skip the map lookup.
+ */
+bool free_only = false;
+u64 free_addr_min = 0;
+u64 free_addr_max = 0;
 
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
@@ -23,6 +54,25 @@ struct {
 	__uint(max_entries, 10240);
 } sizes SEC(".maps");
 
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32); /* session id */
+	__type(value, struct session_config);
+	__uint(max_entries, MAX_SESSIONS);
+} session_configs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u32); /* tgid */
+	__type(value, u32); /* session id */
+	__uint(max_entries, MAX_SESSIONS);
+} session_pids SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 64 * 1024);
+} follow_events SEC(".maps");
+
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
 	__type(key, u64); /* address */
@@ -49,9 +99,179 @@ struct {
 	__type(key, u32);
 } stack_traces SEC(".maps");
 
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64); /* stack id */
+	__type(value, struct stack_budget_info);
+	__uint(max_entries, COMBINED_ALLOCS_MAX_ENTRIES);
+} stack_budgets SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+} alerts SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 1024 * 1024);
+} free_events SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 4 * 1024 * 1024);
+} unwind_events SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64); /* stack id */
+	__type(value, struct remote_free_info);
+	__uint(max_entries, COMBINED_ALLOCS_MAX_ENTRIES);
+} remote_frees SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, u64);
+	__uint(max_entries, MEMLEAK_STAT_MAX);
+} stats SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64); /* stack id */
+	__type(value, u8);
+	__uint(max_entries, 1024);
+} target_stacks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64); /* alloc stack id << 32 | free stack id */
+	__type(value, union combined_alloc_info);
+	__uint(max_entries, COMBINED_ALLOCS_MAX_ENTRIES);
+} free_pairs SEC(".maps");
+
+/* the allocation a realloc in progress is going to replace */
+struct realloc_origin {
+	u64 address;
+	u64 size;
+	u32 hops;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u32); /* tid */
+	__type(value, struct realloc_origin);
+	__uint(max_entries, 10240);
+} realloc_origins SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64); /* stack id */
+	__type(value, struct realloc_chain_info);
+	__uint(max_entries, COMBINED_ALLOCS_MAX_ENTRIES);
+} realloc_chains SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u32); /* tid */
+	__type(value, u64); /* window id */
+	__uint(max_entries, 10240);
+} active_windows SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, u64); /* window id */
+	__type(value, u64); /* end timestamp */
+	__uint(max_entries, 10240);
+} window_ends SEC(".maps");
+
 static union combined_alloc_info initial_cinfo;
+static struct stack_budget_info initial_budget;
+static struct realloc_chain_info initial_chain;
+static struct remote_free_info initial_remote_free;
+
+/* the sampling interval of a stack over budget doubles at most this often */
+#define MAX_BUDGET_SHIFT 16
+
+/*
+ * With several sessions the allocations of each one are told apart by the
+ * session id in the top bits of their keys: bits 56-58 of the address, and
+ * bits 32-34 of the stack id. Session 0 keeps the plain keys.
+ *
+ * Followed processes share a session, so the low 14 bits of their tgid go
+ * to the unused bits 47-55 and 59-63 of user space addresses.
+ */
+static __always_inline u64 session_alloc_key(u64 address, u32 sid, bool kernel)
+{
+	u64 key = address ^ (u64)sid << 56;
+
+	if ((follow_children || follow_exe || pidns_filter) && !kernel) {
+		const u32 tgid = bpf_get_current_pid_tgid() >> 32;
+
+		key ^= (u64)(tgid & 0x1ff) << 47 ^ (u64)(tgid >> 9 & 0x1f) << 59;
+	}
 
-static void update_statistics_add(u64 stack_id, u64 sz)
+	return key;
+}
+
+static __always_inline u64 session_stack_key(int stack_id, u32 sid)
+{
+	return (u64)(s64)stack_id ^ (u64)sid << 32;
+}
+
+/*
+ * Finds the session of an event: kernel tracepoints belong to the kernel
+ * session, user probes to the session of the process. Returns false for
+ * processes no session traces, or outside of the traced pid namespace.
+ */
+static __always_inline bool get_session(bool kernel, u32 *sid)
+{
+	const u32 tgid = bpf_get_current_pid_tgid() >> 32;
+	struct bpf_pidns_info ns;
+	const u32 *found;
+
+	*sid = 0;
+
+	/* fails unless the pid namespace of the task is the traced one */
+	if (pidns_filter && !kernel &&
+	    bpf_get_ns_current_pid_tgid(pidns_dev, pidns_ino, &ns, sizeof(ns)))
+		return false;
+
+	if (!multi_session && !follow_children && !follow_exe)
+		return true;
+
+	if (kernel) {
+		*sid = kernel_session;
+
+		return true;
+	}
+
+	found = bpf_map_lookup_elem(&session_pids, &tgid);
+	if (!found)
+		return false;
+
+	*sid = *found;
+
+	return true;
+}
+
+/* kernel allocations may nest in a user allocation of the same process */
+static __always_inline pid_t sizes_key(bool kernel)
+{
+	const pid_t pid = bpf_get_current_pid_tgid() >> 32;
+
+	return kernel ? ~pid : pid;
+}
+
+static __always_inline void stat_inc(u32 idx)
+{
+	u64 *count;
+
+	count = bpf_map_lookup_elem(&stats, &idx);
+	if (count)
+		(*count)++;
+}
+
+static void update_statistics_add(u64 stack_id, u64 sz, u32 weight)
 {
 	union combined_alloc_info *existing_cinfo;
 
@@ -60,14 +280,14 @@ static void update_statistics_add(u64 stack_id, u64 sz)
 		return;
 
 	const union combined_alloc_info incremental_cinfo = {
-		.total_size = sz,
-		.number_of_allocs = 1
+		.total_size = sz * weight,
+		.number_of_allocs = weight
 	};
 
 	__sync_fetch_and_add(&existing_cinfo->bits, incremental_cinfo.bits);
 }
 
-static void update_statistics_del(u64 stack_id, u64 sz)
+static void update_statistics_del(u64 stack_id, u64 sz, u32 weight)
 {
 	union combined_alloc_info *existing_cinfo;
 
@@ -79,24 +299,306 @@ static void update_statistics_del(u64 stack_id, u64 sz)
 	}
 
 	const union combined_alloc_info decremental_cinfo = {
-		.total_size = sz,
-		.number_of_allocs = 1
+		.total_size = sz * weight,
+		.number_of_allocs = weight
 	};
 
 	__sync_fetch_and_sub(&existing_cinfo->bits, decremental_cinfo.bits);
 }
 
-static int gen_alloc_enter(size_t size)
+/*
+ * Once a stack has more than stack_budget outstanding tracked allocations,
+ * only every interval-th of its further allocations is tracked, with the
+ * interval doubling each time the stack grows by another budget. Returns
+ * false for allocations that are skipped, otherwise sets the weight of the
+ * tracked allocation.
+ */
+static bool stack_budget_admit(u64 stack_id, u32 *weight)
+{
+	struct stack_budget_info *budget;
+	u64 over, interval;
+
+	*weight = 1;
+
+	budget = bpf_map_lookup_or_try_init(&stack_budgets, &stack_id, &initial_budget);
+	if (!budget)
+		return true;
+
+	if (budget->live >= stack_budget) {
+		over = (budget->live - stack_budget) / stack_budget + 1;
+		interval = 1ULL << (over < MAX_BUDGET_SHIFT ? over : MAX_BUDGET_SHIFT);
+
+		if (__sync_fetch_and_add(&budget->seen, 1) % interval)
+			return false;
+
+		*weight = interval;
+	}
+
+	__sync_fetch_and_add(&budget->live, 1);
+
+	return true;
+}
+
+static void stack_budget_release(u64 stack_id)
+{
+	struct stack_budget_info *budget;
+
+	budget = bpf_map_lookup_elem(&stack_budgets, &stack_id);
+	if (budget)
+		__sync_fetch_and_sub(&budget->live, 1);
+}
+
+static void emit_alert(void *ctx, u64 address, const struct alloc_info *info)
+{
+	const u64 pid_tgid = bpf_get_current_pid_tgid();
+	struct alert_event *event;
+	long stack_sz;
+
+	event = bpf_ringbuf_reserve(&alerts, sizeof(*event), 0);
+	if (!event) {
+		stat_inc(MEMLEAK_STAT_ALERTS_DROPPED);
+
+		return;
+	}
+
+	event->size = info->size;
+	event->address = address;
+	event->timestamp_ns = info->timestamp_ns;
+	event->pid = pid_tgid >> 32;
+	event->tid = (u32)pid_tgid;
+
+	stack_sz = bpf_get_stack(ctx, event->stack, sizeof(event->stack), stack_flags);
+	event->nr_frames = stack_sz > 0 ? stack_sz / sizeof(event->stack[0]) : 0;
+
+	bpf_ringbuf_submit(event, 0);
+}
+
+/* the stack may end less than UNWIND_STACK_SIZE above sp, near its top */
+static __always_inline u32 copy_user_stack(void *dst, u64 sp)
 {
-	if (size < min_size || size > max_size)
+	u32 size;
+
+	if (!bpf_probe_read_user(dst, UNWIND_STACK_SIZE, (void *)sp))
+		return UNWIND_STACK_SIZE;
+
+	/* up to the end of the next page, then of the page of sp */
+	size = page_size - (sp & (page_size - 1)) + page_size;
+	if (size > UNWIND_STACK_SIZE)
+		size = UNWIND_STACK_SIZE;
+	if (!bpf_probe_read_user(dst, size, (void *)sp))
+		return size;
+
+	size -= page_size;
+	if (size > UNWIND_STACK_SIZE)
 		return 0;
+	if (!bpf_probe_read_user(dst, size, (void *)sp))
+		return size;
+
+	return 0;
+}
+
+/*
+ * Hands a copy of the user stack and the registers of a sampled allocation
+ * to userspace to unwind, see --dwarf-unwind. Returns false for allocations
+ * not sampled or when the ring buffer is full, which keep the stack of the
+ * frame pointers.
+ */
+static bool emit_unwind_event(struct pt_regs *ctx, u64 key, const struct alloc_info *info)
+{
+	struct unwind_event *event;
+
+	if (unwind_sample > 1 && bpf_ktime_get_ns() % unwind_sample != 0)
+		return false;
+
+	event = bpf_ringbuf_reserve(&unwind_events, sizeof(*event), 0);
+	if (!event) {
+		stat_inc(MEMLEAK_STAT_UNWINDS_DROPPED);
+
+		return false;
+	}
+
+	event->key = key;
+	event->timestamp_ns = info->timestamp_ns;
+	event->ip = PT_REGS_IP(ctx);
+	event->sp = PT_REGS_SP(ctx);
+	event->bp = PT_REGS_FP(ctx);
+	event->pid = info->pid;
+	event->stack_sz = copy_user_stack(event->stack, event->sp);
+
+	bpf_ringbuf_submit(event, 0);
+
+	return true;
+}
+
+/* counts the frees of a --free-stacks allocation by its freeing stack */
+static void record_free_pair(void *ctx, const struct alloc_info *info)
+{
+	union combined_alloc_info *pair;
+	long free_stack_id;
+	u64 key;
+
+	free_stack_id = bpf_get_stackid(ctx, &stack_traces, stack_flags);
+	if (free_stack_id < 0) {
+		stat_inc(MEMLEAK_STAT_STACK_ERRORS);
+
+		return;
+	}
+
+	key = (u64)info->stack_id << 32 | (u32)free_stack_id;
+
+	pair = bpf_map_lookup_or_try_init(&free_pairs, &key, &initial_cinfo);
+	if (!pair)
+		return;
 
-	if (sample_rate > 1) {
-		if (bpf_ktime_get_ns() % sample_rate != 0)
+	const union combined_alloc_info incremental_cinfo = {
+		.total_size = info->size * info->weight,
+		.number_of_allocs = info->weight
+	};
+
+	__sync_fetch_and_add(&pair->bits, incremental_cinfo.bits);
+}
+
+/*
+ * Accounts a realloc of a tracked allocation to the stack of the realloc.
+ * A realloc that moved the object implies a copy of the smaller of both
+ * sizes.
+ */
+static void update_realloc_chain(u64 stack_id, const struct realloc_origin *origin,
+				 u64 address, u64 size)
+{
+	struct realloc_chain_info *chain;
+	u64 hops = origin->hops + 1;
+
+	chain = bpf_map_lookup_or_try_init(&realloc_chains, &stack_id, &initial_chain);
+	if (!chain)
+		return;
+
+	__sync_fetch_and_add(&chain->hops, 1);
+	if (hops == 1)
+		__sync_fetch_and_add(&chain->chains, 1);
+	if (hops > chain->max_hops)
+		chain->max_hops = hops;
+
+	if (address != origin->address)
+		__sync_fetch_and_add(&chain->copy_bytes, size < origin->size ? size : origin->size);
+
+	if (size >= origin->size + origin->size / 2)
+		__sync_fetch_and_add(&chain->geometric, 1);
+	else if (size > origin->size)
+		__sync_fetch_and_add(&chain->small_growth, 1);
+}
+
+/* counts frees happening on another cpu or thread than the allocation */
+static void update_remote_frees(const struct alloc_info *info)
+{
+	const u32 tid = (u32)bpf_get_current_pid_tgid();
+	const u64 stack_id = info->stack_id;
+	struct remote_free_info *remote;
+
+	remote = bpf_map_lookup_or_try_init(&remote_frees, &stack_id, &initial_remote_free);
+	if (!remote)
+		return;
+
+	__sync_fetch_and_add(&remote->frees, info->weight);
+	if (info->cpu != bpf_get_smp_processor_id())
+		__sync_fetch_and_add(&remote->remote_cpu, info->weight);
+	if (info->tid != tid)
+		__sync_fetch_and_add(&remote->remote_thread, info->weight);
+}
+
+static void emit_free_event(const struct alloc_info *info)
+{
+	struct free_event *event;
+
+	event = bpf_ringbuf_reserve(&free_events, sizeof(*event), 0);
+	if (!event) {
+		stat_inc(MEMLEAK_STAT_FREE_EVENTS_DROPPED);
+
+		return;
+	}
+
+	event->size = info->size;
+	event->alloc_ns = info->timestamp_ns;
+	event->free_ns = bpf_ktime_get_ns();
+	event->stack_id = info->stack_id;
+	event->weight = info->weight;
+
+	bpf_ringbuf_submit(event, 0);
+}
+
+static __always_inline u64 get_thread_pointer(void)
+{
+	struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+
+#if defined(__TARGET_ARCH_x86)
+	return BPF_CORE_READ(task, thread.fsbase);
+#elif defined(__TARGET_ARCH_arm64)
+	return BPF_CORE_READ(task, thread.uw.tp_value);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Reads the tag variable of the allocating thread. For a thread-local
+ * variable tag_addr is its offset from the thread pointer.
+ */
+static __always_inline u64 read_alloc_tag(void)
+{
+	u64 addr = tag_addr, tag = 0;
+
+	if (tag_tls)
+		addr += get_thread_pointer();
+
+	bpf_probe_read_user(&tag, sizeof(tag), (void *)addr);
+
+	return tag;
+}
+
+static int gen_alloc_enter(size_t size, bool kernel)
+{
+	u64 min = min_size, max = max_size, rate = sample_rate;
+	u32 sid;
+
+	/* followed and pid namespace uprobes are attached to all processes */
+	if (!get_session(kernel, &sid))
+		return 0;
+
+	stat_inc(MEMLEAK_STAT_ALLOC_EVENTS);
+
+	if (free_only)
+		return 0;
+
+	if (multi_session) {
+		const struct session_config *config;
+
+		config = bpf_map_lookup_elem(&session_configs, &sid);
+		if (!config)
 			return 0;
+
+		min = config->min_size;
+		max = config->max_size;
+		rate = config->sample_rate;
 	}
 
-	const pid_t pid = bpf_get_current_pid_tgid() >> 32;
+	/* with --usdt-window only allocations inside a window are tracked */
+	if (windows_enabled) {
+		const u32 tid = (u32)bpf_get_current_pid_tgid();
+
+		if (!bpf_map_lookup_elem(&active_windows, &tid))
+			return 0;
+	}
+
+	if (size < min || size > max)
+		return 0;
+
+	/* allocations big enough to alert on are never sampled out */
+	if (rate > 1 && !(alert_size && size >= alert_size)) {
+		if (bpf_ktime_get_ns() % rate != 0)
+			return 0;
+	}
+
+	const pid_t pid = sizes_key(kernel);
 	bpf_map_update_elem(&sizes, &pid, &size, BPF_ANY);
 
 	if (trace_all)
@@ -105,10 +607,13 @@ static int gen_alloc_enter(size_t size)
 	return 0;
 }
 
-static int gen_alloc_exit2(void *ctx, u64 address)
+static int gen_alloc_exit3(void *ctx, u64 address, const struct realloc_origin *origin,
+			   bool kernel)
 {
-	const pid_t pid = bpf_get_current_pid_tgid() >> 32;
+	const pid_t pid = sizes_key(kernel);
 	struct alloc_info info;
+	u64 key, stack_key;
+	u32 sid;
 
 	const u64* size = bpf_map_lookup_elem(&sizes, &pid);
 	if (!size)
@@ -119,14 +624,65 @@ static int gen_alloc_exit2(void *ctx, u64 address)
 	info.size = *size;
 	bpf_map_delete_elem(&sizes, &pid);
 
-	if (address != 0) {
+	if (address != 0 && get_session(kernel, &sid)) {
+		info.session = sid;
+		info.pid = bpf_get_current_pid_tgid() >> 32;
 		info.timestamp_ns = bpf_ktime_get_ns();
+		info.tid = (u32)bpf_get_current_pid_tgid();
+		info.cpu = bpf_get_smp_processor_id();
+
+		if (tag_enabled)
+			info.tag = read_alloc_tag();
+
+		if (windows_enabled) {
+			const u64 *window_id = bpf_map_lookup_elem(&active_windows, &info.tid);
+
+			/* the window ended while the allocator ran */
+			if (!window_id)
+				return 0;
+
+			info.window_id = *window_id;
+		}
+
+		if (alert_size && info.size >= alert_size)
+			emit_alert(ctx, address, &info);
+
+		key = session_alloc_key(address, sid, kernel);
+
+		/* the uretprobe's registers are the ones of the caller */
+		if (dwarf_unwind && !kernel && emit_unwind_event(ctx, key, &info)) {
+			info.stack_id = UNWIND_STACK_ID;
+		} else {
+			info.stack_id = bpf_get_stackid(ctx, &stack_traces,
+					multi_session ? (kernel ? 0 : BPF_F_USER_STACK) : stack_flags);
+			if (info.stack_id < 0)
+				stat_inc(MEMLEAK_STAT_STACK_ERRORS);
+		}
+
+		stack_key = session_stack_key(info.stack_id, sid);
+
+		if (origin && info.stack_id >= 0) {
+			info.realloc_hops = origin->hops + 1;
+			update_realloc_chain(info.stack_id, origin, address, info.size);
+		}
 
-		info.stack_id = bpf_get_stackid(ctx, &stack_traces, stack_flags);
+		if (free_stacks_enabled && info.stack_id >= 0) {
+			const u64 stack_id = info.stack_id;
 
-		bpf_map_update_elem(&allocs, &address, &info, BPF_ANY);
+			info.targeted = bpf_map_lookup_elem(&target_stacks, &stack_id) != NULL;
+		}
 
-		update_statistics_add(info.stack_id, info.size);
+		info.weight = 1;
+		if (stack_budget && info.stack_id >= 0 &&
+		    !stack_budget_admit(stack_key, &info.weight))
+			return 0;
+
+		if (bpf_map_update_elem(&allocs, &key, &info, BPF_ANY))
+			stat_inc(MEMLEAK_STAT_ALLOCS_DROPPED);
+
+		/* unwound stacks are only told apart in userspace */
+		if (info.stack_id != UNWIND_STACK_ID)
+			update_statistics_add(stack_key, info.size, info.weight);
 	}
 
 	if (trace_all) {
@@ -137,34 +693,96 @@ static int gen_alloc_exit2(void *ctx, u64 address)
 	return 0;
 }
 
+static int gen_alloc_exit2(void *ctx, u64 address, bool kernel)
+{
+	return gen_alloc_exit3(ctx, address, NULL, kernel);
+}
+
 static int gen_alloc_exit(struct pt_regs *ctx)
 {
-	return gen_alloc_exit2(ctx, PT_REGS_RC(ctx));
+	return gen_alloc_exit2(ctx, PT_REGS_RC(ctx), false);
 }
 
-static int gen_free_enter(const void *address)
+static int gen_free_enter(void *ctx, const void *address, bool kernel)
 {
 	const u64 addr = (u64)address;
+	u64 key;
+	u32 sid;
+
+	if (!get_session(kernel, &sid))
+		return 0;
+
+	stat_inc(MEMLEAK_STAT_FREE_EVENTS);
 
-	const struct alloc_info *info = bpf_map_lookup_elem(&allocs, &addr);
-	if (!info)
+	key = session_alloc_key(addr, sid, kernel);
+
+	/* the range is the one of the keys of the tracked allocations */
+	if (free_only && (key < free_addr_min || key > free_addr_max))
+		return 0;
+
+	const struct alloc_info *found = bpf_map_lookup_elem(&allocs, &key);
+	if (!found)
 		return 0;
 
-	bpf_map_delete_elem(&allocs, &addr);
-	update_statistics_del(info->stack_id, info->size);
+	/* the element may be reused by another cpu once deleted */
+	struct alloc_info info = *found;
+
+	bpf_map_delete_elem(&allocs, &key);
+	if (info.stack_id != UNWIND_STACK_ID)
+		update_statistics_del(session_stack_key(info.stack_id, sid), info.size, info.weight);
+
+	/* only frees of targeted allocations pay for the stack walk */
+	if (info.targeted)
+		record_free_pair(ctx, &info);
+
+	if (cohorts_enabled && info.stack_id >= 0)
+		emit_free_event(&info);
+
+	if (remote_frees_enabled && info.stack_id >= 0)
+		update_remote_frees(&info);
+
+	if (stack_budget && info.stack_id >= 0)
+		stack_budget_release(session_stack_key(info.stack_id, sid));
 
 	if (trace_all) {
 		bpf_printk("free entered, address = %lx, size = %lu\n",
-				address, info->size);
+				address, info.size);
 	}
 
 	return 0;
 }
 
+/*
+ * Application-defined leak check windows. A window covers the allocations
+ * of the thread that began it until it ends; a nested begin replaces the
+ * window of the thread.
+ */
+SEC("usdt")
+int BPF_USDT(window_begin, u64 window_id)
+{
+	const u32 tid = (u32)bpf_get_current_pid_tgid();
+
+	bpf_map_update_elem(&active_windows, &tid, &window_id, BPF_ANY);
+
+	return 0;
+}
+
+SEC("usdt")
+int BPF_USDT(window_end, u64 window_id)
+{
+	const u32 tid = (u32)bpf_get_current_pid_tgid();
+	const u64 ts = bpf_ktime_get_ns();
+
+	bpf_map_delete_elem(&active_windows, &tid);
+	bpf_map_update_elem(&window_ends, &window_id, &ts, BPF_ANY);
+
+	return 0;
+}
+
 SEC("uprobe")
 int BPF_KPROBE(malloc_enter, size_t size)
 {
-	return gen_alloc_enter(size);
+	return gen_alloc_enter(size, false);
 }
 
 SEC("uretprobe")
@@ -176,13 +794,13 @@ int BPF_KRETPROBE(malloc_exit)
 SEC("uprobe")
 int BPF_KPROBE(free_enter, void *address)
 {
-	return gen_free_enter(address);
+	return gen_free_enter(ctx, address, false);
 }
 
 SEC("uprobe")
 int BPF_KPROBE(calloc_enter, size_t nmemb, size_t size)
 {
-	return gen_alloc_enter(nmemb * size);
+	return gen_alloc_enter(nmemb * size, false);
 }
 
 SEC("uretprobe")
@@ -194,21 +812,53 @@ int BPF_KRETPROBE(calloc_exit)
 SEC("uprobe")
 int BPF_KPROBE(realloc_enter, void *ptr, size_t size)
 {
-	gen_free_enter(ptr);
+	/* remember the tracked allocation being resized before freeing it */
+	if (realloc_chains_enabled && !free_only && ptr) {
+		const u64 key = session_alloc_key((u64)ptr, 0, false);
+		const struct alloc_info *info = bpf_map_lookup_elem(&allocs, &key);
+
+		if (info) {
+			const u32 tid = (u32)bpf_get_current_pid_tgid();
+			struct realloc_origin origin = {
+				/* compared with the plain address realloc returns */
+				.address = (u64)ptr,
+				.size = info->size,
+				.hops = info->realloc_hops,
+			};
+
+			bpf_map_update_elem(&realloc_origins, &tid, &origin, BPF_ANY);
+		}
+	}
 
-	return gen_alloc_enter(size);
+	gen_free_enter(ctx, ptr, false);
+
+	return gen_alloc_enter(size, false);
 }
 
 SEC("uretprobe")
 int BPF_KRETPROBE(realloc_exit)
 {
+	struct realloc_origin origin;
+
+	if (realloc_chains_enabled) {
+		const u32 tid = (u32)bpf_get_current_pid_tgid();
+		const struct realloc_origin *found = bpf_map_lookup_elem(&realloc_origins, &tid);
+
+		if (found) {
+			origin = *found;
+			bpf_map_delete_elem(&realloc_origins, &tid);
+
+			return gen_alloc_exit3(ctx, PT_REGS_RC(ctx), &origin, false);
+		}
+	}
+
 	return gen_alloc_exit(ctx);
 }
 
 SEC("uprobe")
 int BPF_KPROBE(mmap_enter, void *address, size_t size)
 {
-	return gen_alloc_enter(size);
+	return gen_alloc_enter(size, false);
 }
 
 SEC("uretprobe")
@@ -220,7 +870,7 @@ int BPF_KRETPROBE(mmap_exit)
 SEC("uprobe")
 int BPF_KPROBE(munmap_enter, void *address)
 {
-	return gen_free_enter(address);
+	return gen_free_enter(ctx, address, false);
 }
 
 SEC("uprobe")
@@ -230,7 +880,7 @@ int BPF_KPROBE(posix_memalign_enter, void **memptr, size_t alignment, size_t siz
 	const u64 pid = bpf_get_current_pid_tgid() >> 32;
 	bpf_map_update_elem(&memptrs, &pid, &memptr64, BPF_ANY);
 
-	return gen_alloc_enter(size);
+	return gen_alloc_enter(size, false);
 }
 
 SEC("uretprobe")
@@ -251,13 +901,13 @@ int BPF_KRETPROBE(posix_memalign_exit)
 
 	const u64 addr64 = (u64)(size_t)addr;
 
-	return gen_alloc_exit2(ctx, addr64);
+	return gen_alloc_exit2(ctx, addr64, false);
 }
 
 SEC("uprobe")
 int BPF_KPROBE(aligned_alloc_enter, size_t alignment, size_t size)
 {
-	return gen_alloc_enter(size);
+	return gen_alloc_enter(size, false);
 }
 
 SEC("uretprobe")
@@ -269,7 +919,7 @@ int BPF_KRETPROBE(aligned_alloc_exit)
 SEC("uprobe")
 int BPF_KPROBE(valloc_enter, size_t size)
 {
-	return gen_alloc_enter(size);
+	return gen_alloc_enter(size, false);
 }
 
 SEC("uretprobe")
@@ -281,7 +931,7 @@ int BPF_KRETPROBE(valloc_exit)
 SEC("uprobe")
 int BPF_KPROBE(memalign_enter, size_t alignment, size_t size)
 {
-	return gen_alloc_enter(size);
+	return gen_alloc_enter(size, false);
 }
 
 SEC("uretprobe")
@@ -293,7 +943,7 @@ int BPF_KRETPROBE(memalign_exit)
 SEC("uprobe")
 int BPF_KPROBE(pvalloc_enter, size_t size)
 {
-	return gen_alloc_enter(size);
+	return gen_alloc_enter(size, false);
 }
 
 SEC("uretprobe")
@@ -302,6 +952,76 @@ int BPF_KRETPROBE(pvalloc_exit)
 	return gen_alloc_exit(ctx);
 }
 
+static void emit_follow_event(u32 type, u32 pid, u32 ppid)
+{
+	struct follow_event *event;
+
+	event = bpf_ringbuf_reserve(&follow_events, sizeof(*event), 0);
+	if (!event)
+		return;
+
+	event->type = type;
+	event->pid = pid;
+	event->ppid = ppid;
+
+	bpf_ringbuf_submit(event, 0);
+}
+
+/* new processes forked by a traced one join its session */
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(memleak__sched_process_fork, struct task_struct *parent, struct task_struct *child)
+{
+	const u32 parent_tgid = parent->tgid;
+	const u32 child_tgid = child->tgid;
+	const u32 *sid;
+
+	/* a new thread of the same process */
+	if (child->pid != child_tgid)
+		return 0;
+
+	sid = bpf_map_lookup_elem(&session_pids, &parent_tgid);
+	if (!sid)
+		return 0;
+
+	if (!bpf_map_update_elem(&session_pids, &child_tgid, sid, BPF_NOEXIST))
+		emit_follow_event(FOLLOW_FORK, child_tgid, parent_tgid);
+
+	return 0;
+}
+
+/* so do processes exec'ing the followed executable */
+SEC("tp_btf/sched_process_exec")
+int BPF_PROG(memleak__sched_process_exec, struct task_struct *p, pid_t old_pid,
+	     struct linux_binprm *bprm)
+{
+	const struct inode *inode = BPF_CORE_READ(bprm, file, f_inode);
+	const u32 tgid = p->tgid;
+	const u32 sid = 0;
+
+	if (BPF_CORE_READ(inode, i_ino) != follow_exe_ino ||
+	    BPF_CORE_READ(inode, i_sb, s_dev) != follow_exe_dev)
+		return 0;
+
+	if (!bpf_map_update_elem(&session_pids, &tgid, &sid, BPF_NOEXIST))
+		emit_follow_event(FOLLOW_EXEC, tgid, BPF_CORE_READ(p, real_parent, tgid));
+
+	return 0;
+}
+
+SEC("tp_btf/sched_process_exit")
+int BPF_PROG(memleak__sched_process_exit, struct task_struct *p)
+{
+	const u32 tgid = p->tgid;
+
+	if (p->pid != tgid)
+		return 0;
+
+	if (!bpf_map_delete_elem(&session_pids, &tgid))
+		emit_follow_event(FOLLOW_EXIT, tgid, 0);
+
+	return 0;
+}
+
 /**
  * commit 11e9734bcb6a("mm/slab_common: unify NUMA and UMA version of
  * tracepoints") drops kmem_alloc event class, rename kmem_alloc_node to
@@ -369,11 +1089,11 @@ int memleak__kmalloc(void *ctx)
 	}
 
 	if (wa_missing_free)
-		gen_free_enter(ptr);
+		gen_free_enter(ctx, ptr, true);
 
-	gen_alloc_enter(bytes_alloc);
+	gen_alloc_enter(bytes_alloc, true);
 
-	return gen_alloc_exit2(ctx, (u64)ptr);
+	return gen_alloc_exit2(ctx, (u64)ptr, true);
 }
 
 SEC("tracepoint/kmem/kmalloc_node")
@@ -388,11 +1108,11 @@ int memleak__kmalloc_node(void *ctx)
 		bytes_alloc = BPF_CORE_READ(args, bytes_alloc);
 
 		if (wa_missing_free)
-			gen_free_enter(ptr);
+			gen_free_enter(ctx, ptr, true);
 
-		gen_alloc_enter( bytes_alloc);
+		gen_alloc_enter( bytes_alloc, true);
 
-		return gen_alloc_exit2(ctx, (u64)ptr);
+		return gen_alloc_exit2(ctx, (u64)ptr, true);
 	} else {
 		/* tracepoint is disabled if not exist, avoid compile warning */
 		return 0;
@@ -412,7 +1132,7 @@ int memleak__kfree(void *ctx)
 		ptr = BPF_CORE_READ(args, ptr);
 	}
 
-	return gen_free_enter(ptr);
+	return gen_free_enter(ctx, ptr, true);
 }
 
 SEC("tracepoint/kmem/kmem_cache_alloc")
@@ -432,11 +1152,11 @@ int memleak__kmem_cache_alloc(void *ctx)
 	}
 
 	if (wa_missing_free)
-		gen_free_enter(ptr);
+		gen_free_enter(ctx, ptr, true);
 
-	gen_alloc_enter(bytes_alloc);
+	gen_alloc_enter(bytes_alloc, true);
 
-	return gen_alloc_exit2(ctx, (u64)ptr);
+	return gen_alloc_exit2(ctx, (u64)ptr, true);
 }
 
 SEC("tracepoint/kmem/kmem_cache_alloc_node")
@@ -451,11 +1171,11 @@ int memleak__kmem_cache_alloc_node(void *ctx)
 		bytes_alloc = BPF_CORE_READ(args, bytes_alloc);
 
 		if (wa_missing_free)
-			gen_free_enter(ptr);
+			gen_free_enter(ctx, ptr, true);
 
-		gen_alloc_enter(bytes_alloc);
+		gen_alloc_enter(bytes_alloc, true);
 
-		return gen_alloc_exit2(ctx, (u64)ptr);
+		return gen_alloc_exit2(ctx, (u64)ptr, true);
 	} else {
 		/* tracepoint is disabled if not exist, avoid compile warning */
 		return 0;
@@ -475,35 +1195,35 @@ int memleak__kmem_cache_free(void *ctx)
 		ptr = BPF_CORE_READ(args, ptr);
 	}
 
-	return gen_free_enter(ptr);
+	return gen_free_enter(ctx, ptr, true);
 }
 
 SEC("tracepoint/kmem/mm_page_alloc")
 int memleak__mm_page_alloc(struct trace_event_raw_mm_page_alloc *ctx)
 {
-	gen_alloc_enter(page_size << ctx->order);
+	gen_alloc_enter(page_size << ctx->order, true);
 
-	return gen_alloc_exit2(ctx, ctx->pfn);
+	return gen_alloc_exit2(ctx, ctx->pfn, true);
 }
 
 SEC("tracepoint/kmem/mm_page_free")
 int memleak__mm_page_free(struct trace_event_raw_mm_page_free *ctx)
 {
-	return gen_free_enter((void *)ctx->pfn);
+	return gen_free_enter(ctx, (void *)ctx->pfn, true);
 }
 
 SEC("tracepoint/percpu/percpu_alloc_percpu")
 int memleak__percpu_alloc_percpu(struct trace_event_raw_percpu_alloc_percpu *ctx)
 {
-	gen_alloc_enter(ctx->bytes_alloc);
+	gen_alloc_enter(ctx->bytes_alloc, true);
 
-	return gen_alloc_exit2(ctx, (u64)(ctx->ptr));
+	return gen_alloc_exit2(ctx, (u64)(ctx->ptr), true);
 }
 
 SEC("tracepoint/percpu/percpu_free_percpu")
 int memleak__percpu_free_percpu(struct trace_event_raw_percpu_free_percpu *ctx)
 {
-	return gen_free_enter(ctx->ptr);
+	return gen_free_enter(ctx, ctx->ptr, true);
 }
 
 char LICENSE[] SEC("license") = "GPL";
\ No newline at end of file
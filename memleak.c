@@ -5,13 +5,18 @@
 // 1-Mar-2023   JP Kobryn   Created this.
 #include <argp.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
 #include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -24,6 +29,8 @@
 #include "memleak.skel.h"
 
 #include "blazesym.h"
+#include "trace_helpers.h"
+#include "uprobe_helpers.h"
 
 static struct env {
 	int interval;
@@ -47,6 +54,57 @@ static struct env {
 	bool kernel_trace;
 	bool verbose;
 	char command[32];
+
+	uint64_t max_event_rate;
+	uint64_t max_bpf_runtime_ms;
+	int breaker_hold;
+	int breaker_cooldown;
+	bool health;
+
+	int capture_window;
+	int observe_period;
+
+	uint64_t stack_budget;
+
+	uint64_t alert_size;
+	bool ndjson;
+
+	bool show_threads;
+	char thread_filter[32];
+
+	char tag_symbol[64];
+	uint64_t tag_addr;
+	bool tag_tls;
+
+	char window_obj[128];
+	char window_provider[32];
+	char window_begin[64];
+	char window_end[64];
+	int window_grace;
+
+	char free_stacks[128];
+
+	bool realloc_chains;
+
+	int cohort_window_ms;
+
+	char size_classes[16];
+
+	bool remote_frees;
+
+	bool kernel_session;
+
+	bool follow_children;
+	char follow_exe[PATH_MAX];
+
+	char pidns[PATH_MAX];
+
+	char symbolizer[16];
+	char symbol_cache[PATH_MAX];
+	char demangle[8];
+
+	bool dwarf_unwind;
+	uint64_t unwind_sample;
 } env = {
 	.interval = 5, // posarg 1
 	.nr_intervals = -1, // posarg 2
@@ -66,27 +124,176 @@ static struct env {
 	.stack_map_max_entries = 10240,
 	.page_size = 1,
 	.kernel_trace = true,
-	.verbose = false,
+	.verbose = false, // -v --verbose
 	.command = {0}, // -c --command
+	.max_event_rate = 0, // --max-event-rate
+	.max_bpf_runtime_ms = 0, // --max-bpf-runtime
+	.breaker_hold = 3, // --breaker-hold
+	.breaker_cooldown = 30, // --breaker-cooldown
+	.health = false, // --health
+	.capture_window = 0, // --capture-window
+	.observe_period = 600, // --observe
+	.stack_budget = 0, // --stack-budget
+	.alert_size = 0, // --alert-size
+	.ndjson = false, // --ndjson
+	.show_threads = false, // --threads
+	.thread_filter = {0}, // --thread
+	.tag_symbol = {0}, // --tag
+	.window_provider = {0}, // --usdt-window
+	.window_grace = 10, // --window-grace
+	.free_stacks = {0}, // --free-stacks
+	.realloc_chains = false, // --realloc-chains
+	.cohort_window_ms = 0, // --cohorts
+	.size_classes = {0}, // --size-classes
+	.remote_frees = false, // --remote-frees
+	.follow_children = false, // --follow-children
+	.follow_exe = {0}, // --follow-exe
+	.pidns = {0}, // --pidns
+	.symbolizer = {0}, // --symbolizer
+	.symbol_cache = {0}, // --symbol-cache
+	.demangle = {0}, // --demangle
+	.dwarf_unwind = false, // --dwarf-unwind
+	.unwind_sample = 1, // --unwind-sample
 };
 
+// overload circuit breaker state, advanced once per second by the main loop
+static struct breaker {
+	bool tripped;
+	int over_secs;
+	int cooldown_left;
+	uint64_t last_events;
+	uint64_t last_runtime_ns;
+	unsigned long long last_ns;
+
+	uint64_t trips;
+	uint64_t detached_secs;
+} breaker;
+
+// an independent target traced by the same bpf object, see --session;
+// session 0 is the one set up by -p, -c or kernel mode
+#define MAX_SESSION_LINKS 32
+static struct session {
+	pid_t pid; // -1 for the kernel
+	struct session_config config;
+	sym_src_cfg src_cfg;
+	struct bpf_link *links[MAX_SESSION_LINKS];
+	size_t nr_links;
+} sessions[MAX_SESSIONS];
+static size_t nr_sessions = 1;
+
+// duty-cycled mode state: a capture window with all probes attached followed
+// by an observation period where only frees are traced
+static struct duty_cycle {
+	bool free_only;
+	int phase_left;
+} duty;
+
 struct allocation_node {
 	uint64_t address;
 	size_t size;
+	pid_t tid;
 	struct allocation_node* next;
 };
 
+struct realloc_chain {
+	uint64_t stack_id;
+	struct realloc_chain_info info;
+};
+
+struct remote_free {
+	uint64_t stack_id;
+	struct remote_free_info info;
+};
+
 struct allocation {
 	uint64_t stack_id;
 	size_t size;
 	size_t count;
+	pid_t pid; // the first process seen with the stack, to symbolize it
 	struct allocation_node* allocations;
 };
 
+// an object mapped by processes of another mount namespace, shared by all of
+// them through the /proc/<pid>/root of one, so blazesym parses it only once
+struct ns_object {
+	uint64_t mntns;
+	uint64_t dev;
+	uint64_t ino;
+	pid_t pid;
+	struct ns_object *next;
+	char path[PATH_MAX];
+};
+
+// the symbol sources of a process of another mount namespace, its objects
+struct ns_process {
+	pid_t pid;
+	sym_src_cfg *cfgs;
+	size_t nr_cfgs;
+};
+
+// allocating thread, with its name cached across reports
+struct thread {
+	bool used;
+	bool matched; // by --thread
+	pid_t tid;
+	char comm[16];
+	size_t size;
+	size_t count;
+};
+
+// outstanding bytes and allocations rolled up by an arbitrary key
+struct usage {
+	uint64_t key;
+	size_t size;
+	size_t count;
+};
+
+// open addressing table of struct usage, a zero count marks a free slot
+struct usage_table {
+	struct usage *entries;
+	size_t cap;
+	size_t nr;
+};
+
 #ifndef NSEC_PER_SEC
 #define NSEC_PER_SEC 1000000000L
 #endif
 
+// keys for options that only have a long form
+enum {
+	OPT_MAX_EVENT_RATE = 0x100,
+	OPT_MAX_BPF_RUNTIME,
+	OPT_BREAKER_HOLD,
+	OPT_BREAKER_COOLDOWN,
+	OPT_HEALTH,
+	OPT_CAPTURE_WINDOW,
+	OPT_OBSERVE,
+	OPT_STACK_BUDGET,
+	OPT_ALERT_SIZE,
+	OPT_NDJSON,
+	OPT_THREADS,
+	OPT_THREAD,
+	OPT_TAG,
+	OPT_USDT_WINDOW,
+	OPT_WINDOW_GRACE,
+	OPT_FREE_STACKS,
+	OPT_REALLOC_CHAINS,
+	OPT_COHORTS,
+	OPT_SIZE_CLASSES,
+	OPT_REMOTE_FREES,
+	OPT_SESSION,
+	OPT_FOLLOW_CHILDREN,
+	OPT_FOLLOW_EXE,
+	OPT_PIDNS,
+	OPT_SYMBOLIZER,
+	OPT_SYMBOL_CACHE,
+	OPT_DEMANGLE,
+	OPT_DWARF_UNWIND,
+	OPT_UNWIND_SAMPLE,
+};
+
+#define ROUND_UP(x, align) (((x) + (align) - 1) / (align) * (align))
+
 #define __ATTACH_UPROBE(skel, sym_name, prog_name, is_retprobe) \
 	do { \
 		LIBBPF_OPTS(bpf_uprobe_opts, uprobe_opts, \
@@ -94,8 +301,8 @@ struct allocation {
 				.retprobe = is_retprobe); \
 		skel->links.prog_name = bpf_program__attach_uprobe_opts( \
 				skel->progs.prog_name, \
-				env.pid, \
-				env.object, \
+				many_processes() ? -1 : env.pid, \
+				object_path, \
 				0, \
 				&uprobe_opts); \
 	} while (false)
@@ -120,6 +327,12 @@ struct allocation {
 #define ATTACH_UPROBE_CHECKED(skel, sym_name, prog_name) __ATTACH_UPROBE_CHECKED(skel, sym_name, prog_name, false)
 #define ATTACH_URETPROBE_CHECKED(skel, sym_name, prog_name) __ATTACH_UPROBE_CHECKED(skel, sym_name, prog_name, true)
 
+#define DETACH_PROBE(skel, prog_name) \
+	do { \
+		bpf_link__destroy(skel->links.prog_name); \
+		skel->links.prog_name = NULL; \
+	} while (false)
+
 static void sig_handler(int signo);
 
 static long argp_parse_long(int key, const char *arg, struct argp_state *state);
@@ -137,16 +350,122 @@ static void print_stack_frame_by_blazesym(size_t frame, uint64_t addr, const bla
 static void print_stack_frames_by_blazesym();
 static int print_stack_frames(struct allocation *allocs, size_t nr_allocs, int stack_traces_fd);
 
+static const struct syms *native_syms(void);
+static const char *native_symbolize(const struct syms *syms, uint64_t addr, unsigned long *offset,
+		const char **dso_name);
+static void print_stack_frames_by_native();
+
+static void print_json_string(const char *str);
+static const char *demangle(const char *name);
+static char *shorten_templates(const char *name);
+static void free_demangled_names(void);
+static void print_stack_frames_json_by_blazesym(size_t nr_frames);
+static void print_stack_frames_json_by_native(size_t nr_frames);
+static int handle_alert(void *ctx, void *data, size_t data_sz);
+static void wait_tick(void);
+
 static int alloc_size_compare(const void *a, const void *b);
 
-static int print_outstanding_allocs(int allocs_fd, int stack_traces_fd);
-static int print_outstanding_combined_allocs(int combined_allocs_fd, int stack_traces_fd);
+static struct thread *get_thread(pid_t pid, pid_t tid);
+static int thread_size_compare(const void *a, const void *b);
+static int print_threads(void);
+
+static int usage_add(struct usage_table *table, uint64_t key, size_t size, size_t count);
+static int usage_size_compare(const void *a, const void *b);
+static size_t usage_sort(struct usage_table *table);
+static void usage_clear(struct usage_table *table);
+static struct usage *usage_find(struct usage_table *table, uint64_t key);
+static int usage_decay(struct usage_table *table, int shift);
+
+static int resolve_tag(void);
+static void print_tags(void);
+
+static int parse_usdt_window(const char *arg);
+static int attach_window_usdts(struct memleak_bpf *skel);
+static bool window_expired(int window_ends_fd, const struct alloc_info *alloc_info);
+static void print_windows(void);
+
+static int setup_free_stacks(struct memleak_bpf *skel);
+static int target_stack(struct memleak_bpf *skel, uint64_t stack_id);
+static bool stack_matches_free_stack_syms(void);
+static int update_free_stack_targets(struct memleak_bpf *skel);
+static int print_free_pairs(struct memleak_bpf *skel);
+
+static int realloc_chain_compare(const void *a, const void *b);
+static int print_realloc_chains(struct memleak_bpf *skel);
+
+static int remote_free_compare(const void *a, const void *b);
+static int print_remote_frees(struct memleak_bpf *skel);
+
+static int parse_session(char *arg);
+static int setup_sessions(struct memleak_bpf *skel);
+static int attach_session_uprobes(struct memleak_bpf *skel, struct session *session);
+static void detach_session_uprobes(struct session *session);
+
+static bool following(void);
+static uint64_t alloc_key_address(uint64_t key, const struct alloc_info *alloc_info);
+static int follow_exe_processes(struct memleak_bpf *skel, const struct stat *exe);
+static int setup_follow(struct memleak_bpf *skel, struct stat *exe);
+static int exited_process_compare(const void *a, const void *b);
+static int drop_exited_allocs(int allocs_fd);
+static int handle_follow_event(void *ctx, void *data, size_t data_sz);
+
+static bool many_processes(void);
+static uint64_t mount_ns(pid_t pid);
+static int resolve_object(pid_t pid, char *path, size_t path_sz);
+static pid_t ns_pid(pid_t pid);
+static pid_t pidns_host_pid(pid_t target);
+static int setup_pidns(void);
+static struct ns_object *get_ns_object(pid_t pid, uint64_t mntns, uint64_t dev, uint64_t ino,
+		const char *path);
+static struct ns_process *get_ns_process(pid_t pid);
+static void clear_ns_processes(void);
+static void use_symbol_source(const sym_src_cfg *cfg);
+
+static int add_ring_buffer(int map_fd, ring_buffer_sample_fn sample_cb, void *ctx);
+static int handle_free_event(void *ctx, void *data, size_t data_sz);
+static int print_cohorts(struct memleak_bpf *skel);
+
+static size_t glibc_size_class(size_t size);
+static size_t tcmalloc_size_class(size_t size);
+static size_t jemalloc_size_class(size_t size);
+static int add_size_class(uint64_t stack_id, size_t size, size_t weight);
+static void print_stack_size_classes(uint64_t stack_id);
+static void print_size_classes(void);
+
+static int intern_unwound_stack(pid_t pid, const unsigned long *frames, size_t nr_frames, uint32_t *index);
+static int add_unwound_alloc(uint64_t key, uint64_t timestamp_ns, uint32_t stack);
+static struct unwound_alloc *find_unwound_alloc(uint64_t key);
+static int prune_unwound_allocs(void);
+static int handle_unwind_event(void *ctx, void *data, size_t data_sz);
+static void print_unwind_cost(void);
+
+static int print_outstanding_allocs(int allocs_fd, int stack_traces_fd, int window_ends_fd, uint32_t sid);
+static int print_outstanding_combined_allocs(int combined_allocs_fd, int stack_traces_fd, uint32_t sid);
+static int print_outstanding(struct memleak_bpf *skel);
+
+static int read_stats(int stats_fd, uint64_t *counts);
+static uint64_t read_bpf_runtime_ns(struct memleak_bpf *skel);
+static void print_health(struct memleak_bpf *skel);
+
+static int clear_map(int fd);
+static int breaker_tick(struct memleak_bpf *skel);
+
+static size_t get_allocs_address_range(int allocs_fd, uint64_t *min, uint64_t *max);
+static void duty_cycle_reset(struct memleak_bpf *skel);
+static int duty_cycle_tick(struct memleak_bpf *skel);
+static int duty_cycle_restart(struct memleak_bpf *skel);
 
 static void disable_kernel_node_tracepoints(struct memleak_bpf *skel);
 static void disable_kernel_percpu_tracepoints(struct memleak_bpf *skel);
 static void disable_kernel_tracepoints(struct memleak_bpf *skel);
 
+static int attach_alloc_uprobes(struct memleak_bpf *skel);
+static int attach_free_uprobes(struct memleak_bpf *skel);
+static void detach_alloc_uprobes(struct memleak_bpf *skel);
 static int attach_uprobes(struct memleak_bpf *skel);
+static int attach_probes(struct memleak_bpf *skel);
+static void detach_probes(struct memleak_bpf *skel);
 
 const char *argp_program_version = "memleak 0.1";
 const char *argp_program_bug_address =
@@ -176,6 +495,70 @@ const char argp_args_doc[] =
 "        allocations that are at least one minute (60 seconds) old\n"
 "./memleak -s 5\n"
 "        Trace roughly every 5th allocation, to reduce overhead\n"
+"./memleak -p $(pidof allocs) --max-event-rate 1000000 --health\n"
+"        Detach the probes while the allocator is called more than a million\n"
+"        times per second for 3 seconds, re-attach them after a cool-down\n"
+"./memleak -p $(pidof allocs) --capture-window 60 --observe 3600\n"
+"        Trace allocations and frees for a minute, then only frees for an\n"
+"        hour, and report the allocations from that minute still outstanding\n"
+"./memleak -p $(pidof allocs) --stack-budget 1000\n"
+"        Track up to 1000 outstanding allocations per stack, then sample the\n"
+"        stack ever more sparsely and weight the samples in the report\n"
+"./memleak -p $(pidof allocs) --alert-size 104857600 --ndjson\n"
+"        Print every allocation of 100MiB or more with its stack as soon as\n"
+"        it happens, as one JSON object per line\n"
+"./memleak -p $(pidof allocs) --threads --thread 'worker-*'\n"
+"        Only report allocations made by threads named worker-*, and break\n"
+"        the outstanding allocations down by thread\n"
+"./memleak -p $(pidof server) --tag current_request_type\n"
+"        Tag every allocation with the value of the (thread-local) variable\n"
+"        current_request_type and break outstanding allocations down by tag\n"
+"./memleak -p $(pidof server) --usdt-window myapp:leakcheck_begin:leakcheck_end\n"
+"        Only track allocations made between the myapp:leakcheck_begin and\n"
+"        myapp:leakcheck_end probes and report those still outstanding 10\n"
+"        seconds after their window ended, by window ID\n"
+"./memleak -p $(pidof allocs) --free-stacks 'cache_insert*,4217'\n"
+"        Also capture the freeing stack of allocations from stacks through\n"
+"        cache_insert* and from stack id 4217 (shown by -v), and report\n"
+"        how often each alloc/free stack pair occurs\n"
+"./memleak -p $(pidof allocs) --realloc-chains\n"
+"        Follow objects through realloc and report the stacks whose growth\n"
+"        chains copy the most bytes, i.e. the buffers that should reserve()\n"
+"./memleak -p $(pidof allocs) --size-classes glibc\n"
+"        Map the outstanding allocations onto glibc malloc chunk sizes and\n"
+"        report the bytes lost to rounding and chunk headers per stack\n"
+"./memleak -p $(pidof server) --remote-frees\n"
+"        Rank stacks by how often their allocations are freed on another CPU\n"
+"        or by another thread than they were allocated on\n"
+"./memleak -p $(pidof a) -s 10 --session pid=$(pidof b),min-size=4096 --session kernel\n"
+"        Trace process a sampling every 10th allocation, allocations of at\n"
+"        least 4KiB in process b and kernel allocations, with one loaded bpf\n"
+"        object, and report each separately\n"
+"./memleak -c './server' --follow-children\n"
+"        Run server and also trace the processes it forks\n"
+"./memleak --follow-exe /usr/sbin/server\n"
+"        Trace all processes of /usr/sbin/server, including the ones started\n"
+"        after memleak, e.g. when the service restarts\n"
+"./memleak --pidns /proc/$(docker inspect -f '{{.State.Pid}}' app)/ns/pid\n"
+"        Trace every process of the pid namespace of the container app,\n"
+"        resolving its libc and symbols through the container's filesystem\n"
+"./memleak --pidns /proc/$(docker inspect -f '{{.State.Pid}}' app)/ns/pid -p 7\n"
+"        Trace the process with pid 7 inside the container app\n"
+"./memleak -p $(pidof allocs) --symbolizer native\n"
+"        Symbolize with the elf symbol tables of the process rather than\n"
+"        blazesym, which takes less memory but prints no source lines\n"
+"./memleak -p $(pidof allocs) --symbolizer native --symbol-cache /var/cache/memleak\n"
+"        Keep the symbol tables of the objects in /var/cache/memleak, so the\n"
+"        next runs map them rather than parsing the objects again\n"
+"./memleak -p $(pidof server) --demangle short\n"
+"        Print C++ functions without their template arguments, e.g.\n"
+"        std::vector<...>::_M_realloc_insert<...>(...)\n"
+"./memleak -p $(pidof server) --dwarf-unwind --unwind-sample 100\n"
+"        Unwind the stacks of every 100th allocation in userspace with the\n"
+"        .eh_frame of the objects, for code built without frame pointers\n"
+"./memleak -p $(pidof server) --cohorts 50\n"
+"        Find groups of stacks whose objects are allocated and freed within\n"
+"        50ms of each other, the candidates for a per-request arena\n"
 "";
 
 static const struct argp_option argp_options[] = {
@@ -193,6 +576,36 @@ static const struct argp_option argp_options[] = {
 	{"max-size", 'Z', "MAX_SIZE", 0, "capture only allocations smaller than this size"},
 	{"obj", 'O', "OBJECT", 0, "attach to allocator functions in the specified object"},
 	{"percpu", 'P', NULL, 0, "trace percpu allocations"},
+	{"verbose", 'v', NULL, 0, "verbose debug output, including stack ids"},
+	{"max-event-rate", OPT_MAX_EVENT_RATE, "RATE", 0, "detach probes while alloc/free events exceed this many per second"},
+	{"max-bpf-runtime", OPT_MAX_BPF_RUNTIME, "MS", 0, "detach probes while bpf programs run longer than this many milliseconds per second"},
+	{"breaker-hold", OPT_BREAKER_HOLD, "SECS", 0, "seconds a threshold must be exceeded before detaching (default 3)"},
+	{"breaker-cooldown", OPT_BREAKER_COOLDOWN, "SECS", 0, "seconds to stay detached before re-attaching (default 30)"},
+	{"health", OPT_HEALTH, NULL, 0, "print health counters after each report"},
+	{"capture-window", OPT_CAPTURE_WINDOW, "SECS", 0, "duty-cycled mode: trace allocations for this many seconds, then only frees"},
+	{"observe", OPT_OBSERVE, "SECS", 0, "duty-cycled mode: seconds to trace only frees before reporting (default 600)"},
+	{"stack-budget", OPT_STACK_BUDGET, "N", 0, "sample stacks with more than N outstanding tracked allocations"},
+	{"alert-size", OPT_ALERT_SIZE, "SIZE", 0, "print allocations of at least SIZE bytes with their stack immediately"},
+	{"ndjson", OPT_NDJSON, NULL, 0, "print alerts as newline-delimited json"},
+	{"threads", OPT_THREADS, NULL, 0, "show outstanding allocations per allocating thread"},
+	{"thread", OPT_THREAD, "TID|PATTERN", 0, "only report allocations from this thread id or thread name glob"},
+	{"tag", OPT_TAG, "SYMBOL", 0, "tag allocations with the 8-byte (thread-local) variable SYMBOL of the traced binary"},
+	{"usdt-window", OPT_USDT_WINDOW, "[BINARY:]PROVIDER:BEGIN:END", 0, "only track allocations inside the windows marked by these USDT probes, whose first argument is the window ID"},
+	{"window-grace", OPT_WINDOW_GRACE, "SECS", 0, "report window allocations outstanding this long after the window ended (default 10)"},
+	{"realloc-chains", OPT_REALLOC_CHAINS, NULL, 0, "follow objects through realloc and report the growth chains per stack"},
+	{"size-classes", OPT_SIZE_CLASSES, "ALLOCATOR", 0, "estimate internal fragmentation with the size classes of glibc, tcmalloc or jemalloc"},
+	{"remote-frees", OPT_REMOTE_FREES, NULL, 0, "report stacks by their rate of frees on another cpu or thread"},
+	{"session", OPT_SESSION, "pid=PID|kernel[,sample-rate=N][,min-size=N][,max-size=N]", 0, "also trace this target with its own filters, can be repeated"},
+	{"follow-children", OPT_FOLLOW_CHILDREN, NULL, 0, "also trace the processes forked by the traced ones"},
+	{"follow-exe", OPT_FOLLOW_EXE, "PATH", 0, "trace every process running the executable PATH, including future ones"},
+	{"pidns", OPT_PIDNS, "PATH", 0, "trace the processes of the pid namespace of the nsfs file PATH, -p is a pid inside of it"},
+	{"symbolizer", OPT_SYMBOLIZER, "native|blazesym", 0, "symbolize stacks with kallsyms and elf symbol tables, or with blazesym for source lines, inlined functions and containers (default native for kernel stacks)"},
+	{"symbol-cache", OPT_SYMBOL_CACHE, "DIR", 0, "keep the symbol tables of the native symbolizer in DIR, by build ID"},
+	{"demangle", OPT_DEMANGLE, "full|short|none", 0, "print C++ symbols demangled, demangled without template arguments, or as they are (default full)"},
+	{"dwarf-unwind", OPT_DWARF_UNWIND, NULL, 0, "unwind user stacks in userspace with .eh_frame rather than frame pointers (x86_64)"},
+	{"unwind-sample", OPT_UNWIND_SAMPLE, "N", 0, "with --dwarf-unwind, only unwind every N-th allocation, the others keep the frame pointer stack"},
+	{"cohorts", OPT_COHORTS, "MS", 0, "find stacks whose objects are allocated and freed together within MS milliseconds"},
+	{"free-stacks", OPT_FREE_STACKS, "ID|SYMBOL,...", 0, "capture the freeing stack of allocations from these stack ids or stacks through these symbols (globs)"},
 	{},
 };
 
@@ -204,29 +617,160 @@ static struct sigaction sig_action = {
 };
 
 static int child_exec_event_fd = -1;
+static int bpf_stats_fd = -1;
 
 static blazesym *symbolizer;
 static sym_src_cfg src_cfg;
+// what stacks are symbolized with: src_cfg, or the objects of a process of
+// another mount namespace
+static const sym_src_cfg *src_cfgs = &src_cfg;
+static size_t nr_src_cfgs = 1;
+
+// the mount namespace of memleak, processes of others need their own view
+static uint64_t self_mntns;
+static struct ns_object *ns_objects;
+// rebuilt for every report since processes map and unmap objects
+static struct ns_process *ns_processes;
+static size_t nr_ns_processes;
+
+// --pidns: the namespace file, and a process in the namespace
+static struct stat pidns_stat;
+static pid_t pidns_pid = -1;
+// the object uprobes attach to, resolved for the traced process
+static char object_path[PATH_MAX];
+
+// following: the processes exited since the last tick, their allocations
+// are dropped in one pass over the allocs map
+struct exited_process {
+	pid_t pid;
+	size_t nr_dropped;
+};
+
+static struct exited_process *exited_processes;
+static size_t nr_exited_processes;
+static size_t exited_processes_cap;
+
+// --symbolizer native: kallsyms, and the symbol tables of the objects of
+// each process, loaded on first use
+static bool native_symbols;
+static struct ksyms *ksyms;
+static struct syms_cache *syms_cache;
+
+// --demangle: C++ names are demangled on first sight and interned by the
+// mangled name, since the ones of blazesym don't outlive a stack
+struct demangled_name {
+	uint64_t hash;
+	char *mangled;
+	char *name;
+	struct demangled_name *next;
+};
+
+static struct demangled_name **demangled_names;
+static size_t nr_demangled_buckets;
+static size_t nr_demangled_names;
+
+extern char *__cxa_demangle(const char *mangled_name, char *output_buffer, size_t *length, int *status);
+
+// --dwarf-unwind: the stacks unwound from the copies of the bpf programs,
+// interned, and the stack of each unwound allocation by its key in the
+// allocs map. A report groups the allocations by the interned stacks.
+struct unwound_stack {
+	uint64_t hash;
+	pid_t pid;
+	size_t nr_frames;
+	uint64_t *frames;
+};
+
+struct unwound_alloc {
+	uint64_t key;
+	uint64_t timestamp_ns;
+	uint32_t stack;
+	uint32_t gen; // the last report it was seen by or unwound for, 0 if free
+};
+
+static struct unwound_stack *unwound_stacks;
+static size_t nr_unwound_stacks;
+static size_t unwound_stacks_cap;
+// open addressing index of unwound_stacks by hash, holding index + 1
+static uint32_t *unwound_stack_slots;
+static size_t unwound_stack_slots_cap;
+// open addressing table of the allocations
+static struct unwound_alloc *unwound_allocs;
+static size_t nr_unwound_allocs;
+static size_t unwound_allocs_cap;
+static uint32_t unwind_gen = 1;
+
+// what unwinding cost since the last report
+static struct unwind_cost {
+	uint64_t unwinds;
+	uint64_t ns;
+	uint64_t frames;
+	uint64_t stack_bytes;
+} unwind_cost;
+
 static void (*print_stack_frames_func)();
+static void (*print_stack_frames_json_func)(size_t nr_frames);
 
 static uint64_t *stack;
 
+static struct ring_buffer *events_rb;
+
 static struct allocation *allocs;
 
-static const char default_object[] = "libc.so.6";
+// open addressing table of allocating threads keyed by tid
+static struct thread *threads;
+static size_t threads_cap;
+static size_t nr_threads;
 
-unsigned long long get_ktime_ns(void)
-{
-	struct timespec ts;
+static struct usage_table tags;
+static struct usage_table windows;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
-}
+// --free-stacks symbol patterns, matched against stacks as they show up
+#define MAX_FREE_STACK_SYMS 16
+static char free_stack_syms[MAX_FREE_STACK_SYMS][64];
+static size_t nr_free_stack_syms;
+static uint8_t *scanned_stacks;
+static struct usage_table free_pairs;
+
+static struct realloc_chain *chains;
+
+static struct remote_free *remote_frees;
+
+// --cohorts: the last frees, a bounded sliding window over the free events
+#define COHORT_RECENT 256
+#define COHORT_MAX_PARTNERS 16
+// pairs of stacks are decayed rather than grown past this
+#define COHORT_MAX_PAIRS 4096
+// only this many of the strongest pairs are grouped into cohorts
+#define COHORT_MAX_GROUPED_PAIRS 64
+
+struct recent_free {
+	struct free_event event;
+	bool cofreed;
+};
+
+static struct recent_free recent_frees[COHORT_RECENT];
+static size_t nr_recent_frees;
+static size_t recent_frees_head;
+// key: both stack ids, lower one first, size: bytes, count: co-frees
+static struct usage_table cohort_pairs;
+// key: stack id, bytes and objects freed along with a cohort
+static struct usage_table cohort_stacks;
+
+// --size-classes: maps a requested size to the bytes the allocator uses
+static size_t (*size_class_func)(size_t size);
+// key: size class, size: bytes wasted, count: allocations
+static struct usage_table size_classes;
+// key: stack id << 32 | requested size, size: bytes wasted, count: allocations
+static struct usage_table stack_size_classes;
+
+static const char default_object[] = "libc.so.6";
 
 int main(int argc, char *argv[])
 {
 	int ret = 0;
 	struct memleak_bpf *skel = NULL;
+	struct stat follow_exe_stat;
 
 	static const struct argp argp = {
 		.options = argp_options,
@@ -263,9 +807,145 @@ int main(int argc, char *argv[])
 	env.page_size = sysconf(_SC_PAGE_SIZE);
 	printf("using page size: %ld\n", env.page_size);
 
-	env.kernel_trace = env.pid < 0 && !strlen(env.command);
+	env.kernel_trace = env.pid < 0 && !strlen(env.command) && !strlen(env.follow_exe) &&
+		!strlen(env.pidns);
 	printf("tracing kernel: %s\n", env.kernel_trace ? "true" : "false");
 
+	if (env.combined_only && (env.show_threads || strlen(env.thread_filter))) {
+		fprintf(stderr, "per-thread reporting is not available with combined statistics (-C)\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
+	if (strlen(env.tag_symbol) && (env.kernel_trace || env.combined_only)) {
+		fprintf(stderr, "tagging (--tag) needs a pid or command and per-allocation reports\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
+	if (following() && (env.kernel_trace || nr_sessions > 1)) {
+		fprintf(stderr, "following processes needs a pid, command or --follow-exe and no --session\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
+	// the allocations of exited processes are dropped from userspace,
+	// which doesn't undo what they add to the statistics by stack
+	if (following() && (env.combined_only || env.stack_budget)) {
+		fprintf(stderr, "following processes can't be combined with -C or --stack-budget\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
+	// the native backend has no source lines and inlined functions, which
+	// kernel stacks rarely need, and reads objects at the paths of the host
+	if (strlen(env.symbolizer))
+		native_symbols = !strcmp(env.symbolizer, "native");
+	else
+		native_symbols = env.kernel_trace && nr_sessions == 1;
+
+	if (native_symbols && strlen(env.pidns)) {
+		fprintf(stderr, "the native symbolizer can't read the objects of a pid namespace (--pidns)\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
+	if (env.unwind_sample > 1 && !env.dwarf_unwind) {
+		fprintf(stderr, "unwind sampling (--unwind-sample) needs --dwarf-unwind\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
+	if (env.dwarf_unwind) {
+#ifndef __x86_64__
+		fprintf(stderr, "dwarf unwinding (--dwarf-unwind) is only supported on x86_64\n");
+		ret = 1;
+
+		goto cleanup;
+#endif
+		// the reports by stack id only know the stacks of frame pointers
+		if (env.kernel_trace || env.combined_only || nr_sessions > 1 || strlen(env.pidns) ||
+		    env.stack_budget || strlen(env.free_stacks) || env.realloc_chains ||
+		    env.cohort_window_ms || env.remote_frees) {
+			fprintf(stderr, "dwarf unwinding (--dwarf-unwind) needs a pid or command, per-allocation "
+					"reports, no --session or --pidns and no reports by stack id\n");
+			ret = 1;
+
+			goto cleanup;
+		}
+	}
+
+	if (strlen(env.symbol_cache)) {
+		if (!native_symbols && !env.dwarf_unwind) {
+			fprintf(stderr, "a symbol cache (--symbol-cache) needs the native symbolizer or --dwarf-unwind\n");
+			ret = 1;
+
+			goto cleanup;
+		}
+
+		if (mkdir(env.symbol_cache, 0700) && errno != EEXIST) {
+			fprintf(stderr, "failed to create %s: %s\n", env.symbol_cache, strerror(errno));
+			ret = 1;
+
+			goto cleanup;
+		}
+
+		syms__set_cache_dir(env.symbol_cache);
+	}
+
+	if (strlen(env.pidns) && (strlen(env.command) || following() || nr_sessions > 1)) {
+		fprintf(stderr, "a pid namespace (--pidns) can't be combined with a command, following or --session\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
+	if (nr_sessions > 1) {
+		if (strlen(env.tag_symbol) || strlen(env.window_provider) || strlen(env.free_stacks) ||
+		    env.realloc_chains || env.cohort_window_ms || env.remote_frees ||
+		    strlen(env.size_classes) || env.show_threads || strlen(env.thread_filter) ||
+		    env.capture_window || env.alert_size) {
+			fprintf(stderr, "several sessions (--session) only support the outstanding allocation reports\n");
+			ret = 1;
+
+			goto cleanup;
+		}
+
+		if (env.kernel_trace && env.kernel_session) {
+			fprintf(stderr, "only one session can trace the kernel\n");
+			ret = 1;
+
+			goto cleanup;
+		}
+	}
+
+	if (strlen(env.size_classes) && (env.kernel_trace || env.combined_only)) {
+		fprintf(stderr, "size classes (--size-classes) need a pid or command and per-allocation reports\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
+	if (strlen(env.window_provider) && (env.kernel_trace || env.combined_only)) {
+		fprintf(stderr, "leak check windows (--usdt-window) need a pid or command and per-allocation reports\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
+	if (env.capture_window && env.kernel_trace) {
+		fprintf(stderr, "duty-cycled mode (--capture-window) needs a pid or command\n");
+		ret = 1;
+
+		goto cleanup;
+	}
+
 	// if specific userspace program was specified,
 	// create the child process and use an eventfd to synchronize the call to exec()
 	if (strlen(env.command)) {
@@ -293,6 +973,31 @@ int main(int argc, char *argv[])
 		env.pid = child_pid;
 	}
 
+	self_mntns = mount_ns(getpid());
+
+	if (strlen(env.pidns)) {
+		ret = setup_pidns();
+		if (ret)
+			goto cleanup;
+	}
+
+	if (!env.kernel_trace) {
+		ret = resolve_object(env.pid > 0 ? env.pid : pidns_pid, object_path, sizeof(object_path));
+		if (ret)
+			goto cleanup;
+	}
+
+	sessions[0].pid = env.kernel_trace ? -1 : env.pid;
+	sessions[0].config.min_size = env.min_size;
+	sessions[0].config.max_size = env.max_size;
+	sessions[0].config.sample_rate = env.sample_rate;
+
+	if (strlen(env.tag_symbol)) {
+		ret = resolve_tag();
+		if (ret)
+			goto cleanup;
+	}
+
 	// allocate space for storing a stack trace
 	stack = calloc(env.perf_max_stack_depth, sizeof(*stack));
 	if (!stack) {
@@ -302,14 +1007,19 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
-	if (env.pid < 0) {
-		src_cfg.src_type = SRC_T_KERNEL;
-		src_cfg.params.kernel.kallsyms = NULL;
-		src_cfg.params.kernel.kernel_image = NULL;
-	} else {
-		src_cfg.src_type = SRC_T_PROCESS;
-		src_cfg.params.process.pid = env.pid;
+	for (size_t i = 0; i < nr_sessions; ++i) {
+		sym_src_cfg *cfg = &sessions[i].src_cfg;
+
+		if (i == 0 ? env.kernel_trace : sessions[i].pid < 0) {
+			cfg->src_type = SRC_T_KERNEL;
+			cfg->params.kernel.kallsyms = NULL;
+			cfg->params.kernel.kernel_image = NULL;
+		} else {
+			cfg->src_type = SRC_T_PROCESS;
+			cfg->params.process.pid = sessions[i].pid;
+		}
 	}
+	use_symbol_source(&sessions[0].src_cfg);
 
 	// allocate space for storing "allocation" structs
 	if (env.combined_only)
@@ -324,6 +1034,26 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
+	if (env.remote_frees) {
+		remote_frees = calloc(COMBINED_ALLOCS_MAX_ENTRIES, sizeof(*remote_frees));
+		if (!remote_frees) {
+			fprintf(stderr, "failed to allocate remote free array\n");
+			ret = -ENOMEM;
+
+			goto cleanup;
+		}
+	}
+
+	if (env.realloc_chains) {
+		chains = calloc(COMBINED_ALLOCS_MAX_ENTRIES, sizeof(*chains));
+		if (!chains) {
+			fprintf(stderr, "failed to allocate realloc chain array\n");
+			ret = -ENOMEM;
+
+			goto cleanup;
+		}
+	}
+
 	libbpf_set_print(libbpf_print_fn);
 
 	skel = memleak_bpf__open();
@@ -341,13 +1071,91 @@ int main(int argc, char *argv[])
 	skel->rodata->trace_all = env.trace_all;
 	skel->rodata->stack_flags = env.kernel_trace ? 0 : BPF_F_USER_STACK;
 	skel->rodata->wa_missing_free = env.wa_missing_free;
+	skel->rodata->stack_budget = env.stack_budget;
 
 	bpf_map__set_value_size(skel->maps.stack_traces,
 				env.perf_max_stack_depth * sizeof(unsigned long));
 	bpf_map__set_max_entries(skel->maps.stack_traces, env.stack_map_max_entries);
 
+	// only used with a sampling budget, keep it tiny otherwise
+	if (!env.stack_budget)
+		bpf_map__set_max_entries(skel->maps.stack_budgets, 1);
+
+	skel->rodata->tag_enabled = strlen(env.tag_symbol) > 0;
+	skel->rodata->tag_tls = env.tag_tls;
+	skel->rodata->tag_addr = env.tag_addr;
+
+	skel->rodata->windows_enabled = strlen(env.window_provider) > 0;
+	if (!strlen(env.window_provider)) {
+		bpf_program__set_autoload(skel->progs.window_begin, false);
+		bpf_program__set_autoload(skel->progs.window_end, false);
+		bpf_map__set_max_entries(skel->maps.active_windows, 1);
+		bpf_map__set_max_entries(skel->maps.window_ends, 1);
+	}
+
+	skel->rodata->realloc_chains_enabled = env.realloc_chains;
+	if (!env.realloc_chains) {
+		bpf_map__set_max_entries(skel->maps.realloc_origins, 1);
+		bpf_map__set_max_entries(skel->maps.realloc_chains, 1);
+	}
+
+	skel->rodata->remote_frees_enabled = env.remote_frees;
+	if (!env.remote_frees)
+		bpf_map__set_max_entries(skel->maps.remote_frees, 1);
+
+	skel->rodata->cohorts_enabled = env.cohort_window_ms > 0;
+	if (!env.cohort_window_ms)
+		bpf_map__set_max_entries(skel->maps.free_events, env.page_size);
+
+	skel->rodata->free_stacks_enabled = strlen(env.free_stacks) > 0;
+	if (!strlen(env.free_stacks)) {
+		bpf_map__set_max_entries(skel->maps.target_stacks, 1);
+		bpf_map__set_max_entries(skel->maps.free_pairs, 1);
+	}
+
+	skel->rodata->alert_size = env.alert_size;
+	if (!env.alert_size)
+		bpf_map__set_max_entries(skel->maps.alerts, env.page_size);
+
+	skel->rodata->dwarf_unwind = env.dwarf_unwind;
+	skel->rodata->unwind_sample = env.unwind_sample;
+	if (!env.dwarf_unwind)
+		bpf_map__set_max_entries(skel->maps.unwind_events, env.page_size);
+
+	skel->rodata->multi_session = nr_sessions > 1;
+	skel->rodata->follow_children = env.follow_children;
+	skel->rodata->follow_exe = strlen(env.follow_exe) > 0;
+	if (!env.follow_children)
+		bpf_program__set_autoload(skel->progs.memleak__sched_process_fork, false);
+	if (!strlen(env.follow_exe))
+		bpf_program__set_autoload(skel->progs.memleak__sched_process_exec, false);
+	if (strlen(env.follow_exe)) {
+		ret = setup_follow(skel, &follow_exe_stat);
+		if (ret)
+			goto cleanup;
+	}
+	if (!following()) {
+		bpf_program__set_autoload(skel->progs.memleak__sched_process_exit, false);
+		bpf_map__set_max_entries(skel->maps.follow_events, env.page_size);
+	} else {
+		// every followed process has an entry
+		bpf_map__set_max_entries(skel->maps.session_pids, 10240);
+	}
+
+	// the namespace filter is only needed to trace all of its processes
+	if (strlen(env.pidns) && env.pid < 0) {
+		skel->rodata->pidns_filter = true;
+		skel->rodata->pidns_dev = major(pidns_stat.st_dev) << 20 | minor(pidns_stat.st_dev);
+		skel->rodata->pidns_ino = pidns_stat.st_ino;
+	}
+
+	for (size_t i = 0; i < nr_sessions; ++i) {
+		if (sessions[i].pid < 0)
+			skel->rodata->kernel_session = i;
+	}
+
 	// disable kernel tracepoints based on settings or availability
-	if (env.kernel_trace) {
+	if (env.kernel_trace || env.kernel_session) {
 		disable_kernel_node_tracepoints(skel);
 
 		if (!env.percpu)
@@ -363,27 +1171,42 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
-	const int allocs_fd = bpf_map__fd(skel->maps.allocs);
-	const int combined_allocs_fd = bpf_map__fd(skel->maps.combined_allocs);
-	const int stack_traces_fd = bpf_map__fd(skel->maps.stack_traces);
-
-	// if userspace oriented, attach upbrobes
-	if (!env.kernel_trace) {
-		ret = attach_uprobes(skel);
-		if (ret) {
-			fprintf(stderr, "failed to attach uprobes\n");
+	// the runtime threshold needs the kernel to account bpf program run time
+	if (env.max_bpf_runtime_ms) {
+		bpf_stats_fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+		if (bpf_stats_fd < 0) {
+			fprintf(stderr, "failed to enable bpf run time stats\n");
+			ret = bpf_stats_fd;
 
 			goto cleanup;
 		}
 	}
 
-	ret = memleak_bpf__attach(skel);
-	if (ret) {
-		fprintf(stderr, "failed to attach bpf program(s)\n");
+	if (nr_sessions > 1 || following()) {
+		ret = setup_sessions(skel);
+		if (ret)
+			goto cleanup;
+	}
 
-		goto cleanup;
+	if (strlen(env.follow_exe)) {
+		ret = follow_exe_processes(skel, &follow_exe_stat);
+		if (ret)
+			goto cleanup;
+	}
+
+	if (strlen(env.free_stacks)) {
+		ret = setup_free_stacks(skel);
+		if (ret)
+			goto cleanup;
 	}
 
+	ret = attach_probes(skel);
+	if (ret)
+		goto cleanup;
+
+	if (env.capture_window)
+		duty_cycle_reset(skel);
+
 	// if running a specific userspace program,
 	// notify the child process that it can exec its program
 	if (strlen(env.command)) {
@@ -395,55 +1218,184 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	symbolizer = blazesym_new();
-	if (!symbolizer) {
-		fprintf(stderr, "Failed to load blazesym\n");
-		ret = -ENOMEM;
-
-		goto cleanup;
-	}
-	print_stack_frames_func = print_stack_frames_by_blazesym;
-	printf("Tracing outstanding memory allocs...  Hit Ctrl-C to end\n");
-
-	// main loop
-	while (!exiting && env.nr_intervals) {
-		env.nr_intervals--;
-
-		sleep(env.interval);
+	// the unwinder finds the unwind tables through the symbols of the process
+	if (native_symbols || env.dwarf_unwind) {
+		syms_cache = syms_cache__new(0);
+		if (!syms_cache) {
+			fprintf(stderr, "Failed to create syms cache\n");
+			ret = -ENOMEM;
 
-		if (env.combined_only)
-			print_outstanding_combined_allocs(combined_allocs_fd, stack_traces_fd);
-		else
-			print_outstanding_allocs(allocs_fd, stack_traces_fd);
+			goto cleanup;
+		}
 	}
 
-	// after loop ends, check for child process and cleanup accordingly
-	if (env.pid > 0 && strlen(env.command)) {
-		if (!child_exited) {
-			if (kill(env.pid, SIGTERM)) {
-				perror("failed to signal child process");
-				ret = -errno;
+	if (native_symbols) {
+		if (env.kernel_trace || env.kernel_session) {
+			ksyms = ksyms__load();
+			if (!ksyms) {
+				fprintf(stderr, "Failed to load ksyms\n");
+				ret = -ENOMEM;
 
 				goto cleanup;
 			}
-			printf("signaled child process\n");
 		}
 
-		if (waitpid(env.pid, NULL, 0) < 0) {
-			perror("failed to reap child process");
-			ret = -errno;
+		print_stack_frames_func = print_stack_frames_by_native;
+		print_stack_frames_json_func = print_stack_frames_json_by_native;
+	} else {
+		symbolizer = blazesym_new();
+		if (!symbolizer) {
+			fprintf(stderr, "Failed to load blazesym\n");
+			ret = -ENOMEM;
 
 			goto cleanup;
 		}
-		printf("reaped child process\n");
+		print_stack_frames_func = print_stack_frames_by_blazesym;
+		print_stack_frames_json_func = print_stack_frames_json_by_blazesym;
 	}
 
-cleanup:
-	blazesym_free(symbolizer);
-	memleak_bpf__destroy(skel);
+	if (env.alert_size) {
+		ret = add_ring_buffer(bpf_map__fd(skel->maps.alerts), handle_alert, NULL);
+		if (ret)
+			goto cleanup;
+	}
 
-	free(allocs);
-	free(stack);
+	if (env.cohort_window_ms) {
+		ret = add_ring_buffer(bpf_map__fd(skel->maps.free_events), handle_free_event, NULL);
+		if (ret)
+			goto cleanup;
+	}
+
+	if (following()) {
+		ret = add_ring_buffer(bpf_map__fd(skel->maps.follow_events), handle_follow_event, NULL);
+		if (ret)
+			goto cleanup;
+	}
+
+	if (env.dwarf_unwind) {
+		ret = add_ring_buffer(bpf_map__fd(skel->maps.unwind_events), handle_unwind_event, NULL);
+		if (ret)
+			goto cleanup;
+	}
+	printf("Tracing outstanding memory allocs...  Hit Ctrl-C to end\n");
+
+	// main loop, ticking once per second so the circuit breaker and the
+	// duty cycle can react between reports
+	for (int elapsed = 0; !exiting && env.nr_intervals;) {
+		wait_tick();
+
+		if (nr_exited_processes) {
+			ret = drop_exited_allocs(bpf_map__fd(skel->maps.allocs));
+			if (ret)
+				goto cleanup;
+		}
+
+		// new stacks through a --free-stacks symbol become targets
+		if (nr_free_stack_syms) {
+			ret = update_free_stack_targets(skel);
+			if (ret)
+				goto cleanup;
+		}
+
+		if (env.max_event_rate || env.max_bpf_runtime_ms) {
+			ret = breaker_tick(skel);
+			if (ret)
+				goto cleanup;
+		}
+
+		// in duty-cycled mode a report is due at the end of each
+		// observation period rather than every interval
+		if (env.capture_window) {
+			if (breaker.tripped)
+				continue;
+
+			ret = duty_cycle_tick(skel);
+			if (ret < 0)
+				goto cleanup;
+			if (!ret)
+				continue;
+
+			printf("Leak suspects: allocations from the capture window outstanding after %d seconds\n",
+					env.observe_period);
+		} else if (++elapsed < env.interval) {
+			continue;
+		}
+
+		elapsed = 0;
+		env.nr_intervals--;
+
+		print_outstanding(skel);
+
+		if (env.health)
+			print_health(skel);
+
+		if (env.capture_window) {
+			ret = duty_cycle_restart(skel);
+			if (ret)
+				goto cleanup;
+		}
+	}
+
+	// after loop ends, check for child process and cleanup accordingly
+	if (env.pid > 0 && strlen(env.command)) {
+		if (!child_exited) {
+			if (kill(env.pid, SIGTERM)) {
+				perror("failed to signal child process");
+				ret = -errno;
+
+				goto cleanup;
+			}
+			printf("signaled child process\n");
+		}
+
+		if (waitpid(env.pid, NULL, 0) < 0) {
+			perror("failed to reap child process");
+			ret = -errno;
+
+			goto cleanup;
+		}
+		printf("reaped child process\n");
+	}
+
+cleanup:
+	ring_buffer__free(events_rb);
+	blazesym_free(symbolizer);
+	ksyms__free(ksyms);
+	syms_cache__free(syms_cache);
+	free_demangled_names();
+	for (size_t i = 1; i < nr_sessions; ++i)
+		detach_session_uprobes(&sessions[i]);
+	memleak_bpf__destroy(skel);
+
+	if (bpf_stats_fd >= 0)
+		close(bpf_stats_fd);
+
+	free(allocs);
+	free(threads);
+	free(tags.entries);
+	free(windows.entries);
+	free(free_pairs.entries);
+	free(chains);
+	free(remote_frees);
+	free(cohort_pairs.entries);
+	free(cohort_stacks.entries);
+	free(size_classes.entries);
+	free(stack_size_classes.entries);
+	free(scanned_stacks);
+	for (size_t i = 0; i < nr_unwound_stacks; ++i)
+		free(unwound_stacks[i].frames);
+	free(unwound_stacks);
+	free(unwound_stack_slots);
+	free(unwound_allocs);
+	free(exited_processes);
+	free(stack);
+	clear_ns_processes();
+	while (ns_objects) {
+		struct ns_object *next = ns_objects->next;
+
+		free(ns_objects);
+		ns_objects = next;
+	}
 
 	printf("done\n");
 
@@ -506,6 +1458,120 @@ error_t argp_parse_arg(int key, char *arg, struct argp_state *state)
 	case 'P':
 		env.percpu = true;
 		break;
+	case 'v':
+		env.verbose = true;
+		break;
+	case OPT_MAX_EVENT_RATE:
+		env.max_event_rate = argp_parse_long(key, arg, state);
+		break;
+	case OPT_MAX_BPF_RUNTIME:
+		env.max_bpf_runtime_ms = argp_parse_long(key, arg, state);
+		break;
+	case OPT_BREAKER_HOLD:
+		env.breaker_hold = argp_parse_long(key, arg, state);
+		break;
+	case OPT_BREAKER_COOLDOWN:
+		env.breaker_cooldown = argp_parse_long(key, arg, state);
+		break;
+	case OPT_HEALTH:
+		env.health = true;
+		break;
+	case OPT_CAPTURE_WINDOW:
+		env.capture_window = argp_parse_long(key, arg, state);
+		break;
+	case OPT_OBSERVE:
+		env.observe_period = argp_parse_long(key, arg, state);
+		break;
+	case OPT_STACK_BUDGET:
+		env.stack_budget = argp_parse_long(key, arg, state);
+		break;
+	case OPT_ALERT_SIZE:
+		env.alert_size = argp_parse_long(key, arg, state);
+		break;
+	case OPT_NDJSON:
+		env.ndjson = true;
+		break;
+	case OPT_THREADS:
+		env.show_threads = true;
+		break;
+	case OPT_THREAD:
+		strncpy(env.thread_filter, arg, sizeof(env.thread_filter) - 1);
+		break;
+	case OPT_TAG:
+		strncpy(env.tag_symbol, arg, sizeof(env.tag_symbol) - 1);
+		break;
+	case OPT_USDT_WINDOW:
+		if (parse_usdt_window(arg)) {
+			fprintf(stderr, "invalid usdt window: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case OPT_WINDOW_GRACE:
+		env.window_grace = argp_parse_long(key, arg, state);
+		break;
+	case OPT_REALLOC_CHAINS:
+		env.realloc_chains = true;
+		break;
+	case OPT_SIZE_CLASSES:
+		if (!strcmp(arg, "glibc"))
+			size_class_func = glibc_size_class;
+		else if (!strcmp(arg, "tcmalloc"))
+			size_class_func = tcmalloc_size_class;
+		else if (!strcmp(arg, "jemalloc"))
+			size_class_func = jemalloc_size_class;
+		else {
+			fprintf(stderr, "unknown allocator: %s\n", arg);
+			argp_usage(state);
+		}
+		strncpy(env.size_classes, arg, sizeof(env.size_classes) - 1);
+		break;
+	case OPT_REMOTE_FREES:
+		env.remote_frees = true;
+		break;
+	case OPT_SESSION:
+		if (parse_session(arg)) {
+			fprintf(stderr, "invalid session: %s\n", arg);
+			argp_usage(state);
+		}
+		break;
+	case OPT_FOLLOW_CHILDREN:
+		env.follow_children = true;
+		break;
+	case OPT_SYMBOLIZER:
+		if (strcmp(arg, "native") && strcmp(arg, "blazesym")) {
+			fprintf(stderr, "unknown symbolizer: %s\n", arg);
+			argp_usage(state);
+		}
+		strncpy(env.symbolizer, arg, sizeof(env.symbolizer) - 1);
+		break;
+	case OPT_DEMANGLE:
+		if (strcmp(arg, "full") && strcmp(arg, "short") && strcmp(arg, "none")) {
+			fprintf(stderr, "unknown demangling: %s\n", arg);
+			argp_usage(state);
+		}
+		strncpy(env.demangle, arg, sizeof(env.demangle) - 1);
+		break;
+	case OPT_SYMBOL_CACHE:
+		strncpy(env.symbol_cache, arg, sizeof(env.symbol_cache) - 1);
+		break;
+	case OPT_DWARF_UNWIND:
+		env.dwarf_unwind = true;
+		break;
+	case OPT_UNWIND_SAMPLE:
+		env.unwind_sample = argp_parse_long(key, arg, state);
+		break;
+	case OPT_PIDNS:
+		strncpy(env.pidns, arg, sizeof(env.pidns) - 1);
+		break;
+	case OPT_FOLLOW_EXE:
+		strncpy(env.follow_exe, arg, sizeof(env.follow_exe) - 1);
+		break;
+	case OPT_COHORTS:
+		env.cohort_window_ms = argp_parse_long(key, arg, state);
+		break;
+	case OPT_FREE_STACKS:
+		strncpy(env.free_stacks, arg, sizeof(env.free_stacks) - 1);
+		break;
 	case ARGP_KEY_ARG:
 		pos_args++;
 
@@ -641,14 +1707,14 @@ void print_stack_frame_by_blazesym(size_t frame, uint64_t addr, const blazesym_c
 	if (!sym)
 		printf("\t%zu [<%016lx>] <%s>\n", frame, addr, "null sym");
 	else if (sym->path && strlen(sym->path))
-		printf("\t%zu [<%016lx>] %s+0x%lx %s:%ld\n", frame, addr, sym->symbol, addr - sym->start_address, sym->path, sym->line_no);
+		printf("\t%zu [<%016lx>] %s+0x%lx %s:%ld\n", frame, addr, demangle(sym->symbol), addr - sym->start_address, sym->path, sym->line_no);
 	else
-		printf("\t%zu [<%016lx>] %s+0x%lx\n", frame, addr, sym->symbol, addr - sym->start_address);
+		printf("\t%zu [<%016lx>] %s+0x%lx\n", frame, addr, demangle(sym->symbol), addr - sym->start_address);
 }
 
 void print_stack_frames_by_blazesym()
 {
-	const blazesym_result *result = blazesym_symbolize(symbolizer, &src_cfg, 1, stack, env.perf_max_stack_depth);
+	const blazesym_result *result = blazesym_symbolize(symbolizer, src_cfgs, nr_src_cfgs, stack, env.perf_max_stack_depth);
 
 	for (size_t j = 0; j < result->size; ++j) {
 		const uint64_t addr = stack[j];
@@ -677,31 +1743,397 @@ void print_stack_frames_by_blazesym()
 		for (size_t k = 0; k < result->entries[j].size; ++k) {
 			const blazesym_csym *sym = &result->entries[j].syms[k];
 			if (sym->path && strlen(sym->path))
-				printf("\t\t%s@0x%lx %s:%ld\n", sym->symbol, sym->start_address, sym->path, sym->line_no);
+				printf("\t\t%s@0x%lx %s:%ld\n", demangle(sym->symbol), sym->start_address, sym->path, sym->line_no);
 			else
-				printf("\t\t%s@0x%lx\n", sym->symbol, sym->start_address);
+				printf("\t\t%s@0x%lx\n", demangle(sym->symbol), sym->start_address);
+		}
+	}
+
+	blazesym_result_free(result);
+}
+
+// the symbols of the process of src_cfg, NULL for the kernel
+const struct syms *native_syms(void)
+{
+	const struct syms *syms;
+
+	if (src_cfg.src_type != SRC_T_PROCESS)
+		return NULL;
+
+	syms = syms_cache__get_syms(syms_cache, src_cfg.params.process.pid);
+	if (!syms)
+		fprintf(stderr, "Failed to get syms of pid %u\n", src_cfg.params.process.pid);
+
+	return syms;
+}
+
+const char *native_symbolize(const struct syms *syms, uint64_t addr, unsigned long *offset,
+		const char **dso_name)
+{
+	const struct ksym *ksym;
+	struct sym_info sinfo;
+
+	*dso_name = NULL;
+
+	if (src_cfg.src_type != SRC_T_PROCESS) {
+		ksym = ksyms ? ksyms__map_addr(ksyms, addr) : NULL;
+		if (!ksym)
+			return NULL;
+
+		*offset = addr - ksym->addr;
+
+		return ksym->name;
+	}
+
+	// an address in no mapping may be in a library dlopen()ed since the
+	// maps were read, the cache reads them again at most once a second
+	if (!syms || syms__map_addr_dso(syms, addr, &sinfo)) {
+		syms = syms_cache__refresh_syms(syms_cache, src_cfg.params.process.pid);
+		if (!syms || syms__map_addr_dso(syms, addr, &sinfo))
+			return NULL;
+	}
+
+	if (!sinfo.sym_name)
+		return NULL;
+
+	*dso_name = sinfo.dso_name;
+	*offset = sinfo.sym_offset;
+
+	return sinfo.sym_name;
+}
+
+void print_stack_frames_by_native()
+{
+	const struct syms *syms = native_syms();
+
+	for (size_t i = 0; i < env.perf_max_stack_depth; ++i) {
+		const uint64_t addr = stack[i];
+		unsigned long offset;
+		const char *name;
+		const char *dso_name;
+
+		if (addr == 0)
+			break;
+
+		name = demangle(native_symbolize(syms, addr, &offset, &dso_name));
+		if (!name)
+			printf("\t%zu [<%016lx>] <%s>\n", i, addr, "null sym");
+		else if (dso_name)
+			printf("\t%zu [<%016lx>] %s+0x%lx [%s]\n", i, addr, name, offset, dso_name);
+		else
+			printf("\t%zu [<%016lx>] %s+0x%lx\n", i, addr, name, offset);
+	}
+}
+
+void print_json_string(const char *str)
+{
+	putchar('"');
+
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+
+	putchar('"');
+}
+
+void print_stack_frames_json_by_blazesym(size_t nr_frames)
+{
+	const blazesym_result *result = blazesym_symbolize(symbolizer, src_cfgs, nr_src_cfgs, stack, nr_frames);
+
+	printf("[");
+
+	for (size_t j = 0; j < nr_frames; ++j) {
+		printf("%s{\"addr\":\"%#lx\"", j ? "," : "", stack[j]);
+
+		if (result && j < result->size && result->entries[j].size > 0) {
+			const blazesym_csym *sym = &result->entries[j].syms[0];
+
+			printf(",\"symbol\":");
+			print_json_string(demangle(sym->symbol));
+			printf(",\"offset\":%lu", stack[j] - sym->start_address);
 		}
+
+		printf("}");
 	}
 
+	printf("]");
+
 	blazesym_result_free(result);
 }
 
+void print_stack_frames_json_by_native(size_t nr_frames)
+{
+	const struct syms *syms = native_syms();
+
+	printf("[");
+
+	for (size_t j = 0; j < nr_frames; ++j) {
+		unsigned long offset;
+		const char *name;
+		const char *dso_name;
+
+		printf("%s{\"addr\":\"%#lx\"", j ? "," : "", stack[j]);
+
+		name = demangle(native_symbolize(syms, stack[j], &offset, &dso_name));
+		if (name) {
+			printf(",\"symbol\":");
+			print_json_string(name);
+			printf(",\"offset\":%lu", offset);
+		}
+
+		printf("}");
+	}
+
+	printf("]");
+}
+
+// the name to print for a symbol, NULL stays NULL
+const char *demangle(const char *name)
+{
+	struct demangled_name *entry, **buckets;
+	uint64_t hash = 14695981039346656037ull;
+	size_t bucket;
+	int status;
+
+	// only C++ names are mangled, and only they are worth a lookup
+	if (!name || strncmp(name, "_Z", 2) || !strcmp(env.demangle, "none"))
+		return name;
+
+	for (const char *p = name; *p; ++p)
+		hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+
+	if (nr_demangled_names >= nr_demangled_buckets) {
+		const size_t nr_buckets = nr_demangled_buckets ? nr_demangled_buckets * 2 : 1024;
+
+		buckets = calloc(nr_buckets, sizeof(*buckets));
+		if (!buckets)
+			return name;
+
+		for (size_t i = 0; i < nr_demangled_buckets; ++i) {
+			while ((entry = demangled_names[i])) {
+				demangled_names[i] = entry->next;
+				entry->next = buckets[entry->hash & (nr_buckets - 1)];
+				buckets[entry->hash & (nr_buckets - 1)] = entry;
+			}
+		}
+
+		free(demangled_names);
+		demangled_names = buckets;
+		nr_demangled_buckets = nr_buckets;
+	}
+
+	bucket = hash & (nr_demangled_buckets - 1);
+	for (entry = demangled_names[bucket]; entry; entry = entry->next) {
+		if (entry->hash == hash && !strcmp(entry->mangled, name))
+			return entry->name;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return name;
+
+	entry->hash = hash;
+	entry->mangled = strdup(name);
+	entry->name = __cxa_demangle(name, NULL, NULL, &status);
+	if (entry->name && !strcmp(env.demangle, "short")) {
+		char *shortened = shorten_templates(entry->name);
+
+		free(entry->name);
+		entry->name = shortened;
+	}
+
+	// names that don't demangle are printed as they are
+	if (!entry->name)
+		entry->name = strdup(name);
+
+	if (!entry->mangled || !entry->name) {
+		free(entry->mangled);
+		free(entry->name);
+		free(entry);
+
+		return name;
+	}
+
+	entry->next = demangled_names[bucket];
+	demangled_names[bucket] = entry;
+	nr_demangled_names++;
+
+	return entry->name;
+}
+
+// replaces template arguments with "<...>", minding operator<, <<, -> etc.
+char *shorten_templates(const char *name)
+{
+	// "<>" becomes "<...>", so at most 5 characters out of 2, and an
+	// unclosed '<' ends the output
+	char *shortened = malloc(strlen(name) * 5 / 2 + 6);
+	char *out = shortened;
+	int depth = 0;
+
+	if (!shortened)
+		return NULL;
+
+	for (const char *in = name; *in; ++in) {
+		if (!strncmp(in, "operator", 8)) {
+			const char *end = in + 8;
+
+			while (*end && strchr("<>=-", *end))
+				++end;
+			if (!depth) {
+				memcpy(out, in, end - in);
+				out += end - in;
+			}
+			in = end - 1;
+		} else if (*in == '<') {
+			if (!depth++) {
+				memcpy(out, "<...>", 5);
+				out += 5;
+			}
+		} else if (*in == '>' && depth) {
+			--depth;
+		} else if (!depth) {
+			*out++ = *in;
+		}
+	}
+
+	*out = '\0';
+
+	return shortened;
+}
+
+void free_demangled_names(void)
+{
+	struct demangled_name *entry;
+
+	for (size_t i = 0; i < nr_demangled_buckets; ++i) {
+		while ((entry = demangled_names[i])) {
+			demangled_names[i] = entry->next;
+			free(entry->mangled);
+			free(entry->name);
+			free(entry);
+		}
+	}
+
+	free(demangled_names);
+}
+
+int handle_alert(void *ctx, void *data, size_t data_sz)
+{
+	const struct alert_event *event = data;
+	size_t nr_frames = event->nr_frames;
+
+	if (nr_frames > env.perf_max_stack_depth)
+		nr_frames = env.perf_max_stack_depth;
+
+	memset(stack, 0, env.perf_max_stack_depth * sizeof(*stack));
+	memcpy(stack, event->stack, nr_frames * sizeof(*stack));
+
+	if (many_processes()) {
+		const sym_src_cfg cfg = {
+			.src_type = SRC_T_PROCESS,
+			.params.process.pid = event->pid,
+		};
+
+		use_symbol_source(&cfg);
+	}
+
+	if (env.ndjson) {
+		printf("{\"type\":\"alert\",\"timestamp_ns\":%llu,\"pid\":%u,\"tid\":%u,"
+				"\"size\":%llu,\"address\":\"%#llx\",",
+				event->timestamp_ns, event->pid, event->tid,
+				event->size, event->address);
+		if (strlen(env.pidns))
+			printf("\"ns_pid\":%d,", ns_pid(event->pid));
+		printf("\"stack\":");
+		(*print_stack_frames_json_func)(nr_frames);
+		printf("}\n");
+	} else {
+		time_t t = time(NULL);
+		struct tm *tm = localtime(&t);
+
+		printf("[%d:%d:%d] Alert: %llu bytes allocated at %#llx by pid %u tid %u",
+				tm->tm_hour, tm->tm_min, tm->tm_sec,
+				event->size, event->address, event->pid, event->tid);
+		if (strlen(env.pidns))
+			printf(" (pid %d in the namespace)", ns_pid(event->pid));
+		printf("\n");
+		(*print_stack_frames_func)();
+	}
+
+	fflush(stdout);
+
+	return 0;
+}
+
+void wait_tick(void)
+{
+	const unsigned long long deadline = get_ktime_ns() + NSEC_PER_SEC;
+
+	if (!events_rb) {
+		sleep(1);
+
+		return;
+	}
+
+	// events are handled as they arrive rather than at the next report
+	for (unsigned long long now = get_ktime_ns(); !exiting && now < deadline; now = get_ktime_ns()) {
+		const int err = ring_buffer__poll(events_rb, (deadline - now) / 1000000 + 1);
+		if (err < 0 && err != -EINTR) {
+			fprintf(stderr, "failed to poll events: %d\n", err);
+
+			return;
+		}
+	}
+}
+
 int print_stack_frames(struct allocation *allocs, size_t nr_allocs, int stack_traces_fd)
 {
 	for (size_t i = 0; i < nr_allocs; ++i) {
 		const struct allocation *alloc = &allocs[i];
 
-		printf("%zu bytes in %zu allocations from stack\n", alloc->size, alloc->count);
+		if (env.verbose)
+			printf("%zu bytes in %zu allocations from stack id %lu\n",
+					alloc->size, alloc->count, alloc->stack_id);
+		else
+			printf("%zu bytes in %zu allocations from stack\n", alloc->size, alloc->count);
 
 		if (env.show_allocs) {
 			struct allocation_node* it = alloc->allocations;
 			while (it != NULL) {
-				printf("\taddr = %#lx size = %zu\n", it->address, it->size);
+				printf("\taddr = %#lx size = %zu tid = %d\n", it->address, it->size, it->tid);
 				it = it->next;
 			}
 		}
 
-		if (bpf_map_lookup_elem(stack_traces_fd, &alloc->stack_id, stack)) {
+		if (size_class_func)
+			print_stack_size_classes(alloc->stack_id);
+
+		if (strlen(env.pidns) && alloc->pid > 0)
+			printf("\tfrom pid %d in the namespace, host pid %d\n", ns_pid(alloc->pid), alloc->pid);
+
+		// the traced processes may run other binaries than the first one
+		if (many_processes() && alloc->pid > 0) {
+			const sym_src_cfg cfg = {
+				.src_type = SRC_T_PROCESS,
+				.params.process.pid = alloc->pid,
+			};
+
+			use_symbol_source(&cfg);
+		}
+
+		// only --dwarf-unwind makes up stack ids, all others are the stack map's
+		if (env.dwarf_unwind && alloc->stack_id < 1ULL << 31 &&
+		    alloc->stack_id & UNWIND_STACK_ID) {
+			const struct unwound_stack *unwound = &unwound_stacks[alloc->stack_id & ~UNWIND_STACK_ID];
+
+			memset(stack, 0, env.perf_max_stack_depth * sizeof(*stack));
+			memcpy(stack, unwound->frames, unwound->nr_frames * sizeof(*stack));
+		} else if (bpf_map_lookup_elem(stack_traces_fd, &alloc->stack_id, stack)) {
 			if (errno == ENOENT)
 				continue;
 
@@ -732,7 +2164,7 @@ int alloc_size_compare(const void *a, const void *b)
 	return 0;
 }
 
-int print_outstanding_allocs(int allocs_fd, int stack_traces_fd)
+int print_outstanding_allocs(int allocs_fd, int stack_traces_fd, int window_ends_fd, uint32_t sid)
 {
 	time_t t = time(NULL);
 	struct tm *tm = localtime(&t);
@@ -763,6 +2195,22 @@ int print_outstanding_allocs(int allocs_fd, int stack_traces_fd)
 			return -errno;
 		}
 
+		// an unwound stack is known once its event arrived, the allocation
+		// is marked as seen before any filter so it is not pruned
+		if (alloc_info.stack_id == UNWIND_STACK_ID) {
+			struct unwound_alloc *unwound = find_unwound_alloc(curr_key);
+
+			if (!unwound || unwound->timestamp_ns != alloc_info.timestamp_ns)
+				continue;
+
+			unwound->gen = unwind_gen;
+			alloc_info.stack_id = UNWIND_STACK_ID | unwound->stack;
+		}
+
+		// filter by session
+		if (alloc_info.session != sid)
+			continue;
+
 		// filter by age
 		if (get_ktime_ns() - env.min_age_ns < alloc_info.timestamp_ns) {
 			continue;
@@ -773,6 +2221,44 @@ int print_outstanding_allocs(int allocs_fd, int stack_traces_fd)
 			continue;
 		}
 
+		// filter by window, accounting to the per-window rollup
+		if (window_ends_fd >= 0) {
+			if (!window_expired(window_ends_fd, &alloc_info))
+				continue;
+
+			if (usage_add(&windows, alloc_info.window_id,
+				      alloc_info.size * alloc_info.weight, alloc_info.weight)) {
+				fprintf(stderr, "failed to grow window table\n");
+				return -ENOMEM;
+			}
+		}
+
+		// filter by thread, accounting to the per-thread rollup
+		if (env.show_threads || strlen(env.thread_filter)) {
+			struct thread *thread = get_thread(alloc_info.pid, alloc_info.tid);
+			if (!thread) {
+				fprintf(stderr, "failed to grow thread table\n");
+				return -ENOMEM;
+			}
+
+			if (!thread->matched)
+				continue;
+
+			thread->size += alloc_info.size * alloc_info.weight;
+			thread->count += alloc_info.weight;
+		}
+
+		if (size_class_func && add_size_class(alloc_info.stack_id, alloc_info.size, alloc_info.weight)) {
+			fprintf(stderr, "failed to grow size class table\n");
+			return -ENOMEM;
+		}
+
+		if (strlen(env.tag_symbol) &&
+		    usage_add(&tags, alloc_info.tag, alloc_info.size * alloc_info.weight, alloc_info.weight)) {
+			fprintf(stderr, "failed to grow tag table\n");
+			return -ENOMEM;
+		}
+
 		// when the stack_id exists in the allocs array,
 		//   increment size with alloc_info.size
 		bool stack_exists = false;
@@ -781,8 +2267,8 @@ int print_outstanding_allocs(int allocs_fd, int stack_traces_fd)
 			struct allocation *alloc = &allocs[i];
 
 			if (alloc->stack_id == alloc_info.stack_id) {
-				alloc->size += alloc_info.size;
-				alloc->count++;
+				alloc->size += alloc_info.size * alloc_info.weight;
+				alloc->count += alloc_info.weight;
 
 				if (env.show_allocs) {
 					struct allocation_node* node = malloc(sizeof(struct allocation_node));
@@ -790,8 +2276,9 @@ int print_outstanding_allocs(int allocs_fd, int stack_traces_fd)
 						perror("malloc failed");
 						return -errno;
 					}
-					node->address = curr_key;
+					node->address = alloc_key_address(curr_key, &alloc_info);
 					node->size = alloc_info.size;
+					node->tid = alloc_info.tid;
 					node->next = alloc->allocations;
 					alloc->allocations = node;
 				}
@@ -808,8 +2295,9 @@ int print_outstanding_allocs(int allocs_fd, int stack_traces_fd)
 		//   create a new entry in the array
 		struct allocation alloc = {
 			.stack_id = alloc_info.stack_id,
-			.size = alloc_info.size,
-			.count = 1,
+			.size = alloc_info.size * alloc_info.weight,
+			.count = alloc_info.weight,
+			.pid = alloc_info.pid,
 			.allocations = NULL
 		};
 
@@ -819,8 +2307,9 @@ int print_outstanding_allocs(int allocs_fd, int stack_traces_fd)
 				perror("malloc failed");
 				return -errno;
 			}
-			node->address = curr_key;
+			node->address = alloc_key_address(curr_key, &alloc_info);
 			node->size = alloc_info.size;
+			node->tid = alloc_info.tid;
 			node->next = NULL;
 			alloc.allocations = node;
 		}
@@ -838,9 +2327,24 @@ int print_outstanding_allocs(int allocs_fd, int stack_traces_fd)
 	printf("[%d:%d:%d] Top %zu stacks with outstanding allocations:\n",
 			tm->tm_hour, tm->tm_min, tm->tm_sec, nr_allocs_to_show);
 
+	if (size_class_func)
+		usage_sort(&stack_size_classes);
+
 	print_stack_frames(allocs, nr_allocs_to_show, stack_traces_fd);
 
-	// Reset allocs list so that we dont accidentaly reuse data the next time we call this function
+	if (size_class_func)
+		print_size_classes();
+
+	if (env.show_threads)
+		print_threads();
+
+	if (strlen(env.tag_symbol))
+		print_tags();
+
+	if (window_ends_fd >= 0)
+		print_windows();
+
+	// Reset allocs list so that we dont accidentaly reuse data the next time we call this function
 	for (size_t i = 0; i < nr_allocs; i++) {
 		allocs[i].stack_id = 0;
 		if (env.show_allocs) {
@@ -857,7 +2361,1998 @@ int print_outstanding_allocs(int allocs_fd, int stack_traces_fd)
 	return 0;
 }
 
-int print_outstanding_combined_allocs(int combined_allocs_fd, int stack_traces_fd)
+struct thread *get_thread(pid_t pid, pid_t tid)
+{
+	char path[64];
+	size_t i;
+	FILE *f;
+
+	// keep the table at most half full
+	if ((nr_threads + 1) * 2 > threads_cap) {
+		const size_t new_cap = threads_cap ? threads_cap * 2 : 256;
+		struct thread *new_threads = calloc(new_cap, sizeof(*new_threads));
+		if (!new_threads)
+			return NULL;
+
+		for (size_t j = 0; j < threads_cap; ++j) {
+			if (!threads[j].used)
+				continue;
+
+			for (i = threads[j].tid & (new_cap - 1); new_threads[i].used; i = (i + 1) & (new_cap - 1))
+				;
+			new_threads[i] = threads[j];
+		}
+
+		free(threads);
+		threads = new_threads;
+		threads_cap = new_cap;
+	}
+
+	for (i = tid & (threads_cap - 1); threads[i].used; i = (i + 1) & (threads_cap - 1)) {
+		if (threads[i].tid == tid)
+			return &threads[i];
+	}
+
+	struct thread *thread = &threads[i];
+	memset(thread, 0, sizeof(*thread));
+	thread->used = true;
+	thread->tid = tid;
+	nr_threads++;
+
+	// kernel allocations may come from any task on the system, and the
+	// followed ones from any process
+	if (env.kernel_trace)
+		snprintf(path, sizeof(path), "/proc/%d/comm", tid);
+	else
+		snprintf(path, sizeof(path), "/proc/%d/task/%d/comm", pid, tid);
+
+	f = fopen(path, "r");
+	if (!f || !fgets(thread->comm, sizeof(thread->comm), f))
+		strcpy(thread->comm, "[exited]");
+	else
+		thread->comm[strcspn(thread->comm, "\n")] = '\0';
+
+	if (f)
+		fclose(f);
+
+	if (!strlen(env.thread_filter)) {
+		thread->matched = true;
+	} else {
+		char *end;
+		const long filter_tid = strtol(env.thread_filter, &end, 10);
+
+		if (*end == '\0')
+			thread->matched = filter_tid == tid;
+		else
+			thread->matched = !fnmatch(env.thread_filter, thread->comm, 0);
+	}
+
+	return thread;
+}
+
+int thread_size_compare(const void *a, const void *b)
+{
+	const struct thread *x = (struct thread *)a;
+	const struct thread *y = (struct thread *)b;
+
+	// descending order
+
+	if (x->size > y->size)
+		return -1;
+
+	if (x->size < y->size)
+		return 1;
+
+	return 0;
+}
+
+int print_threads(void)
+{
+	struct thread *sorted;
+	size_t nr_sorted = 0;
+
+	sorted = calloc(nr_threads ? nr_threads : 1, sizeof(*sorted));
+	if (!sorted) {
+		fprintf(stderr, "failed to allocate thread array\n");
+
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < threads_cap; ++i) {
+		if (threads[i].used && threads[i].count)
+			sorted[nr_sorted++] = threads[i];
+
+		// the names stay cached, the usage is per report
+		threads[i].size = 0;
+		threads[i].count = 0;
+	}
+
+	qsort(sorted, nr_sorted, sizeof(sorted[0]), thread_size_compare);
+
+	if (nr_sorted > env.top_stacks)
+		nr_sorted = env.top_stacks;
+
+	printf("Top %zu threads with outstanding allocations:\n", nr_sorted);
+
+	for (size_t i = 0; i < nr_sorted; ++i)
+		printf("\t%zu bytes in %zu allocations from tid %d (%s)\n",
+				sorted[i].size, sorted[i].count, sorted[i].tid, sorted[i].comm);
+
+	free(sorted);
+
+	return 0;
+}
+
+static inline size_t usage_hash(uint64_t key, size_t cap)
+{
+	return (key * 0x9e3779b97f4a7c15ULL) >> 32 & (cap - 1);
+}
+
+int usage_add(struct usage_table *table, uint64_t key, size_t size, size_t count)
+{
+	size_t i;
+
+	// keep the table at most half full
+	if ((table->nr + 1) * 2 > table->cap) {
+		const size_t new_cap = table->cap ? table->cap * 2 : 64;
+		struct usage *entries = calloc(new_cap, sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+
+		for (size_t j = 0; j < table->cap; ++j) {
+			if (!table->entries[j].count)
+				continue;
+
+			for (i = usage_hash(table->entries[j].key, new_cap); entries[i].count; i = (i + 1) & (new_cap - 1))
+				;
+			entries[i] = table->entries[j];
+		}
+
+		free(table->entries);
+		table->entries = entries;
+		table->cap = new_cap;
+	}
+
+	for (i = usage_hash(key, table->cap); table->entries[i].count; i = (i + 1) & (table->cap - 1)) {
+		if (table->entries[i].key == key)
+			break;
+	}
+
+	if (!table->entries[i].count) {
+		table->entries[i].key = key;
+		table->nr++;
+	}
+
+	table->entries[i].size += size;
+	table->entries[i].count += count;
+
+	return 0;
+}
+
+int usage_size_compare(const void *a, const void *b)
+{
+	const struct usage *x = (struct usage *)a;
+	const struct usage *y = (struct usage *)b;
+
+	// descending order
+
+	if (x->size > y->size)
+		return -1;
+
+	if (x->size < y->size)
+		return 1;
+
+	return 0;
+}
+
+// compacts the used entries to the front of the table, largest first;
+// the table must be cleared before it is added to again
+size_t usage_sort(struct usage_table *table)
+{
+	size_t nr = 0;
+
+	for (size_t i = 0; i < table->cap; ++i) {
+		if (table->entries[i].count)
+			table->entries[nr++] = table->entries[i];
+	}
+
+	qsort(table->entries, nr, sizeof(table->entries[0]), usage_size_compare);
+
+	return nr;
+}
+
+void usage_clear(struct usage_table *table)
+{
+	if (table->entries)
+		memset(table->entries, 0, table->cap * sizeof(*table->entries));
+
+	table->nr = 0;
+}
+
+struct usage *usage_find(struct usage_table *table, uint64_t key)
+{
+	if (!table->cap)
+		return NULL;
+
+	for (size_t i = usage_hash(key, table->cap); table->entries[i].count; i = (i + 1) & (table->cap - 1)) {
+		if (table->entries[i].key == key)
+			return &table->entries[i];
+	}
+
+	return NULL;
+}
+
+// divides all entries by 2^shift and drops those reaching zero, which also
+// rehashes a table compacted by usage_sort() so it can be added to again
+int usage_decay(struct usage_table *table, int shift)
+{
+	struct usage *entries;
+	size_t i, nr = 0;
+
+	if (!table->cap)
+		return 0;
+
+	entries = calloc(table->cap, sizeof(*entries));
+	if (!entries)
+		return -ENOMEM;
+
+	for (size_t j = 0; j < table->cap; ++j) {
+		const struct usage old = table->entries[j];
+
+		if (!(old.count >> shift))
+			continue;
+
+		for (i = usage_hash(old.key, table->cap); entries[i].count; i = (i + 1) & (table->cap - 1))
+			;
+		entries[i].key = old.key;
+		entries[i].size = old.size >> shift;
+		entries[i].count = old.count >> shift;
+		nr++;
+	}
+
+	free(table->entries);
+	table->entries = entries;
+	table->nr = nr;
+
+	return 0;
+}
+
+int resolve_tag(void)
+{
+	char path[PATH_MAX];
+	struct elf_var var;
+	uint64_t base;
+
+	// a command has not been exec'ed yet, so read its binary directly
+	if (strlen(env.command))
+		snprintf(path, sizeof(path), "%s", env.command);
+	else
+		snprintf(path, sizeof(path), "/proc/%d/exe", env.pid);
+
+	if (get_elf_var(path, env.tag_symbol, &var)) {
+		fprintf(stderr, "failed to find variable %s in %s\n", env.tag_symbol, path);
+
+		return 1;
+	}
+
+	// the bpf programs read the tag as 8 bytes
+	if (var.size != sizeof(uint64_t)) {
+		fprintf(stderr, "tag variable %s is %lu bytes, not 8\n", env.tag_symbol,
+				(unsigned long)var.size);
+
+		return 1;
+	}
+
+	if (var.tls) {
+		// only the executable's own variables live in the static TLS
+		// block at a fixed offset from the thread pointer
+		if (!var.tls_align)
+			var.tls_align = 1;
+#if defined(__x86_64__)
+		// TLS variant II: the block ends at the thread pointer
+		env.tag_addr = var.addr - ROUND_UP(var.tls_memsz, var.tls_align);
+#elif defined(__aarch64__)
+		// TLS variant I: the block follows the 16 byte thread control block
+		env.tag_addr = ROUND_UP(16, var.tls_align) + var.addr;
+#else
+		fprintf(stderr, "thread-local tags are not supported on this architecture\n");
+
+		return 1;
+#endif
+		env.tag_tls = true;
+
+		return 0;
+	}
+
+	if (!var.pie) {
+		env.tag_addr = var.addr;
+
+		return 0;
+	}
+
+	if (strlen(env.command) || get_pid_exe_base(env.pid, &base)) {
+		fprintf(stderr, "failed to find the load address of %s\n", path);
+
+		return 1;
+	}
+
+	env.tag_addr = base + var.addr - var.load_vaddr;
+
+	return 0;
+}
+
+void print_tags(void)
+{
+	size_t nr_tags = usage_sort(&tags);
+
+	if (nr_tags > env.top_stacks)
+		nr_tags = env.top_stacks;
+
+	printf("Top %zu %s tags with outstanding allocations:\n", nr_tags, env.tag_symbol);
+
+	for (size_t i = 0; i < nr_tags; ++i)
+		printf("\t%zu bytes in %zu allocations with tag %lu (%#lx)\n",
+				tags.entries[i].size, tags.entries[i].count,
+				tags.entries[i].key, tags.entries[i].key);
+
+	usage_clear(&tags);
+}
+
+// parses [BINARY:]PROVIDER:BEGIN:END
+int parse_usdt_window(const char *arg)
+{
+	char *fields[4], buf[256];
+	int nr_fields = 0;
+	char *field;
+
+	if (strlen(arg) >= sizeof(buf))
+		return -1;
+
+	strcpy(buf, arg);
+
+	for (field = strtok(buf, ":"); field; field = strtok(NULL, ":")) {
+		if (nr_fields == 4)
+			return -1;
+
+		fields[nr_fields++] = field;
+	}
+
+	if (nr_fields < 3)
+		return -1;
+
+	if (nr_fields == 4)
+		strncpy(env.window_obj, fields[0], sizeof(env.window_obj) - 1);
+
+	strncpy(env.window_provider, fields[nr_fields - 3], sizeof(env.window_provider) - 1);
+	strncpy(env.window_begin, fields[nr_fields - 2], sizeof(env.window_begin) - 1);
+	strncpy(env.window_end, fields[nr_fields - 1], sizeof(env.window_end) - 1);
+
+	return 0;
+}
+
+int attach_window_usdts(struct memleak_bpf *skel)
+{
+	char path[PATH_MAX];
+
+	// the probes live in the traced executable unless told otherwise,
+	// and a command has not been exec'ed yet
+	if (strlen(env.window_obj))
+		snprintf(path, sizeof(path), "%s", env.window_obj);
+	else if (strlen(env.command))
+		snprintf(path, sizeof(path), "%s", env.command);
+	else
+		snprintf(path, sizeof(path), "/proc/%d/exe", env.pid);
+
+	skel->links.window_begin = bpf_program__attach_usdt(skel->progs.window_begin, env.pid,
+			path, env.window_provider, env.window_begin, NULL);
+	if (!skel->links.window_begin) {
+		fprintf(stderr, "failed to attach usdt %s:%s in %s\n",
+				env.window_provider, env.window_begin, path);
+
+		return -errno;
+	}
+
+	skel->links.window_end = bpf_program__attach_usdt(skel->progs.window_end, env.pid,
+			path, env.window_provider, env.window_end, NULL);
+	if (!skel->links.window_end) {
+		fprintf(stderr, "failed to attach usdt %s:%s in %s\n",
+				env.window_provider, env.window_end, path);
+
+		return -errno;
+	}
+
+	return 0;
+}
+
+// whether the window of the allocation ended at least --window-grace ago
+bool window_expired(int window_ends_fd, const struct alloc_info *alloc_info)
+{
+	uint64_t end_ns;
+
+	if (bpf_map_lookup_elem(window_ends_fd, &alloc_info->window_id, &end_ns))
+		return false;
+
+	// window IDs may be reused, an end before the allocation belongs to an
+	// earlier window and the one of the allocation is still open
+	if (end_ns < alloc_info->timestamp_ns)
+		return false;
+
+	return get_ktime_ns() - end_ns >= (uint64_t)env.window_grace * NSEC_PER_SEC;
+}
+
+void print_windows(void)
+{
+	size_t nr_windows = usage_sort(&windows);
+
+	if (nr_windows > env.top_stacks)
+		nr_windows = env.top_stacks;
+
+	printf("Top %zu %s windows with allocations outstanding %d seconds after the window ended:\n",
+			nr_windows, env.window_provider, env.window_grace);
+
+	for (size_t i = 0; i < nr_windows; ++i)
+		printf("\t%zu bytes in %zu allocations from window %lu (%#lx)\n",
+				windows.entries[i].size, windows.entries[i].count,
+				windows.entries[i].key, windows.entries[i].key);
+
+	usage_clear(&windows);
+}
+
+int setup_free_stacks(struct memleak_bpf *skel)
+{
+	char buf[sizeof(env.free_stacks)];
+	int ret;
+
+	strcpy(buf, env.free_stacks);
+
+	for (char *item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+		char *end;
+
+		errno = 0;
+		const unsigned long stack_id = strtoul(item, &end, 10);
+		if (!errno && end != item && !*end) {
+			ret = target_stack(skel, stack_id);
+			if (ret)
+				return ret;
+
+			continue;
+		}
+
+		if (nr_free_stack_syms == MAX_FREE_STACK_SYMS) {
+			fprintf(stderr, "too many --free-stacks symbols, at most %d\n", MAX_FREE_STACK_SYMS);
+
+			return -EINVAL;
+		}
+
+		strncpy(free_stack_syms[nr_free_stack_syms++], item, sizeof(free_stack_syms[0]) - 1);
+	}
+
+	if (nr_free_stack_syms) {
+		scanned_stacks = calloc(env.stack_map_max_entries, sizeof(*scanned_stacks));
+		if (!scanned_stacks) {
+			fprintf(stderr, "failed to allocate scanned stacks\n");
+
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+int target_stack(struct memleak_bpf *skel, uint64_t stack_id)
+{
+	const uint8_t one = 1;
+
+	if (bpf_map_update_elem(bpf_map__fd(skel->maps.target_stacks), &stack_id, &one, BPF_NOEXIST) &&
+	    errno != EEXIST) {
+		fprintf(stderr, "failed to target stack id %lu: %s\n", stack_id, strerror(errno));
+
+		return -errno;
+	}
+
+	return 0;
+}
+
+// whether a frame of the stack in "stack" is in a --free-stacks symbol
+bool stack_matches_free_stack_syms(void)
+{
+	const blazesym_result *result;
+	bool matched = false;
+
+	if (native_symbols) {
+		const struct syms *syms = native_syms();
+
+		for (size_t j = 0; !matched && j < env.perf_max_stack_depth && stack[j]; ++j) {
+			unsigned long offset;
+			const char *symbol;
+			const char *dso_name;
+
+			symbol = native_symbolize(syms, stack[j], &offset, &dso_name);
+			for (size_t i = 0; !matched && symbol && i < nr_free_stack_syms; ++i)
+				matched = !fnmatch(free_stack_syms[i], symbol, 0);
+		}
+
+		return matched;
+	}
+
+	result = blazesym_symbolize(symbolizer, src_cfgs, nr_src_cfgs, stack, env.perf_max_stack_depth);
+	if (!result)
+		return false;
+
+	for (size_t j = 0; !matched && j < result->size && stack[j]; ++j) {
+		for (size_t k = 0; !matched && k < result->entries[j].size; ++k) {
+			const char *symbol = result->entries[j].syms[k].symbol;
+
+			for (size_t i = 0; !matched && symbol && i < nr_free_stack_syms; ++i)
+				matched = !fnmatch(free_stack_syms[i], symbol, 0);
+		}
+	}
+
+	blazesym_result_free(result);
+
+	return matched;
+}
+
+int update_free_stack_targets(struct memleak_bpf *skel)
+{
+	const int stack_traces_fd = bpf_map__fd(skel->maps.stack_traces);
+	uint32_t prev_key = 0, curr_key;
+	bool first = true;
+	int ret;
+
+	// only stacks recorded since the last scan are symbolized, so
+	// allocations from a stack before it was scanned are not targeted
+	for (; !bpf_map_get_next_key(stack_traces_fd, first ? NULL : &prev_key, &curr_key);
+			prev_key = curr_key, first = false) {
+		if (curr_key >= env.stack_map_max_entries || scanned_stacks[curr_key])
+			continue;
+
+		if (bpf_map_lookup_elem(stack_traces_fd, &curr_key, stack))
+			continue;
+
+		scanned_stacks[curr_key] = 1;
+
+		if (!stack_matches_free_stack_syms())
+			continue;
+
+		ret = target_stack(skel, curr_key);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int print_free_pairs(struct memleak_bpf *skel)
+{
+	const int free_pairs_fd = bpf_map__fd(skel->maps.free_pairs);
+	const int stack_traces_fd = bpf_map__fd(skel->maps.stack_traces);
+	size_t nr_pairs;
+
+	for (uint64_t prev_key = 0, curr_key = 0;; prev_key = curr_key) {
+		union combined_alloc_info pair;
+
+		if (bpf_map_get_next_key(free_pairs_fd, &prev_key, &curr_key)) {
+			if (errno == ENOENT)
+				break; // no more keys, done
+
+			perror("map get next key error");
+
+			return -errno;
+		}
+
+		if (bpf_map_lookup_elem(free_pairs_fd, &curr_key, &pair)) {
+			if (errno == ENOENT)
+				continue;
+
+			perror("map lookup error");
+
+			return -errno;
+		}
+
+		if (usage_add(&free_pairs, curr_key, pair.total_size, pair.number_of_allocs)) {
+			fprintf(stderr, "failed to grow free pair table\n");
+
+			return -ENOMEM;
+		}
+	}
+
+	nr_pairs = usage_sort(&free_pairs);
+	if (nr_pairs > env.top_stacks)
+		nr_pairs = env.top_stacks;
+
+	printf("Top %zu alloc/free stack pairs of targeted allocations:\n", nr_pairs);
+
+	for (size_t i = 0; i < nr_pairs; ++i) {
+		const struct usage *pair = &free_pairs.entries[i];
+		const uint32_t stack_ids[2] = { pair->key >> 32, (uint32_t)pair->key };
+
+		printf("%zu bytes in %zu allocations from stack id %u freed from stack id %u\n",
+				pair->size, pair->count, stack_ids[0], stack_ids[1]);
+
+		for (int j = 0; j < 2; ++j) {
+			printf("\t%s:\n", j ? "freed at" : "allocated at");
+
+			if (bpf_map_lookup_elem(stack_traces_fd, &stack_ids[j], stack)) {
+				printf("\t[stack not found]\n");
+
+				continue;
+			}
+
+			(*print_stack_frames_func)();
+		}
+	}
+
+	usage_clear(&free_pairs);
+
+	return 0;
+}
+
+int realloc_chain_compare(const void *a, const void *b)
+{
+	const struct realloc_chain *x = (struct realloc_chain *)a;
+	const struct realloc_chain *y = (struct realloc_chain *)b;
+
+	// descending order
+
+	if (x->info.copy_bytes > y->info.copy_bytes)
+		return -1;
+
+	if (x->info.copy_bytes < y->info.copy_bytes)
+		return 1;
+
+	return 0;
+}
+
+int print_realloc_chains(struct memleak_bpf *skel)
+{
+	const int realloc_chains_fd = bpf_map__fd(skel->maps.realloc_chains);
+	const int stack_traces_fd = bpf_map__fd(skel->maps.stack_traces);
+	size_t nr_chains = 0;
+
+	for (uint64_t prev_key = 0, curr_key = 0;
+			nr_chains < COMBINED_ALLOCS_MAX_ENTRIES; prev_key = curr_key) {
+		if (bpf_map_get_next_key(realloc_chains_fd, &prev_key, &curr_key)) {
+			if (errno == ENOENT)
+				break; // no more keys, done
+
+			perror("map get next key error");
+
+			return -errno;
+		}
+
+		if (bpf_map_lookup_elem(realloc_chains_fd, &curr_key, &chains[nr_chains].info)) {
+			if (errno == ENOENT)
+				continue;
+
+			perror("map lookup error");
+
+			return -errno;
+		}
+
+		chains[nr_chains++].stack_id = curr_key;
+	}
+
+	qsort(chains, nr_chains, sizeof(chains[0]), realloc_chain_compare);
+
+	if (nr_chains > env.top_stacks)
+		nr_chains = env.top_stacks;
+
+	printf("Top %zu realloc stacks by bytes copied:\n", nr_chains);
+
+	for (size_t i = 0; i < nr_chains; ++i) {
+		const struct realloc_chain_info *info = &chains[i].info;
+
+		printf("%llu bytes copied by %llu reallocs in %llu chains of up to %llu hops from stack\n",
+				info->copy_bytes, info->hops, info->chains, info->max_hops);
+		printf("\t%llu grew by half or more, %llu grew by less",
+				info->geometric, info->small_growth);
+
+		// a chain of reallocs is a buffer that did not know its final size
+		if (info->small_growth > info->geometric)
+			printf(", repeated small growth: reserve() the final size\n");
+		else if (info->max_hops >= 4)
+			printf(", long geometric chain: reserve() the final size\n");
+		else
+			printf("\n");
+
+		if (bpf_map_lookup_elem(stack_traces_fd, &chains[i].stack_id, stack)) {
+			if (errno == ENOENT)
+				continue;
+
+			perror("failed to lookup stack trace");
+
+			return -errno;
+		}
+
+		(*print_stack_frames_func)();
+	}
+
+	return 0;
+}
+
+static inline double remote_free_rate(const struct remote_free_info *info)
+{
+	const uint64_t remote = info->remote_cpu > info->remote_thread ?
+		info->remote_cpu : info->remote_thread;
+
+	return info->frees ? (double)remote / info->frees : 0;
+}
+
+int remote_free_compare(const void *a, const void *b)
+{
+	const struct remote_free *x = (struct remote_free *)a;
+	const struct remote_free *y = (struct remote_free *)b;
+	const double x_rate = remote_free_rate(&x->info);
+	const double y_rate = remote_free_rate(&y->info);
+
+	// descending order, by rate and then by number of frees
+
+	if (x_rate != y_rate)
+		return x_rate > y_rate ? -1 : 1;
+
+	if (x->info.frees > y->info.frees)
+		return -1;
+
+	if (x->info.frees < y->info.frees)
+		return 1;
+
+	return 0;
+}
+
+int print_remote_frees(struct memleak_bpf *skel)
+{
+	const int remote_frees_fd = bpf_map__fd(skel->maps.remote_frees);
+	const int stack_traces_fd = bpf_map__fd(skel->maps.stack_traces);
+	size_t nr_stacks = 0;
+
+	for (uint64_t prev_key = 0, curr_key = 0;
+			nr_stacks < COMBINED_ALLOCS_MAX_ENTRIES; prev_key = curr_key) {
+		if (bpf_map_get_next_key(remote_frees_fd, &prev_key, &curr_key)) {
+			if (errno == ENOENT)
+				break; // no more keys, done
+
+			perror("map get next key error");
+
+			return -errno;
+		}
+
+		if (bpf_map_lookup_elem(remote_frees_fd, &curr_key, &remote_frees[nr_stacks].info)) {
+			if (errno == ENOENT)
+				continue;
+
+			perror("map lookup error");
+
+			return -errno;
+		}
+
+		// just created by the bpf side
+		if (!remote_frees[nr_stacks].info.frees)
+			continue;
+
+		remote_frees[nr_stacks++].stack_id = curr_key;
+	}
+
+	qsort(remote_frees, nr_stacks, sizeof(remote_frees[0]), remote_free_compare);
+
+	if (nr_stacks > env.top_stacks)
+		nr_stacks = env.top_stacks;
+
+	printf("Top %zu stacks by remote free rate:\n", nr_stacks);
+
+	for (size_t i = 0; i < nr_stacks; ++i) {
+		const struct remote_free_info *info = &remote_frees[i].info;
+
+		printf("%llu frees, %.1f%% on another cpu, %.1f%% by another thread, of allocations from stack\n",
+				info->frees, 100.0 * info->remote_cpu / info->frees,
+				100.0 * info->remote_thread / info->frees);
+
+		if (bpf_map_lookup_elem(stack_traces_fd, &remote_frees[i].stack_id, stack)) {
+			if (errno == ENOENT)
+				continue;
+
+			perror("failed to lookup stack trace");
+
+			return -errno;
+		}
+
+		(*print_stack_frames_func)();
+	}
+
+	return 0;
+}
+
+// parses pid=PID|kernel[,sample-rate=N][,min-size=N][,max-size=N]
+int parse_session(char *arg)
+{
+	enum { SESSION_PID, SESSION_KERNEL, SESSION_SAMPLE_RATE, SESSION_MIN_SIZE, SESSION_MAX_SIZE };
+	char *const tokens[] = {
+		[SESSION_PID] = "pid",
+		[SESSION_KERNEL] = "kernel",
+		[SESSION_SAMPLE_RATE] = "sample-rate",
+		[SESSION_MIN_SIZE] = "min-size",
+		[SESSION_MAX_SIZE] = "max-size",
+		NULL,
+	};
+	struct session *session = &sessions[nr_sessions];
+	bool has_pid = false, has_kernel = false;
+	char *value;
+
+	if (nr_sessions == MAX_SESSIONS)
+		return -1;
+
+	memset(session, 0, sizeof(*session));
+	session->pid = -1;
+	session->config.max_size = -1;
+	session->config.sample_rate = 1;
+
+	while (*arg) {
+		const int token = getsubopt(&arg, tokens, &value);
+
+		if (token != SESSION_KERNEL && (token < 0 || !value))
+			return -1;
+
+		switch (token) {
+		case SESSION_PID:
+			session->pid = atoi(value);
+			if (session->pid <= 0)
+				return -1;
+			has_pid = true;
+			break;
+		case SESSION_KERNEL:
+			has_kernel = true;
+			break;
+		case SESSION_SAMPLE_RATE:
+			session->config.sample_rate = strtoull(value, NULL, 10);
+			if (!session->config.sample_rate)
+				return -1;
+			break;
+		case SESSION_MIN_SIZE:
+			session->config.min_size = strtoull(value, NULL, 10);
+			break;
+		case SESSION_MAX_SIZE:
+			session->config.max_size = strtoull(value, NULL, 10);
+			break;
+		}
+	}
+
+	// a session traces either one process or the kernel
+	if (has_pid == has_kernel)
+		return -1;
+
+	if (has_kernel) {
+		if (env.kernel_session)
+			return -1;
+
+		env.kernel_session = true;
+	}
+
+	if (session->config.min_size > session->config.max_size)
+		return -1;
+
+	nr_sessions++;
+
+	return 0;
+}
+
+// fills the maps the bpf programs find the session of an event with
+int setup_sessions(struct memleak_bpf *skel)
+{
+	const int configs_fd = bpf_map__fd(skel->maps.session_configs);
+	const int pids_fd = bpf_map__fd(skel->maps.session_pids);
+
+	for (uint32_t sid = 0; sid < nr_sessions; ++sid) {
+		const struct session *session = &sessions[sid];
+
+		if (bpf_map_update_elem(configs_fd, &sid, &session->config, BPF_ANY)) {
+			perror("failed to set session config");
+
+			return -errno;
+		}
+
+		if (session->pid < 0)
+			continue;
+
+		const uint32_t tgid = session->pid;
+		if (bpf_map_update_elem(pids_fd, &tgid, &sid, BPF_NOEXIST)) {
+			fprintf(stderr, "failed to add session for pid %d: %s\n", session->pid,
+					errno == EEXIST ? "traced by another session" : strerror(errno));
+
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+// the uprobes of session 0 live in the skeleton, the other sessions attach
+// the same programs to their own process
+static const struct session_probe {
+	const char *func;
+	const char *prog;
+	bool retprobe;
+	bool optional;
+} session_probes[] = {
+	{ "malloc", "malloc_enter", false, false },
+	{ "malloc", "malloc_exit", true, false },
+	{ "calloc", "calloc_enter", false, false },
+	{ "calloc", "calloc_exit", true, false },
+	{ "realloc", "realloc_enter", false, false },
+	{ "realloc", "realloc_exit", true, false },
+	{ "mmap", "mmap_enter", false, false },
+	{ "mmap", "mmap_exit", true, false },
+	{ "posix_memalign", "posix_memalign_enter", false, false },
+	{ "posix_memalign", "posix_memalign_exit", true, false },
+	{ "memalign", "memalign_enter", false, false },
+	{ "memalign", "memalign_exit", true, false },
+	{ "free", "free_enter", false, false },
+	{ "munmap", "munmap_enter", false, false },
+	{ "valloc", "valloc_enter", false, true },
+	{ "valloc", "valloc_exit", true, true },
+	{ "pvalloc", "pvalloc_enter", false, true },
+	{ "pvalloc", "pvalloc_exit", true, true },
+	{ "aligned_alloc", "aligned_alloc_enter", false, true },
+	{ "aligned_alloc", "aligned_alloc_exit", true, true },
+};
+
+int attach_session_uprobes(struct memleak_bpf *skel, struct session *session)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	ret = resolve_object(session->pid, path, sizeof(path));
+	if (ret)
+		return ret;
+
+	for (size_t i = 0; i < sizeof(session_probes) / sizeof(session_probes[0]); ++i) {
+		const struct session_probe *probe = &session_probes[i];
+		LIBBPF_OPTS(bpf_uprobe_opts, uprobe_opts,
+				.func_name = probe->func,
+				.retprobe = probe->retprobe);
+		struct bpf_link *link;
+
+		link = bpf_program__attach_uprobe_opts(
+				bpf_object__find_program_by_name(skel->obj, probe->prog),
+				session->pid, path, 0, &uprobe_opts);
+		if (!link) {
+			if (probe->optional)
+				continue;
+
+			fprintf(stderr, "failed to attach %s for pid %d\n", probe->prog, session->pid);
+
+			return -errno;
+		}
+
+		session->links[session->nr_links++] = link;
+	}
+
+	return 0;
+}
+
+void detach_session_uprobes(struct session *session)
+{
+	for (size_t i = 0; i < session->nr_links; ++i)
+		bpf_link__destroy(session->links[i]);
+
+	session->nr_links = 0;
+}
+
+bool following(void)
+{
+	return env.follow_children || strlen(env.follow_exe);
+}
+
+// undoes the session and process bits the bpf side mixes into the keys
+uint64_t alloc_key_address(uint64_t key, const struct alloc_info *alloc_info)
+{
+	uint64_t address = key ^ (uint64_t)alloc_info->session << 56;
+
+	if (many_processes())
+		address ^= (uint64_t)(alloc_info->pid & 0x1ff) << 47 ^
+			(uint64_t)(alloc_info->pid >> 9 & 0x1f) << 59;
+
+	return address;
+}
+
+// adds the already running processes of the followed executable
+int follow_exe_processes(struct memleak_bpf *skel, const struct stat *exe)
+{
+	const int pids_fd = bpf_map__fd(skel->maps.session_pids);
+	const uint32_t sid = 0;
+	struct dirent *entry;
+	char path[64];
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir("/proc");
+	if (!dir) {
+		perror("failed to open /proc");
+
+		return -errno;
+	}
+
+	while ((entry = readdir(dir))) {
+		const uint32_t pid = strtoul(entry->d_name, NULL, 10);
+
+		if (!pid)
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%u/exe", pid);
+		if (stat(path, &st) || st.st_ino != exe->st_ino || st.st_dev != exe->st_dev)
+			continue;
+
+		if (!bpf_map_update_elem(pids_fd, &pid, &sid, BPF_NOEXIST))
+			printf("following pid %u running %s\n", pid, env.follow_exe);
+	}
+
+	closedir(dir);
+
+	return 0;
+}
+
+/*
+ * The uprobes of a followed session are attached to all processes once and
+ * the bpf side filters by tgid, so taking on a new process only adds it to
+ * the session_pids map: no probes are attached and no symbols resolved.
+ * The exec tracepoint recognizes the executable by inode.
+ */
+int setup_follow(struct memleak_bpf *skel, struct stat *exe)
+{
+	if (stat(env.follow_exe, exe)) {
+		fprintf(stderr, "failed to stat %s: %s\n", env.follow_exe, strerror(errno));
+
+		return -errno;
+	}
+
+	// the kernel encodes device numbers as major << 20 | minor
+	skel->rodata->follow_exe_ino = exe->st_ino;
+	skel->rodata->follow_exe_dev = major(exe->st_dev) << 20 | minor(exe->st_dev);
+
+	return 0;
+}
+
+int exited_process_compare(const void *a, const void *b)
+{
+	const pid_t x = ((const struct exited_process *)a)->pid;
+	const pid_t y = ((const struct exited_process *)b)->pid;
+
+	return x < y ? -1 : x > y;
+}
+
+// the memory of the exited processes is gone, so are their leaks
+int drop_exited_allocs(int allocs_fd)
+{
+	struct exited_process *exited, wanted;
+	struct alloc_info alloc_info;
+	uint64_t key, next_key;
+	bool more;
+
+	qsort(exited_processes, nr_exited_processes, sizeof(exited_processes[0]),
+			exited_process_compare);
+
+	more = !bpf_map_get_next_key(allocs_fd, NULL, &key);
+	while (more) {
+		more = !bpf_map_get_next_key(allocs_fd, &key, &next_key);
+
+		if (!bpf_map_lookup_elem(allocs_fd, &key, &alloc_info)) {
+			wanted.pid = alloc_info.pid;
+			exited = bsearch(&wanted, exited_processes, nr_exited_processes,
+					sizeof(exited_processes[0]), exited_process_compare);
+			if (exited && !bpf_map_delete_elem(allocs_fd, &key))
+				exited->nr_dropped++;
+		}
+
+		key = next_key;
+	}
+
+	for (size_t i = 0; i < nr_exited_processes; ++i)
+		printf("pid %u exited, dropped %zu outstanding allocations\n",
+				exited_processes[i].pid, exited_processes[i].nr_dropped);
+
+	nr_exited_processes = 0;
+
+	return 0;
+}
+
+int handle_follow_event(void *ctx, void *data, size_t data_sz)
+{
+	const struct follow_event *event = data;
+
+	switch (event->type) {
+	case FOLLOW_FORK:
+		printf("following pid %u forked by %u\n", event->pid, event->ppid);
+		break;
+	case FOLLOW_EXEC:
+		printf("following pid %u running %s\n", event->pid, env.follow_exe);
+		break;
+	case FOLLOW_EXIT:
+		// dropped at the next tick, along with the other exits
+		if (nr_exited_processes == exited_processes_cap) {
+			const size_t new_cap = exited_processes_cap ? exited_processes_cap * 2 : 64;
+			struct exited_process *exited = realloc(exited_processes,
+					new_cap * sizeof(*exited));
+			if (!exited)
+				return -ENOMEM;
+
+			exited_processes = exited;
+			exited_processes_cap = new_cap;
+		}
+
+		exited_processes[nr_exited_processes].pid = event->pid;
+		exited_processes[nr_exited_processes].nr_dropped = 0;
+		nr_exited_processes++;
+		break;
+	}
+
+	return 0;
+}
+
+// all processes of a pid namespace are traced like followed ones
+bool many_processes(void)
+{
+	return following() || (strlen(env.pidns) && env.pid < 0);
+}
+
+uint64_t mount_ns(pid_t pid)
+{
+	char path[64];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/mnt", pid);
+	if (stat(path, &st))
+		return 0;
+
+	return st.st_ino;
+}
+
+/*
+ * Finds the object to attach the uprobes to. libbpf looks libraries up in
+ * the mount namespace of memleak, for a process of another one the object
+ * it maps is only reachable through its /proc/<pid>/root.
+ */
+int resolve_object(pid_t pid, char *path, size_t path_sz)
+{
+	static const char *const lib_dirs[] = {
+		"/lib64", "/usr/lib64", "/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu",
+		"/lib/aarch64-linux-gnu", "/usr/lib/aarch64-linux-gnu", "/lib", "/usr/lib",
+	};
+	const uint64_t mntns = pid > 0 ? mount_ns(pid) : 0;
+	char buf[PATH_MAX];
+	int ret = -ENOENT;
+	FILE *f;
+
+	snprintf(path, path_sz, "%s", env.object);
+	if (!mntns || mntns == self_mntns)
+		return 0;
+
+	if (env.object[0] == '/') {
+		snprintf(path, path_sz, "/proc/%d/root%s", pid, env.object);
+
+		return 0;
+	}
+
+	snprintf(buf, sizeof(buf), "/proc/%d/maps", pid);
+	f = fopen(buf, "r");
+	if (!f) {
+		fprintf(stderr, "failed to open %s: %s\n", buf, strerror(errno));
+
+		return -errno;
+	}
+
+	while (ret && fgets(buf, sizeof(buf), f)) {
+		const char *mapped = strchr(buf, '/');
+		const char *name;
+
+		if (!mapped)
+			continue;
+
+		buf[strcspn(buf, "\n")] = '\0';
+		name = strrchr(mapped, '/') + 1;
+		if (strcmp(name, env.object))
+			continue;
+
+		snprintf(path, path_sz, "/proc/%d/root%s", pid, mapped);
+		ret = 0;
+	}
+
+	fclose(f);
+
+	// not loaded yet, look in the usual library directories of the namespace
+	for (size_t i = 0; ret && i < sizeof(lib_dirs) / sizeof(lib_dirs[0]); ++i) {
+		snprintf(path, path_sz, "/proc/%d/root%s/%s", pid, lib_dirs[i], env.object);
+		if (!access(path, R_OK))
+			ret = 0;
+	}
+
+	if (ret)
+		fprintf(stderr, "failed to find %s in the mount namespace of pid %d\n", env.object, pid);
+	else
+		printf("using object %s of pid %d\n", path, pid);
+
+	return ret;
+}
+
+// the pid of a process in its own pid namespace, the last NSpid field
+pid_t ns_pid(pid_t pid)
+{
+	char path[64], buf[256];
+	pid_t nspid = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		const char *last;
+
+		if (strncmp(buf, "NSpid:", 6))
+			continue;
+
+		buf[strcspn(buf, "\n")] = '\0';
+		last = strrchr(buf, '\t');
+		nspid = atoi(last ? last + 1 : buf + 6);
+		break;
+	}
+
+	fclose(f);
+
+	return nspid;
+}
+
+// the host pid of the process with pid target in the --pidns namespace, or
+// with a negative target the namespace's init, else any process of it
+pid_t pidns_host_pid(pid_t target)
+{
+	const pid_t wanted = target < 0 ? 1 : target;
+	struct dirent *entry;
+	pid_t found = -1;
+	char path[64];
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir("/proc");
+	if (!dir) {
+		perror("failed to open /proc");
+
+		return -1;
+	}
+
+	while ((entry = readdir(dir))) {
+		const pid_t pid = strtol(entry->d_name, NULL, 10);
+
+		if (pid <= 0)
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
+		if (stat(path, &st) || st.st_ino != pidns_stat.st_ino || st.st_dev != pidns_stat.st_dev)
+			continue;
+
+		if (ns_pid(pid) == wanted) {
+			found = pid;
+			break;
+		}
+
+		if (target < 0 && found < 0)
+			found = pid;
+	}
+
+	closedir(dir);
+
+	return found;
+}
+
+/*
+ * Without a pid all processes of the namespace are traced: the uprobes are
+ * attached to all processes and the bpf side compares the pid namespace of
+ * the task. A pid is taken to be one inside of the namespace.
+ */
+int setup_pidns(void)
+{
+	const pid_t target = env.pid;
+
+	if (stat(env.pidns, &pidns_stat)) {
+		fprintf(stderr, "failed to stat %s: %s\n", env.pidns, strerror(errno));
+
+		return -errno;
+	}
+
+	pidns_pid = pidns_host_pid(target);
+	if (pidns_pid < 0) {
+		if (target < 0)
+			fprintf(stderr, "no process in the pid namespace %s\n", env.pidns);
+		else
+			fprintf(stderr, "no pid %d in the pid namespace %s\n", target, env.pidns);
+
+		return -ESRCH;
+	}
+
+	if (target >= 0) {
+		env.pid = pidns_pid;
+		printf("pid %d in the namespace is host pid %d\n", target, env.pid);
+	}
+
+	return 0;
+}
+
+struct ns_object *get_ns_object(pid_t pid, uint64_t mntns, uint64_t dev, uint64_t ino,
+		const char *path)
+{
+	struct ns_object *object;
+
+	for (object = ns_objects; object; object = object->next) {
+		if (object->mntns == mntns && object->dev == dev && object->ino == ino)
+			break;
+	}
+
+	if (!object) {
+		object = calloc(1, sizeof(*object));
+		if (!object)
+			return NULL;
+
+		object->mntns = mntns;
+		object->dev = dev;
+		object->ino = ino;
+		object->pid = -1;
+		object->next = ns_objects;
+		ns_objects = object;
+	}
+
+	// the process the path goes through is gone, switch to this one
+	if (object->pid < 0 || mount_ns(object->pid) != mntns) {
+		object->pid = pid;
+		snprintf(object->path, sizeof(object->path), "/proc/%d/root%s", pid, path);
+	}
+
+	return object;
+}
+
+/*
+ * blazesym reads the objects of a process at the paths in its maps, which
+ * are only right in the mount namespace of the process. For processes of
+ * another namespace every executable mapping becomes an ELF source of the
+ * object as seen through /proc/<pid>/root, cached by mount namespace and
+ * inode. Returns NULL for processes of the namespace of memleak.
+ */
+struct ns_process *get_ns_process(pid_t pid)
+{
+	struct ns_process *proc, *tmp;
+	char buf[PATH_MAX + 128];
+	uint64_t mntns;
+	FILE *f;
+
+	for (size_t i = 0; i < nr_ns_processes; ++i) {
+		if (ns_processes[i].pid == pid)
+			return &ns_processes[i];
+	}
+
+	mntns = mount_ns(pid);
+	if (!mntns || mntns == self_mntns)
+		return NULL;
+
+	snprintf(buf, sizeof(buf), "/proc/%d/maps", pid);
+	f = fopen(buf, "r");
+	if (!f)
+		return NULL;
+
+	tmp = realloc(ns_processes, (nr_ns_processes + 1) * sizeof(*ns_processes));
+	if (!tmp) {
+		fclose(f);
+
+		return NULL;
+	}
+	ns_processes = tmp;
+	proc = &ns_processes[nr_ns_processes++];
+	memset(proc, 0, sizeof(*proc));
+	proc->pid = pid;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		unsigned long start, ino;
+		unsigned int maj, min;
+		struct ns_object *object;
+		sym_src_cfg *cfgs;
+		char perms[8];
+		int path_pos = 0;
+
+		if (sscanf(buf, "%lx-%*x %7s %*x %x:%x %lu %n", &start, perms, &maj, &min,
+			   &ino, &path_pos) != 5 || !path_pos)
+			continue;
+
+		buf[strcspn(buf, "\n")] = '\0';
+		if (perms[2] != 'x' || !ino || buf[path_pos] != '/' || strstr(buf, " (deleted)"))
+			continue;
+
+		object = get_ns_object(pid, mntns, makedev(maj, min), ino, buf + path_pos);
+		if (!object)
+			break;
+
+		cfgs = realloc(proc->cfgs, (proc->nr_cfgs + 1) * sizeof(*cfgs));
+		if (!cfgs)
+			break;
+
+		proc->cfgs = cfgs;
+		proc->cfgs[proc->nr_cfgs].src_type = SRC_T_ELF;
+		proc->cfgs[proc->nr_cfgs].params.elf.file_name = object->path;
+		proc->cfgs[proc->nr_cfgs].params.elf.base_address = start;
+		proc->nr_cfgs++;
+	}
+
+	fclose(f);
+
+	return proc;
+}
+
+void clear_ns_processes(void)
+{
+	for (size_t i = 0; i < nr_ns_processes; ++i)
+		free(ns_processes[i].cfgs);
+
+	free(ns_processes);
+	ns_processes = NULL;
+	nr_ns_processes = 0;
+
+	src_cfgs = &src_cfg;
+	nr_src_cfgs = 1;
+}
+
+void use_symbol_source(const sym_src_cfg *cfg)
+{
+	const struct ns_process *proc = NULL;
+
+	src_cfg = *cfg;
+	if (cfg->src_type == SRC_T_PROCESS)
+		proc = get_ns_process(cfg->params.process.pid);
+
+	if (proc && proc->nr_cfgs) {
+		src_cfgs = proc->cfgs;
+		nr_src_cfgs = proc->nr_cfgs;
+	} else {
+		src_cfgs = &src_cfg;
+		nr_src_cfgs = 1;
+	}
+}
+
+int add_ring_buffer(int map_fd, ring_buffer_sample_fn sample_cb, void *ctx)
+{
+	// all ring buffers share one epoll set, polled by wait_tick()
+	if (!events_rb) {
+		events_rb = ring_buffer__new(map_fd, sample_cb, ctx, NULL);
+		if (!events_rb) {
+			perror("failed to create ring buffer");
+
+			return -errno;
+		}
+
+		return 0;
+	}
+
+	const int err = ring_buffer__add(events_rb, map_fd, sample_cb, ctx);
+	if (err) {
+		fprintf(stderr, "failed to add ring buffer: %d\n", err);
+
+		return err;
+	}
+
+	return 0;
+}
+
+static inline uint64_t ns_distance(uint64_t a, uint64_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+/*
+ * Pairs every free with the recent frees of objects allocated and freed
+ * within the cohort window of it, counting each partner stack once per
+ * free. Memory stays bounded: the window is a fixed ring and the pair
+ * table is halved whenever it fills up, so rare pairs fade out while the
+ * frequent ones survive.
+ */
+int handle_free_event(void *ctx, void *data, size_t data_sz)
+{
+	const struct free_event *event = data;
+	const uint64_t window_ns = env.cohort_window_ms * 1000000ULL;
+	const uint64_t bytes = event->size * event->weight;
+	uint32_t partners[COHORT_MAX_PARTNERS];
+	size_t nr_partners = 0;
+	bool cofreed = false;
+
+	for (size_t i = 0; i < nr_recent_frees; ++i) {
+		struct recent_free *recent = &recent_frees[i];
+		const uint32_t a = event->stack_id, b = recent->event.stack_id;
+		size_t j;
+
+		if (ns_distance(event->free_ns, recent->event.free_ns) > window_ns ||
+		    ns_distance(event->alloc_ns, recent->event.alloc_ns) > window_ns)
+			continue;
+
+		cofreed = true;
+
+		// the first object of a cohort only learns about it now
+		if (!recent->cofreed) {
+			if (usage_add(&cohort_stacks, b, recent->event.size * recent->event.weight,
+				      recent->event.weight))
+				return -ENOMEM;
+
+			recent->cofreed = true;
+		}
+
+		for (j = 0; j < nr_partners && partners[j] != b; ++j)
+			;
+		if (j < nr_partners || nr_partners == COHORT_MAX_PARTNERS)
+			continue;
+
+		partners[nr_partners++] = b;
+
+		if (usage_add(&cohort_pairs, a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a,
+			      bytes, 1))
+			return -ENOMEM;
+	}
+
+	if (cofreed && usage_add(&cohort_stacks, event->stack_id, bytes, event->weight))
+		return -ENOMEM;
+
+	// the stacks decay along with the pairs their cohorts are made of
+	if (cohort_pairs.nr >= COHORT_MAX_PAIRS &&
+	    (usage_decay(&cohort_pairs, 1) || usage_decay(&cohort_stacks, 1)))
+		return -ENOMEM;
+
+	recent_frees[recent_frees_head].event = *event;
+	recent_frees[recent_frees_head].cofreed = cofreed;
+	recent_frees_head = (recent_frees_head + 1) % COHORT_RECENT;
+	if (nr_recent_frees < COHORT_RECENT)
+		nr_recent_frees++;
+
+	return 0;
+}
+
+static size_t cohort_find(uint64_t *stack_ids, size_t *parents, size_t *nr, uint64_t stack_id)
+{
+	size_t i;
+
+	for (i = 0; i < *nr && stack_ids[i] != stack_id; ++i)
+		;
+
+	if (i == *nr) {
+		stack_ids[i] = stack_id;
+		parents[i] = i;
+		(*nr)++;
+	}
+
+	while (parents[i] != i)
+		i = parents[i] = parents[parents[i]];
+
+	return i;
+}
+
+/*
+ * Groups the stacks of the strongest pairs into cohorts, the connected
+ * components of the pairs, and ranks them by the bytes their objects were
+ * freed together with. With an arena each of those objects saves a malloc
+ * and a free call.
+ */
+int print_cohorts(struct memleak_bpf *skel)
+{
+	const int stack_traces_fd = bpf_map__fd(skel->maps.stack_traces);
+	uint64_t stack_ids[COHORT_MAX_GROUPED_PAIRS * 2];
+	size_t parents[COHORT_MAX_GROUPED_PAIRS * 2];
+	struct usage groups[COHORT_MAX_GROUPED_PAIRS * 2];
+	size_t nr_stacks = 0, nr_groups = 0;
+	size_t nr_pairs = usage_sort(&cohort_pairs);
+
+	if (nr_pairs > COHORT_MAX_GROUPED_PAIRS)
+		nr_pairs = COHORT_MAX_GROUPED_PAIRS;
+
+	for (size_t i = 0; i < nr_pairs; ++i) {
+		const uint64_t key = cohort_pairs.entries[i].key;
+		const size_t a = cohort_find(stack_ids, parents, &nr_stacks, key >> 32);
+		const size_t b = cohort_find(stack_ids, parents, &nr_stacks, (uint32_t)key);
+
+		parents[a] = b;
+	}
+
+	// a group is keyed by the index of its root stack
+	for (size_t i = 0; i < nr_stacks; ++i) {
+		const struct usage *stack_usage = usage_find(&cohort_stacks, stack_ids[i]);
+		const size_t root = cohort_find(stack_ids, parents, &nr_stacks, stack_ids[i]);
+		size_t j;
+
+		for (j = 0; j < nr_groups && groups[j].key != root; ++j)
+			;
+		if (j == nr_groups) {
+			groups[j] = (struct usage){ .key = root };
+			nr_groups++;
+		}
+
+		if (stack_usage) {
+			groups[j].size += stack_usage->size;
+			groups[j].count += stack_usage->count;
+		}
+	}
+
+	qsort(groups, nr_groups, sizeof(groups[0]), usage_size_compare);
+
+	if (nr_groups > env.top_stacks)
+		nr_groups = env.top_stacks;
+
+	printf("Top %zu cohorts of stacks allocated and freed within %d ms:\n",
+			nr_groups, env.cohort_window_ms);
+
+	for (size_t i = 0; i < nr_groups; ++i) {
+		printf("%zu bytes in %zu objects freed together, an arena saves about %zu allocator calls\n",
+				groups[i].size, groups[i].count, groups[i].count * 2);
+
+		for (size_t j = 0; j < nr_stacks; ++j) {
+			const struct usage *stack_usage = usage_find(&cohort_stacks, stack_ids[j]);
+
+			if (cohort_find(stack_ids, parents, &nr_stacks, stack_ids[j]) != groups[i].key)
+				continue;
+
+			printf("\t%zu bytes in %zu objects from stack id %lu\n",
+					stack_usage ? stack_usage->size : 0,
+					stack_usage ? stack_usage->count : 0, stack_ids[j]);
+
+			if (bpf_map_lookup_elem(stack_traces_fd, &stack_ids[j], stack)) {
+				if (errno == ENOENT)
+					continue;
+
+				perror("failed to lookup stack trace");
+
+				return -errno;
+			}
+
+			(*print_stack_frames_func)();
+		}
+	}
+
+	// the pairs keep accumulating across reports
+	return usage_decay(&cohort_pairs, 0);
+}
+
+int intern_unwound_stack(pid_t pid, const unsigned long *frames, size_t nr_frames, uint32_t *index)
+{
+	uint64_t hash = 14695981039346656037ull ^ (uint32_t)pid;
+	struct unwound_stack *unwound;
+	size_t i;
+
+	for (i = 0; i < nr_frames; ++i)
+		hash = (hash ^ frames[i]) * 1099511628211ull;
+
+	// keep the index at most half full
+	if ((nr_unwound_stacks + 1) * 2 > unwound_stack_slots_cap) {
+		const size_t new_cap = unwound_stack_slots_cap ? unwound_stack_slots_cap * 2 : 1024;
+		uint32_t *slots = calloc(new_cap, sizeof(*slots));
+		if (!slots)
+			return -ENOMEM;
+
+		for (size_t j = 0; j < nr_unwound_stacks; ++j) {
+			for (i = usage_hash(unwound_stacks[j].hash, new_cap); slots[i]; i = (i + 1) & (new_cap - 1))
+				;
+			slots[i] = j + 1;
+		}
+
+		free(unwound_stack_slots);
+		unwound_stack_slots = slots;
+		unwound_stack_slots_cap = new_cap;
+	}
+
+	for (i = usage_hash(hash, unwound_stack_slots_cap); unwound_stack_slots[i];
+	     i = (i + 1) & (unwound_stack_slots_cap - 1)) {
+		unwound = &unwound_stacks[unwound_stack_slots[i] - 1];
+
+		if (unwound->hash == hash && unwound->pid == pid && unwound->nr_frames == nr_frames &&
+		    !memcmp(unwound->frames, frames, nr_frames * sizeof(*frames))) {
+			*index = unwound_stack_slots[i] - 1;
+
+			return 0;
+		}
+	}
+
+	// the index is what the stack id of the report is made of
+	if (nr_unwound_stacks == UNWIND_STACK_ID)
+		return -ENOSPC;
+
+	if (nr_unwound_stacks == unwound_stacks_cap) {
+		const size_t new_cap = unwound_stacks_cap ? unwound_stacks_cap * 2 : 1024;
+		struct unwound_stack *stacks = realloc(unwound_stacks, new_cap * sizeof(*stacks));
+		if (!stacks)
+			return -ENOMEM;
+
+		unwound_stacks = stacks;
+		unwound_stacks_cap = new_cap;
+	}
+
+	unwound = &unwound_stacks[nr_unwound_stacks];
+	unwound->frames = malloc(nr_frames * sizeof(*unwound->frames));
+	if (!unwound->frames)
+		return -ENOMEM;
+
+	memcpy(unwound->frames, frames, nr_frames * sizeof(*unwound->frames));
+	unwound->nr_frames = nr_frames;
+	unwound->hash = hash;
+	unwound->pid = pid;
+
+	unwound_stack_slots[i] = nr_unwound_stacks + 1;
+	*index = nr_unwound_stacks++;
+
+	return 0;
+}
+
+int add_unwound_alloc(uint64_t key, uint64_t timestamp_ns, uint32_t stack)
+{
+	struct unwound_alloc *unwound;
+	size_t i;
+
+	// keep the table at most half full
+	if ((nr_unwound_allocs + 1) * 2 > unwound_allocs_cap) {
+		const size_t new_cap = unwound_allocs_cap ? unwound_allocs_cap * 2 : 1024;
+		struct unwound_alloc *entries = calloc(new_cap, sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+
+		for (size_t j = 0; j < unwound_allocs_cap; ++j) {
+			if (!unwound_allocs[j].gen)
+				continue;
+
+			for (i = usage_hash(unwound_allocs[j].key, new_cap); entries[i].gen; i = (i + 1) & (new_cap - 1))
+				;
+			entries[i] = unwound_allocs[j];
+		}
+
+		free(unwound_allocs);
+		unwound_allocs = entries;
+		unwound_allocs_cap = new_cap;
+	}
+
+	for (i = usage_hash(key, unwound_allocs_cap); unwound_allocs[i].gen; i = (i + 1) & (unwound_allocs_cap - 1)) {
+		if (unwound_allocs[i].key == key)
+			break;
+	}
+
+	// an address freed and allocated again replaces its former allocation
+	unwound = &unwound_allocs[i];
+	if (!unwound->gen)
+		nr_unwound_allocs++;
+
+	unwound->key = key;
+	unwound->timestamp_ns = timestamp_ns;
+	unwound->stack = stack;
+	unwound->gen = unwind_gen;
+
+	return 0;
+}
+
+struct unwound_alloc *find_unwound_alloc(uint64_t key)
+{
+	if (!unwound_allocs_cap)
+		return NULL;
+
+	for (size_t i = usage_hash(key, unwound_allocs_cap); unwound_allocs[i].gen;
+	     i = (i + 1) & (unwound_allocs_cap - 1)) {
+		if (unwound_allocs[i].key == key)
+			return &unwound_allocs[i];
+	}
+
+	return NULL;
+}
+
+// drops the allocations the report did not see, which were freed, unless
+// unwound since the last report: those may not have been in the allocs map
+// yet when the report went through it
+int prune_unwound_allocs(void)
+{
+	struct unwound_alloc *entries;
+	size_t i, nr = 0;
+
+	if (unwound_allocs_cap) {
+		entries = calloc(unwound_allocs_cap, sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+
+		for (size_t j = 0; j < unwound_allocs_cap; ++j) {
+			if (unwound_allocs[j].gen < unwind_gen)
+				continue;
+
+			for (i = usage_hash(unwound_allocs[j].key, unwound_allocs_cap); entries[i].gen;
+			     i = (i + 1) & (unwound_allocs_cap - 1))
+				;
+			entries[i] = unwound_allocs[j];
+			nr++;
+		}
+
+		free(unwound_allocs);
+		unwound_allocs = entries;
+		nr_unwound_allocs = nr;
+	}
+
+	unwind_gen++;
+
+	return 0;
+}
+
+int handle_unwind_event(void *ctx, void *data, size_t data_sz)
+{
+	const struct unwind_event *event = data;
+	const unsigned long long start_ns = get_ktime_ns();
+	const struct user_stack user_stack = {
+		.ip = event->ip,
+		.sp = event->sp,
+		.bp = event->bp,
+		.data = event->stack,
+		.size = event->stack_sz,
+	};
+	unsigned long frames[env.perf_max_stack_depth];
+	const struct syms *syms;
+	int nr_frames = -1;
+	uint32_t index;
+	int ret;
+
+	syms = syms_cache__get_syms(syms_cache, event->pid);
+	if (syms)
+		nr_frames = syms__unwind(syms, &user_stack, frames, env.perf_max_stack_depth);
+
+	// the allocating code may be in a library dlopen()ed since the maps
+	// were read, the cache reads them again at most once a second
+	if (nr_frames < 0) {
+		syms = syms_cache__refresh_syms(syms_cache, event->pid);
+		if (syms)
+			nr_frames = syms__unwind(syms, &user_stack, frames, env.perf_max_stack_depth);
+	}
+
+	// the process is gone along with its allocations
+	if (nr_frames <= 0)
+		return 0;
+
+	ret = intern_unwound_stack(event->pid, frames, nr_frames, &index);
+	if (!ret)
+		ret = add_unwound_alloc(event->key, event->timestamp_ns, index);
+	if (ret) {
+		fprintf(stderr, "failed to keep unwound stack: %d\n", ret);
+
+		return ret;
+	}
+
+	unwind_cost.unwinds++;
+	unwind_cost.ns += get_ktime_ns() - start_ns;
+	unwind_cost.frames += nr_frames;
+	unwind_cost.stack_bytes += event->stack_sz;
+
+	return 0;
+}
+
+// the cost includes loading the unwind tables of objects seen the first time
+void print_unwind_cost(void)
+{
+	const uint64_t unwinds = unwind_cost.unwinds ? unwind_cost.unwinds : 1;
+
+	printf("dwarf unwind: %lu stacks unwound in %lu us, %lu ns, %lu frames and %lu bytes of stack per unwind, "
+			"%zu stacks and %zu allocations kept\n",
+			unwind_cost.unwinds, unwind_cost.ns / 1000, unwind_cost.ns / unwinds,
+			unwind_cost.frames / unwinds, unwind_cost.stack_bytes / unwinds,
+			nr_unwound_stacks, nr_unwound_allocs);
+
+	memset(&unwind_cost, 0, sizeof(unwind_cost));
+}
+
+/*
+ * glibc malloc on 64-bit: the request plus the 8 byte size field, rounded
+ * up to 16 bytes and at least 32 bytes. Requests from the mmap threshold
+ * (128KiB by default) on get their own page-rounded mapping.
+ */
+size_t glibc_size_class(size_t size)
+{
+	if (size + 8 >= 128 * 1024)
+		return ROUND_UP(size + 16, env.page_size);
+
+	size = ROUND_UP(size + 8, 16);
+
+	return size < 32 ? 32 : size;
+}
+
+static inline size_t lg_floor(size_t size)
+{
+	return 63 - __builtin_clzl(size);
+}
+
+/*
+ * tcmalloc aligns classes to 8 bytes below 16 bytes, 16 bytes below 128
+ * bytes, then to an eighth of the power of two below the size, and uses
+ * whole 8KiB pages from 256KiB on. Its generated class table merges some
+ * classes further, so this is a lower bound.
+ */
+size_t tcmalloc_size_class(size_t size)
+{
+	size_t align;
+
+	if (size > 256 * 1024)
+		align = 8192;
+	else if (size >= 128)
+		align = ((size_t)1 << lg_floor(size)) / 8;
+	else if (size >= 16)
+		align = 16;
+	else
+		align = 8;
+
+	return ROUND_UP(size ? size : 1, align);
+}
+
+/*
+ * jemalloc uses 8 and then multiples of 16 up to 128 bytes, and four
+ * classes per doubling above that.
+ */
+size_t jemalloc_size_class(size_t size)
+{
+	if (size <= 8)
+		return 8;
+
+	if (size <= 128)
+		return ROUND_UP(size, 16);
+
+	return ROUND_UP(size, (size_t)1 << (lg_floor(size - 1) - 2));
+}
+
+int add_size_class(uint64_t stack_id, size_t size, size_t weight)
+{
+	const size_t class_size = size_class_func(size);
+	const size_t wasted = (class_size - size) * weight;
+	const uint64_t request = size < UINT32_MAX ? size : UINT32_MAX;
+
+	if (usage_add(&size_classes, class_size, wasted, weight))
+		return -ENOMEM;
+
+	return usage_add(&stack_size_classes, stack_id << 32 | request, wasted, weight);
+}
+
+// the requested sizes of a stack wasting the most, stack_size_classes is sorted
+void print_stack_size_classes(uint64_t stack_id)
+{
+	size_t nr_printed = 0;
+
+	for (size_t i = 0; i < stack_size_classes.cap && nr_printed < 3; ++i) {
+		const struct usage *entry = &stack_size_classes.entries[i];
+		const size_t size = (uint32_t)entry->key;
+
+		if (!entry->count)
+			break;
+
+		if (entry->key >> 32 != stack_id || !entry->size)
+			continue;
+
+		printf("\t%zu allocations of %zu bytes in %zu byte %s chunks, %zu bytes wasted\n",
+				entry->count, size, size_class_func(size), env.size_classes, entry->size);
+		nr_printed++;
+	}
+}
+
+void print_size_classes(void)
+{
+	size_t nr_classes = usage_sort(&size_classes);
+	size_t total = 0, wasted = 0;
+
+	for (size_t i = 0; i < nr_classes; ++i) {
+		total += size_classes.entries[i].key * size_classes.entries[i].count;
+		wasted += size_classes.entries[i].size;
+	}
+
+	if (nr_classes > env.top_stacks)
+		nr_classes = env.top_stacks;
+
+	printf("Top %zu %s size classes by internal fragmentation, %zu of %zu bytes wasted (%.1f%%):\n",
+			nr_classes, env.size_classes, wasted, total, total ? 100.0 * wasted / total : 0.0);
+
+	for (size_t i = 0; i < nr_classes; ++i) {
+		const struct usage *entry = &size_classes.entries[i];
+
+		printf("\t%zu allocations of %lu byte chunks for %lu requested bytes, %zu bytes wasted\n",
+				entry->count, entry->key, entry->key * entry->count - entry->size, entry->size);
+	}
+
+	usage_clear(&size_classes);
+	usage_clear(&stack_size_classes);
+}
+
+int print_outstanding_combined_allocs(int combined_allocs_fd, int stack_traces_fd, uint32_t sid)
 {
 	time_t t = time(NULL);
 	struct tm *tm = localtime(&t);
@@ -889,8 +4384,16 @@ int print_outstanding_combined_allocs(int combined_allocs_fd, int stack_traces_f
 			return -errno;
 		}
 
+		// filter by session, the key is the stack id xor'ed with it
+		if (nr_sessions > 1 && curr_key >> 32 != sid)
+			continue;
+
+		// filter invalid stacks, their negative ids are sign-extended
+		if ((int64_t)(curr_key ^ (uint64_t)sid << 32) < 0)
+			continue;
+
 		const struct allocation alloc = {
-			.stack_id = curr_key,
+			.stack_id = curr_key ^ (uint64_t)sid << 32,
 			.size = combined_alloc_info.total_size,
 			.count = combined_alloc_info.number_of_allocs,
 			.allocations = NULL
@@ -913,6 +4416,307 @@ int print_outstanding_combined_allocs(int combined_allocs_fd, int stack_traces_f
 	return 0;
 }
 
+int print_outstanding(struct memleak_bpf *skel)
+{
+	const int stack_traces_fd = bpf_map__fd(skel->maps.stack_traces);
+	int ret = 0;
+
+	clear_ns_processes();
+
+	// the stacks unwound since the last tick, for their allocations
+	if (env.dwarf_unwind) {
+		ret = ring_buffer__consume(events_rb);
+		if (ret < 0) {
+			fprintf(stderr, "failed to consume unwind events: %d\n", ret);
+
+			return ret;
+		}
+
+		ret = 0;
+	}
+
+	for (size_t i = 0; !ret && i < nr_sessions; ++i) {
+		if (nr_sessions > 1) {
+			if (sessions[i].pid < 0)
+				printf("Session %zu, kernel:\n", i);
+			else
+				printf("Session %zu, pid %d:\n", i, sessions[i].pid);
+		}
+
+		// stacks are symbolized in the context of the session
+		use_symbol_source(&sessions[i].src_cfg);
+
+		if (env.combined_only)
+			ret = print_outstanding_combined_allocs(bpf_map__fd(skel->maps.combined_allocs),
+					stack_traces_fd, i);
+		else
+			ret = print_outstanding_allocs(bpf_map__fd(skel->maps.allocs), stack_traces_fd,
+					strlen(env.window_provider) ? bpf_map__fd(skel->maps.window_ends) : -1, i);
+	}
+
+	if (!ret && strlen(env.free_stacks))
+		ret = print_free_pairs(skel);
+
+	if (!ret && env.realloc_chains)
+		ret = print_realloc_chains(skel);
+
+	if (!ret && env.remote_frees)
+		ret = print_remote_frees(skel);
+
+	if (!ret && env.cohort_window_ms)
+		ret = print_cohorts(skel);
+
+	if (!ret && env.dwarf_unwind) {
+		print_unwind_cost();
+
+		ret = prune_unwound_allocs();
+	}
+
+	return ret;
+}
+
+int read_stats(int stats_fd, uint64_t *counts)
+{
+	const int nr_cpus = libbpf_num_possible_cpus();
+	if (nr_cpus < 0) {
+		fprintf(stderr, "failed to get the number of cpus\n");
+
+		return nr_cpus;
+	}
+
+	uint64_t values[nr_cpus];
+
+	for (uint32_t i = 0; i < MEMLEAK_STAT_MAX; ++i) {
+		if (bpf_map_lookup_elem(stats_fd, &i, values)) {
+			perror("failed to lookup stats");
+
+			return -errno;
+		}
+
+		counts[i] = 0;
+		for (int cpu = 0; cpu < nr_cpus; ++cpu)
+			counts[i] += values[cpu];
+	}
+
+	return 0;
+}
+
+uint64_t read_bpf_runtime_ns(struct memleak_bpf *skel)
+{
+	struct bpf_program *prog;
+	uint64_t runtime_ns = 0;
+
+	bpf_object__for_each_program(prog, skel->obj) {
+		struct bpf_prog_info info = {};
+		__u32 info_len = sizeof(info);
+		const int fd = bpf_program__fd(prog);
+
+		if (fd < 0)
+			continue;
+
+		if (!bpf_prog_get_info_by_fd(fd, &info, &info_len))
+			runtime_ns += info.run_time_ns;
+	}
+
+	return runtime_ns;
+}
+
+void print_health(struct memleak_bpf *skel)
+{
+	uint64_t counts[MEMLEAK_STAT_MAX];
+
+	if (read_stats(bpf_map__fd(skel->maps.stats), counts))
+		return;
+
+	printf("health: %lu alloc events, %lu free events, %lu allocs dropped, %lu stack errors, "
+			"%lu alerts dropped, %lu free events dropped, %lu unwinds dropped, %lu breaker trips, "
+			"%lu seconds detached%s\n",
+			counts[MEMLEAK_STAT_ALLOC_EVENTS], counts[MEMLEAK_STAT_FREE_EVENTS],
+			counts[MEMLEAK_STAT_ALLOCS_DROPPED], counts[MEMLEAK_STAT_STACK_ERRORS],
+			counts[MEMLEAK_STAT_ALERTS_DROPPED], counts[MEMLEAK_STAT_FREE_EVENTS_DROPPED],
+			counts[MEMLEAK_STAT_UNWINDS_DROPPED],
+			breaker.trips, breaker.detached_secs,
+			breaker.tripped ? " (probes detached)" : "");
+}
+
+int clear_map(int fd)
+{
+	uint64_t key;
+
+	// keys are at most 8 bytes wide, so a u64 buffer fits all of our maps
+	while (!bpf_map_get_next_key(fd, NULL, &key)) {
+		if (bpf_map_delete_elem(fd, &key) && errno != ENOENT) {
+			perror("failed to delete map element");
+
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+int breaker_tick(struct memleak_bpf *skel)
+{
+	const unsigned long long now = get_ktime_ns();
+	uint64_t counts[MEMLEAK_STAT_MAX];
+	int ret;
+
+	if (breaker.tripped) {
+		breaker.detached_secs++;
+
+		if (--breaker.cooldown_left > 0)
+			return 0;
+
+		ret = attach_probes(skel);
+		if (ret)
+			return ret;
+
+		printf("cool-down over, re-attached probes\n");
+
+		// all probes are back, so a new capture window begins
+		if (env.capture_window)
+			duty_cycle_reset(skel);
+
+		breaker.tripped = false;
+		breaker.over_secs = 0;
+		breaker.last_ns = 0;
+	}
+
+	ret = read_stats(bpf_map__fd(skel->maps.stats), counts);
+	if (ret)
+		return ret;
+
+	const uint64_t events = counts[MEMLEAK_STAT_ALLOC_EVENTS] + counts[MEMLEAK_STAT_FREE_EVENTS];
+	const uint64_t runtime_ns = env.max_bpf_runtime_ms ? read_bpf_runtime_ns(skel) : 0;
+	const unsigned long long elapsed_ns = now - breaker.last_ns;
+	const bool have_baseline = breaker.last_ns != 0;
+
+	// normalize both counters to a one second window
+	const uint64_t rate = have_baseline && elapsed_ns ?
+		(events - breaker.last_events) * NSEC_PER_SEC / elapsed_ns : 0;
+	const uint64_t runtime_ms = have_baseline && elapsed_ns ?
+		(runtime_ns - breaker.last_runtime_ns) * 1000 / elapsed_ns : 0;
+
+	breaker.last_events = events;
+	breaker.last_runtime_ns = runtime_ns;
+	breaker.last_ns = now;
+
+	const bool over = (env.max_event_rate && rate > env.max_event_rate) ||
+		(env.max_bpf_runtime_ms && runtime_ms > env.max_bpf_runtime_ms);
+
+	breaker.over_secs = over ? breaker.over_secs + 1 : 0;
+	if (breaker.over_secs < env.breaker_hold)
+		return 0;
+
+	printf("overload: %lu events/s, %lu ms/s of bpf run time for %d seconds, detaching probes for %d seconds\n",
+			rate, runtime_ms, breaker.over_secs, env.breaker_cooldown);
+
+	// flush what was collected before the probes go away
+	print_outstanding(skel);
+
+	detach_probes(skel);
+
+	// frees are not observed while detached, so anything still tracked
+	// would turn into a false leak once the probes come back
+	clear_map(bpf_map__fd(skel->maps.allocs));
+	clear_map(bpf_map__fd(skel->maps.combined_allocs));
+	clear_map(bpf_map__fd(skel->maps.sizes));
+	clear_map(bpf_map__fd(skel->maps.memptrs));
+	clear_map(bpf_map__fd(skel->maps.stack_budgets));
+	clear_map(bpf_map__fd(skel->maps.active_windows));
+	clear_map(bpf_map__fd(skel->maps.realloc_origins));
+
+	breaker.tripped = true;
+	breaker.cooldown_left = env.breaker_cooldown;
+	breaker.trips++;
+
+	return 0;
+}
+
+size_t get_allocs_address_range(int allocs_fd, uint64_t *min, uint64_t *max)
+{
+	size_t nr_allocs = 0;
+
+	*min = UINT64_MAX;
+	*max = 0;
+
+	for (uint64_t prev_key = 0, curr_key = 0;
+			!bpf_map_get_next_key(allocs_fd, nr_allocs ? &prev_key : NULL, &curr_key);
+			prev_key = curr_key) {
+		if (curr_key < *min)
+			*min = curr_key;
+		if (curr_key > *max)
+			*max = curr_key;
+
+		nr_allocs++;
+	}
+
+	return nr_allocs;
+}
+
+void duty_cycle_reset(struct memleak_bpf *skel)
+{
+	skel->bss->free_only = false;
+
+	duty.free_only = false;
+	duty.phase_left = env.capture_window;
+}
+
+int duty_cycle_tick(struct memleak_bpf *skel)
+{
+	uint64_t min, max;
+
+	if (--duty.phase_left > 0)
+		return 0;
+
+	// the observation period is over, the caller reports what is left
+	if (duty.free_only)
+		return 1;
+
+	// the capture window is over, keep only the probes releasing memory
+	detach_alloc_uprobes(skel);
+
+	const size_t nr_allocs = get_allocs_address_range(bpf_map__fd(skel->maps.allocs), &min, &max);
+
+	skel->bss->free_addr_min = min;
+	skel->bss->free_addr_max = max;
+	skel->bss->free_only = true;
+
+	duty.free_only = true;
+	duty.phase_left = env.observe_period;
+
+	printf("capture window closed with %zu allocations tracked, observing frees for %d seconds\n",
+			nr_allocs, env.observe_period);
+
+	return 0;
+}
+
+int duty_cycle_restart(struct memleak_bpf *skel)
+{
+	int ret;
+
+	ret = clear_map(bpf_map__fd(skel->maps.allocs));
+	if (!ret)
+		ret = clear_map(bpf_map__fd(skel->maps.combined_allocs));
+	if (!ret)
+		ret = clear_map(bpf_map__fd(skel->maps.stack_budgets));
+	if (ret)
+		return ret;
+
+	duty_cycle_reset(skel);
+
+	ret = attach_alloc_uprobes(skel);
+	if (ret) {
+		fprintf(stderr, "failed to re-attach allocation uprobes\n");
+
+		return ret;
+	}
+
+	printf("capture window opened for %d seconds\n", env.capture_window);
+
+	return 0;
+}
+
 void disable_kernel_node_tracepoints(struct memleak_bpf *skel)
 {
 	bpf_program__set_autoload(skel->progs.memleak__kmalloc_node, false);
@@ -939,7 +4743,7 @@ void disable_kernel_tracepoints(struct memleak_bpf *skel)
 	bpf_program__set_autoload(skel->progs.memleak__percpu_free_percpu, false);
 }
 
-int attach_uprobes(struct memleak_bpf *skel)
+int attach_alloc_uprobes(struct memleak_bpf *skel)
 {
 	ATTACH_UPROBE_CHECKED(skel, malloc, malloc_enter);
 	ATTACH_URETPROBE_CHECKED(skel, malloc, malloc_exit);
@@ -947,7 +4751,6 @@ int attach_uprobes(struct memleak_bpf *skel)
 	ATTACH_UPROBE_CHECKED(skel, calloc, calloc_enter);
 	ATTACH_URETPROBE_CHECKED(skel, calloc, calloc_exit);
 
-	ATTACH_UPROBE_CHECKED(skel, realloc, realloc_enter);
 	ATTACH_URETPROBE_CHECKED(skel, realloc, realloc_exit);
 
 	ATTACH_UPROBE_CHECKED(skel, mmap, mmap_enter);
@@ -959,9 +4762,6 @@ int attach_uprobes(struct memleak_bpf *skel)
 	ATTACH_UPROBE_CHECKED(skel, memalign, memalign_enter);
 	ATTACH_URETPROBE_CHECKED(skel, memalign, memalign_exit);
 
-	ATTACH_UPROBE_CHECKED(skel, free, free_enter);
-	ATTACH_UPROBE_CHECKED(skel, munmap, munmap_enter);
-
 	// the following probes are intentinally allowed to fail attachment
 
 	// deprecated in libc.so bionic
@@ -977,4 +4777,108 @@ int attach_uprobes(struct memleak_bpf *skel)
 	ATTACH_URETPROBE(skel, aligned_alloc, aligned_alloc_exit);
 
 	return 0;
-}
\ No newline at end of file
+}
+
+int attach_free_uprobes(struct memleak_bpf *skel)
+{
+	// realloc_enter releases the old pointer, so it stays with the frees
+	ATTACH_UPROBE_CHECKED(skel, realloc, realloc_enter);
+
+	ATTACH_UPROBE_CHECKED(skel, free, free_enter);
+	ATTACH_UPROBE_CHECKED(skel, munmap, munmap_enter);
+
+	return 0;
+}
+
+void detach_alloc_uprobes(struct memleak_bpf *skel)
+{
+	DETACH_PROBE(skel, malloc_enter);
+	DETACH_PROBE(skel, malloc_exit);
+	DETACH_PROBE(skel, calloc_enter);
+	DETACH_PROBE(skel, calloc_exit);
+	DETACH_PROBE(skel, realloc_exit);
+	DETACH_PROBE(skel, mmap_enter);
+	DETACH_PROBE(skel, mmap_exit);
+	DETACH_PROBE(skel, posix_memalign_enter);
+	DETACH_PROBE(skel, posix_memalign_exit);
+	DETACH_PROBE(skel, memalign_enter);
+	DETACH_PROBE(skel, memalign_exit);
+	DETACH_PROBE(skel, valloc_enter);
+	DETACH_PROBE(skel, valloc_exit);
+	DETACH_PROBE(skel, pvalloc_enter);
+	DETACH_PROBE(skel, pvalloc_exit);
+	DETACH_PROBE(skel, aligned_alloc_enter);
+	DETACH_PROBE(skel, aligned_alloc_exit);
+}
+
+int attach_uprobes(struct memleak_bpf *skel)
+{
+	int ret;
+
+	if (strlen(env.window_provider)) {
+		ret = attach_window_usdts(skel);
+		if (ret)
+			return ret;
+	}
+
+	ret = attach_alloc_uprobes(skel);
+	if (ret)
+		return ret;
+
+	return attach_free_uprobes(skel);
+}
+int attach_probes(struct memleak_bpf *skel)
+{
+	int ret;
+
+	// if userspace oriented, attach upbrobes
+	if (!env.kernel_trace) {
+		ret = attach_uprobes(skel);
+		if (ret) {
+			fprintf(stderr, "failed to attach uprobes\n");
+
+			return ret;
+		}
+	}
+
+	for (size_t i = 1; i < nr_sessions; ++i) {
+		if (sessions[i].pid < 0)
+			continue;
+
+		ret = attach_session_uprobes(skel, &sessions[i]);
+		if (ret)
+			return ret;
+	}
+
+	ret = memleak_bpf__attach(skel);
+	if (ret) {
+		fprintf(stderr, "failed to attach bpf program(s)\n");
+
+		return ret;
+	}
+
+	return 0;
+}
+
+void detach_probes(struct memleak_bpf *skel)
+{
+	// the followed processes are kept track of while detached, and
+	// memleak_bpf__attach() skips the programs that still have a link
+	struct bpf_link *fork_link = skel->links.memleak__sched_process_fork;
+	struct bpf_link *exec_link = skel->links.memleak__sched_process_exec;
+	struct bpf_link *exit_link = skel->links.memleak__sched_process_exit;
+
+	skel->links.memleak__sched_process_fork = NULL;
+	skel->links.memleak__sched_process_exec = NULL;
+	skel->links.memleak__sched_process_exit = NULL;
+
+	// destroys the links of the uprobes attached by hand as well
+	memleak_bpf__detach(skel);
+
+	skel->links.memleak__sched_process_fork = fork_link;
+	skel->links.memleak__sched_process_exec = exec_link;
+	skel->links.memleak__sched_process_exit = exit_link;
+
+	for (size_t i = 1; i < nr_sessions; ++i)
+		detach_session_uprobes(&sessions[i]);
+}
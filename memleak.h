@@ -3,11 +3,32 @@
 
 #define ALLOCS_MAX_ENTRIES 1000000
 #define COMBINED_ALLOCS_MAX_ENTRIES 10240
+#define ALERT_STACK_DEPTH 127
+#define MAX_SESSIONS 8
+#define UNWIND_STACK_SIZE 8192
+/* the stack id of allocations whose stack is unwound in userspace */
+#define UNWIND_STACK_ID (1 << 30)
 
 struct alloc_info {
 	__u64 size;
 	__u64 timestamp_ns;
 	int stack_id;
+	__u32 weight; /* allocations this one stands for, see --stack-budget */
+	__u32 tid;
+	__u32 targeted; /* capture the freeing stack, see --free-stacks */
+	__u64 tag; /* user-defined context, see --tag */
+	__u64 window_id; /* leak check window, see --usdt-window */
+	__u32 realloc_hops; /* reallocs since the first allocation of the object */
+	__u32 cpu;
+	__u32 session; /* see --session */
+	__u32 pid;
+};
+
+/* filters of one session, see --session */
+struct session_config {
+	__u64 min_size;
+	__u64 max_size;
+	__u64 sample_rate;
 };
 
 union combined_alloc_info {
@@ -18,4 +39,84 @@ union combined_alloc_info {
 	__u64 bits;
 };
 
+/* per-stack state of the sampling budget */
+struct stack_budget_info {
+	__u64 live; /* tracked allocations still outstanding */
+	__u64 seen; /* allocations seen while over budget */
+};
+
+/* reallocs from one stack, see --realloc-chains */
+struct realloc_chain_info {
+	__u64 hops; /* reallocs of a tracked allocation */
+	__u64 chains; /* of them, the first realloc of their object */
+	__u64 max_hops; /* longest chain of reallocs ending here */
+	__u64 copy_bytes; /* implied memcpy of the reallocs that moved */
+	__u64 geometric; /* reallocs growing by at least half */
+	__u64 small_growth; /* reallocs growing by less than half */
+};
+
+/* frees of one stack's allocations, see --remote-frees */
+struct remote_free_info {
+	__u64 frees;
+	__u64 remote_cpu; /* freed on another cpu than allocated on */
+	__u64 remote_thread; /* freed by another thread than allocated by */
+};
+
+/* pushed through the "alerts" ring buffer for allocations above --alert-size */
+struct alert_event {
+	__u64 size;
+	__u64 address;
+	__u64 timestamp_ns;
+	__u32 pid;
+	__u32 tid;
+	__u32 nr_frames;
+	__u64 stack[ALERT_STACK_DEPTH];
+};
+
+/* pushed through the "free_events" ring buffer, see --cohorts */
+struct free_event {
+	__u64 size;
+	__u64 alloc_ns;
+	__u64 free_ns;
+	__s32 stack_id;
+	__u32 weight;
+};
+
+/* pushed through the "unwind_events" ring buffer, see --dwarf-unwind */
+struct unwind_event {
+	__u64 key; /* of the allocation in the allocs map */
+	__u64 timestamp_ns;
+	__u64 ip;
+	__u64 sp;
+	__u64 bp;
+	__u32 pid;
+	__u32 stack_sz; /* bytes copied from sp */
+	__u8 stack[UNWIND_STACK_SIZE];
+};
+
+enum follow_event_type {
+	FOLLOW_FORK,
+	FOLLOW_EXEC,
+	FOLLOW_EXIT,
+};
+
+/* pushed through the "follow_events" ring buffer, see --follow-children */
+struct follow_event {
+	__u32 type;
+	__u32 pid;
+	__u32 ppid;
+};
+
+/* indexes into the per-cpu "stats" health counters */
+enum memleak_stat {
+	MEMLEAK_STAT_ALLOC_EVENTS,
+	MEMLEAK_STAT_FREE_EVENTS,
+	MEMLEAK_STAT_ALLOCS_DROPPED,
+	MEMLEAK_STAT_STACK_ERRORS,
+	MEMLEAK_STAT_ALERTS_DROPPED,
+	MEMLEAK_STAT_FREE_EVENTS_DROPPED,
+	MEMLEAK_STAT_UNWINDS_DROPPED,
+	MEMLEAK_STAT_MAX,
+};
+
 #endif /* __MEMLEAK_H */
\ No newline at end of file
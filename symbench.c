@@ -0,0 +1,634 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+//
+// Compares the symbolizer backends of memleak on running processes and on
+// the kernel: the time to load the symbols of the objects, the lookup
+// throughput once they are loaded, and the memory it costs. Each backend
+// runs in a forked child, so the resident set sizes don't mix.
+//
+// With -t, the native backend is also stressed by several threads sharing
+// one struct syms, checked against a single-threaded pass.
+#include <argp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blazesym.h"
+#include "trace_helpers.h"
+
+static struct env {
+	size_t nr_addrs;
+	int rounds;
+	int threads;
+	const char *cache_dir;
+} env = {
+	.nr_addrs = 10000, // -n --addrs
+	.rounds = 10, // -r --rounds
+	.threads = 0, // -t --threads
+	.cache_dir = NULL, // -c --cache
+};
+
+#define MAX_TARGETS 64
+static const char *targets[MAX_TARGETS];
+static int nr_targets;
+
+// a target: a process or the kernel (pid 0), and addresses to look up in it
+static struct target {
+	pid_t pid;
+	uint64_t *addrs;
+	size_t nr_addrs;
+	size_t nr_objects;
+} target;
+
+struct result {
+	double load_ms;
+	double lookups_per_sec;
+	long rss_kib;
+	size_t found;
+};
+
+// a thread of the stress run, with its symbolization of every address
+struct worker {
+	pthread_t thread;
+	int id;
+	const struct syms *syms;
+	pthread_barrier_t *cold_done;
+	struct sym_info *infos;
+};
+
+static error_t argp_parse_arg(int key, char *arg, struct argp_state *state);
+
+static long rss_kib(void);
+static uint64_t next_random(uint64_t *state);
+static int sample_process_addrs(pid_t pid);
+static int sample_kernel_addrs(void);
+
+static int bench_native(struct result *result);
+static void *native_worker(void *arg);
+static int bench_native_threads(struct result *result);
+static int bench_blazesym(struct result *result);
+static int run_forked(const char *name, int (*bench)(struct result *result));
+
+const char argp_args_doc[] =
+"Benchmark the symbolizer backends of memleak\n"
+"\n"
+"USAGE: symbench [-h] [-n ADDRS] [-r ROUNDS] [-t THREADS] [-c DIR] PID|kernel...\n"
+"\n"
+"EXAMPLES:\n"
+"./symbench $(pidof server)\n"
+"        Symbolize 10000 addresses in the executable mappings of server\n"
+"        with both backends\n"
+"./symbench -n 100000 -r 3 kernel\n"
+"        Symbolize 100000 kernel text addresses, three times each\n"
+"./symbench -t 8 $(pidof server)\n"
+"        Also symbolize with 8 threads sharing the native symbols, starting\n"
+"        before any symbol table is loaded\n"
+"./symbench -c /tmp/symcache $(pidof server)\n"
+"        Load the native symbol tables through a cache in /tmp/symcache, run\n"
+"        twice to compare a cold and a warm cache\n"
+"";
+
+static const struct argp_option argp_options[] = {
+	// name/longopt:str, key/shortopt:int, arg:str, flags:int, doc:str
+	{"addrs", 'n', "ADDRS", 0, "number of addresses to look up (default 10000)"},
+	{"rounds", 'r', "ROUNDS", 0, "lookups of every address once symbols are loaded (default 10)"},
+	{"threads", 't', "THREADS", 0, "also run the native backend with this many threads"},
+	{"cache", 'c', "DIR", 0, "keep the native symbol tables in DIR (must exist)"},
+	{},
+};
+
+int main(int argc, char *argv[])
+{
+	static const struct argp argp = {
+		.options = argp_options,
+		.parser = argp_parse_arg,
+		.args_doc = "PID|kernel...",
+		.doc = argp_args_doc,
+	};
+	int ret = 0;
+
+	if (argp_parse(&argp, argc, argv, 0, NULL, NULL)) {
+		fprintf(stderr, "failed to parse args\n");
+
+		return 1;
+	}
+
+	syms__set_cache_dir(env.cache_dir);
+
+	for (int i = 0; !ret && i < nr_targets; ++i) {
+		memset(&target, 0, sizeof(target));
+
+		if (!strcmp(targets[i], "kernel")) {
+			ret = sample_kernel_addrs();
+			if (ret)
+				break;
+
+			printf("kernel: %zu addresses\n", target.nr_addrs);
+		} else {
+			target.pid = atoi(targets[i]);
+			if (target.pid <= 0) {
+				fprintf(stderr, "invalid pid: %s\n", targets[i]);
+				ret = 1;
+
+				break;
+			}
+
+			ret = sample_process_addrs(target.pid);
+			if (ret)
+				break;
+
+			printf("pid %d: %zu addresses in %zu objects\n", target.pid,
+					target.nr_addrs, target.nr_objects);
+		}
+
+		printf("%-10s %10s %14s %10s %10s\n", "backend", "load ms", "lookups/s", "rss KiB", "found");
+
+		ret = run_forked("native", bench_native);
+		if (!ret && env.threads && target.pid) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "native/%d", env.threads);
+			ret = run_forked(name, bench_native_threads);
+		}
+		if (!ret)
+			ret = run_forked("blazesym", bench_blazesym);
+
+		free(target.addrs);
+	}
+
+	return ret ? 1 : 0;
+}
+
+error_t argp_parse_arg(int key, char *arg, struct argp_state *state)
+{
+	switch (key) {
+	case 'n':
+		env.nr_addrs = strtoul(arg, NULL, 10);
+		if (!env.nr_addrs)
+			argp_usage(state);
+		break;
+	case 't':
+		env.threads = atoi(arg);
+		if (env.threads <= 0)
+			argp_usage(state);
+		break;
+	case 'c':
+		env.cache_dir = arg;
+		break;
+	case 'r':
+		env.rounds = atoi(arg);
+		if (env.rounds <= 0)
+			argp_usage(state);
+		break;
+	case ARGP_KEY_ARG:
+		if (nr_targets >= MAX_TARGETS)
+			argp_usage(state);
+		targets[nr_targets++] = arg;
+		break;
+	case ARGP_KEY_END:
+		if (!nr_targets)
+			argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+long rss_kib(void)
+{
+	long size, resident;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return -1;
+
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+
+	fclose(f);
+
+	return resident < 0 ? -1 : resident * (sysconf(_SC_PAGE_SIZE) / 1024);
+}
+
+// xorshift64, the addresses are the same for both backends
+uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+
+	return *state;
+}
+
+// spreads the addresses evenly over the executable file mappings
+int sample_process_addrs(pid_t pid)
+{
+	struct range {
+		uint64_t start;
+		uint64_t end;
+	} *ranges = NULL, *tmp;
+	size_t nr_ranges = 0, total = 0;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	char path[64], buf[4096];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+
+		return -errno;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		unsigned long start, end, ino;
+		char perms[8];
+
+		if (sscanf(buf, "%lx-%lx %7s %*x %*x:%*x %lu", &start, &end, perms, &ino) != 4)
+			continue;
+		if (perms[2] != 'x' || !ino)
+			continue;
+
+		tmp = realloc(ranges, (nr_ranges + 1) * sizeof(*ranges));
+		if (!tmp) {
+			fclose(f);
+			free(ranges);
+
+			return -ENOMEM;
+		}
+		ranges = tmp;
+		ranges[nr_ranges].start = start;
+		ranges[nr_ranges].end = end;
+		nr_ranges++;
+		total += end - start;
+	}
+
+	fclose(f);
+
+	if (!nr_ranges) {
+		fprintf(stderr, "no executable mappings in pid %d\n", pid);
+
+		return -ENOENT;
+	}
+
+	target.addrs = calloc(env.nr_addrs, sizeof(*target.addrs));
+	if (!target.addrs) {
+		free(ranges);
+
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < env.nr_addrs; ++i) {
+		uint64_t offset = next_random(&seed) % total;
+		size_t j = 0;
+
+		while (offset >= ranges[j].end - ranges[j].start) {
+			offset -= ranges[j].end - ranges[j].start;
+			j++;
+		}
+
+		target.addrs[i] = ranges[j].start + offset;
+	}
+
+	target.nr_addrs = env.nr_addrs;
+	target.nr_objects = nr_ranges;
+	free(ranges);
+
+	return 0;
+}
+
+// picks addresses inside of the kernel text symbols of kallsyms
+int sample_kernel_addrs(void)
+{
+	uint64_t *text = NULL, *tmp;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	size_t nr_text = 0, cap = 0;
+	char buf[512];
+	FILE *f;
+
+	f = fopen("/proc/kallsyms", "r");
+	if (!f) {
+		perror("failed to open /proc/kallsyms");
+
+		return -errno;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		unsigned long addr;
+		char type;
+
+		if (sscanf(buf, "%lx %c", &addr, &type) != 2 || !addr)
+			continue;
+		if (type != 't' && type != 'T')
+			continue;
+
+		if (nr_text == cap) {
+			cap = cap ? cap * 2 : 4096;
+			tmp = realloc(text, cap * sizeof(*text));
+			if (!tmp) {
+				fclose(f);
+				free(text);
+
+				return -ENOMEM;
+			}
+			text = tmp;
+		}
+		text[nr_text++] = addr;
+	}
+
+	fclose(f);
+
+	if (!nr_text) {
+		fprintf(stderr, "no kernel text symbols, kallsyms needs root\n");
+
+		return -EPERM;
+	}
+
+	target.addrs = calloc(env.nr_addrs, sizeof(*target.addrs));
+	if (!target.addrs) {
+		free(text);
+
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < env.nr_addrs; ++i)
+		target.addrs[i] = text[next_random(&seed) % nr_text] + next_random(&seed) % 16;
+
+	target.nr_addrs = env.nr_addrs;
+	free(text);
+
+	return 0;
+}
+
+// the first pass loads the symbols of the objects, lazily for both backends
+int bench_native(struct result *result)
+{
+	struct syms *syms = NULL;
+	struct ksyms *ksyms = NULL;
+	unsigned long long start;
+	struct sym sym;
+	size_t found = 0;
+
+	start = get_ktime_ns();
+
+	if (target.pid)
+		syms = syms__load_pid(target.pid);
+	else
+		ksyms = ksyms__load();
+	if (!syms && !ksyms) {
+		fprintf(stderr, "failed to load native symbols\n");
+
+		return -1;
+	}
+
+	for (size_t i = 0; i < target.nr_addrs; ++i) {
+		if (syms ? !syms__map_addr(syms, target.addrs[i], &sym) :
+			   !!ksyms__map_addr(ksyms, target.addrs[i]))
+			found++;
+	}
+
+	result->load_ms = (get_ktime_ns() - start) / 1e6;
+	result->found = found;
+
+	start = get_ktime_ns();
+
+	for (int round = 0; round < env.rounds; ++round) {
+		for (size_t i = 0; i < target.nr_addrs; ++i) {
+			if (syms)
+				syms__map_addr(syms, target.addrs[i], &sym);
+			else
+				ksyms__map_addr(ksyms, target.addrs[i]);
+		}
+	}
+
+	result->lookups_per_sec = (double)env.rounds * target.nr_addrs * NSEC_PER_SEC /
+		(get_ktime_ns() - start + 1);
+	result->rss_kib = rss_kib();
+
+	syms__free(syms);
+	ksyms__free(ksyms);
+
+	return 0;
+}
+
+// every worker starts at another address, so they race for different dsos
+void *native_worker(void *arg)
+{
+	struct worker *worker = arg;
+	const size_t first = target.nr_addrs / env.threads * worker->id;
+
+	for (int round = 0; round <= env.rounds; ++round) {
+		for (size_t k = 0; k < target.nr_addrs; ++k) {
+			const size_t i = (first + k) % target.nr_addrs;
+
+			syms__map_addr_dso(worker->syms, target.addrs[i], &worker->infos[i]);
+		}
+
+		if (!round)
+			pthread_barrier_wait(worker->cold_done);
+	}
+
+	return NULL;
+}
+
+// the load time is the cold round, with the threads loading the tables
+int bench_native_threads(struct result *result)
+{
+	struct worker *workers;
+	pthread_barrier_t cold_done;
+	unsigned long long start;
+	struct sym_info expected;
+	size_t mismatches = 0;
+	struct syms *syms;
+	int ret = 0;
+
+	syms = syms__load_pid(target.pid);
+	if (!syms) {
+		fprintf(stderr, "failed to load native symbols\n");
+
+		return -1;
+	}
+
+	workers = calloc(env.threads, sizeof(*workers));
+	if (!workers) {
+		syms__free(syms);
+
+		return -ENOMEM;
+	}
+
+	pthread_barrier_init(&cold_done, NULL, env.threads + 1);
+
+	start = get_ktime_ns();
+
+	for (int i = 0; i < env.threads; ++i) {
+		workers[i].id = i;
+		workers[i].syms = syms;
+		workers[i].cold_done = &cold_done;
+		workers[i].infos = calloc(target.nr_addrs, sizeof(*workers[i].infos));
+		if (!workers[i].infos ||
+		    pthread_create(&workers[i].thread, NULL, native_worker, &workers[i])) {
+			fprintf(stderr, "failed to start worker %d\n", i);
+
+			// the ones running wait for the others at the barrier
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&cold_done);
+	result->load_ms = (get_ktime_ns() - start) / 1e6;
+
+	start = get_ktime_ns();
+
+	for (int i = 0; i < env.threads; ++i)
+		pthread_join(workers[i].thread, NULL);
+
+	result->lookups_per_sec = (double)env.rounds * env.threads * target.nr_addrs * NSEC_PER_SEC /
+		(get_ktime_ns() - start + 1);
+	result->rss_kib = rss_kib();
+
+	for (size_t i = 0; i < target.nr_addrs; ++i) {
+		syms__map_addr_dso(syms, target.addrs[i], &expected);
+		if (expected.sym_name)
+			result->found++;
+
+		for (int j = 0; j < env.threads; ++j) {
+			const struct sym_info *info = &workers[j].infos[i];
+
+			if (info->dso_name != expected.dso_name || info->dso_offset != expected.dso_offset ||
+			    info->sym_name != expected.sym_name || info->sym_offset != expected.sym_offset)
+				mismatches++;
+		}
+	}
+
+	if (mismatches) {
+		fprintf(stderr, "%zu lookups of the threads differ from a single-threaded one\n",
+				mismatches);
+		ret = -1;
+	}
+
+	pthread_barrier_destroy(&cold_done);
+	for (int i = 0; i < env.threads; ++i)
+		free(workers[i].infos);
+	free(workers);
+	syms__free(syms);
+
+	return ret;
+}
+
+int bench_blazesym(struct result *result)
+{
+	const blazesym_result *symbolized;
+	unsigned long long start;
+	blazesym *symbolizer;
+	sym_src_cfg cfg;
+	size_t found = 0;
+
+	if (target.pid) {
+		cfg.src_type = SRC_T_PROCESS;
+		cfg.params.process.pid = target.pid;
+	} else {
+		cfg.src_type = SRC_T_KERNEL;
+		cfg.params.kernel.kallsyms = NULL;
+		cfg.params.kernel.kernel_image = NULL;
+	}
+
+	start = get_ktime_ns();
+
+	symbolizer = blazesym_new();
+	if (!symbolizer) {
+		fprintf(stderr, "failed to load blazesym\n");
+
+		return -1;
+	}
+
+	symbolized = blazesym_symbolize(symbolizer, &cfg, 1, target.addrs, target.nr_addrs);
+	for (size_t i = 0; symbolized && i < symbolized->size; ++i) {
+		if (symbolized->entries[i].size)
+			found++;
+	}
+	blazesym_result_free(symbolized);
+
+	result->load_ms = (get_ktime_ns() - start) / 1e6;
+	result->found = found;
+
+	start = get_ktime_ns();
+
+	for (int round = 0; round < env.rounds; ++round)
+		blazesym_result_free(blazesym_symbolize(symbolizer, &cfg, 1, target.addrs,
+					target.nr_addrs));
+
+	result->lookups_per_sec = (double)env.rounds * target.nr_addrs * NSEC_PER_SEC /
+		(get_ktime_ns() - start + 1);
+	result->rss_kib = rss_kib();
+
+	blazesym_free(symbolizer);
+
+	return 0;
+}
+
+// the rss is reported as the growth over the rss of the fresh child
+int run_forked(const char *name, int (*bench)(struct result *result))
+{
+	struct result result = {};
+	int fds[2], status;
+	long base_rss;
+	pid_t pid;
+
+	if (pipe(fds)) {
+		perror("failed to create pipe");
+
+		return -errno;
+	}
+
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("failed to fork");
+		close(fds[0]);
+		close(fds[1]);
+
+		return -errno;
+	}
+
+	if (!pid) {
+		close(fds[0]);
+
+		base_rss = rss_kib();
+		if (bench(&result))
+			_exit(1);
+
+		result.rss_kib -= base_rss;
+		if (write(fds[1], &result, sizeof(result)) != sizeof(result))
+			_exit(1);
+
+		_exit(0);
+	}
+
+	close(fds[1]);
+
+	if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+		result.load_ms = -1;
+	close(fds[0]);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) ||
+	    result.load_ms < 0) {
+		fprintf(stderr, "%s backend failed\n", name);
+
+		return 1;
+	}
+
+	printf("%-10s %10.1f %14.0f %10ld %10zu\n", name, result.load_ms, result.lookups_per_sec,
+			result.rss_kib, result.found);
+
+	return 0;
+}
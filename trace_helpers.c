@@ -13,13 +13,17 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <bpf/bpf.h>
 #include <bpf/btf.h>
 #include <bpf/libbpf.h>
 #include <limits.h>
 #include "trace_helpers.h"
+#include "uprobe_helpers.h"
 
 #define min(x, y) ({				\
 	typeof(x) _min1 = (x);			\
@@ -34,104 +38,428 @@
 
 #define MKDEV(ma, mi)	(((ma) << MINORBITS) | (mi))
 
+/*
+ * The names live in one buffer: the text of /proc/kallsyms, cut into
+ * strings in place, or the mapped snapshot of an earlier load.
+ */
 struct ksyms {
 	struct ksym *syms;
 	int syms_sz;
-	int syms_cap;
 	char *strs;
-	int strs_sz;
-	int strs_cap;
+	size_t strs_sz;
+	/* the snapshot strs is mapped from, if any */
+	void *cache_map;
+	size_t cache_map_sz;
+	/* open addressing table of the symbols by name, built on first use */
+	struct ksym_slot *index;
+	unsigned int index_mask;
+	/* 0 until the index is built, 1 once it is, -1 if it failed */
+	int indexed;
+	pthread_mutex_t index_lock;
+};
+
+struct ksym_slot {
+	uint32_t hash;
+	/* index of the symbol + 1, 0 for an empty slot */
+	int sym;
+};
+
+#define KSYMS_CACHE_MAGIC	"MLKSYMS"
+#define KSYMS_CACHE_VERSION	1
+
+/* followed by the symbols, sorted like ksyms->syms, and then the names */
+struct ksyms_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t syms_sz;
+	uint64_t strs_sz;
+};
+
+struct ksyms_cache_sym {
+	uint64_t addr;
+	/* offset of the name in the names */
+	uint64_t name;
 };
 
-static int ksyms__add_symbol(struct ksyms *ksyms, const char *name, unsigned long addr)
+static char sym_cache_dir[PATH_MAX];
+
+static int ksym_cmp(const void *p1, const void *p2)
 {
-	size_t new_cap, name_len = strlen(name) + 1;
-	struct ksym *ksym;
-	void *tmp;
+	const struct ksym *s1 = p1, *s2 = p2;
 
-	if (ksyms->strs_sz + name_len > ksyms->strs_cap) {
-		new_cap = ksyms->strs_cap * 4 / 3;
-		if (new_cap < ksyms->strs_sz + name_len)
-			new_cap = ksyms->strs_sz + name_len;
-		if (new_cap < 1024)
-			new_cap = 1024;
-		tmp = realloc(ksyms->strs, new_cap);
-		if (!tmp)
-			return -1;
-		ksyms->strs = tmp;
-		ksyms->strs_cap = new_cap;
+	if (s1->addr == s2->addr)
+		return strcmp(s1->name, s2->name);
+	return s1->addr < s2->addr ? -1 : 1;
+}
+
+static uint32_t name_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name)
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+	return hash;
+}
+
+/* reads a whole file, which for procfs has no size to go by */
+static char *read_file(const char *path, size_t *size)
+{
+	size_t sz = 0, cap = 1 << 20;
+	char *buf = NULL, *tmp;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	while (true) {
+		if (!buf || cap - sz < 4096) {
+			cap = buf ? cap * 2 : cap;
+			/* one more byte to terminate the last line */
+			tmp = realloc(buf, cap + 1);
+			if (!tmp)
+				goto err_out;
+			buf = tmp;
+		}
+
+		ret = read(fd, buf + sz, cap - sz);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			goto err_out;
+		}
+		if (!ret)
+			break;
+		sz += ret;
 	}
-	if (ksyms->syms_sz + 1 > ksyms->syms_cap) {
-		new_cap = ksyms->syms_cap * 4 / 3;
-		if (new_cap < 1024)
-			new_cap = 1024;
-		tmp = realloc(ksyms->syms, sizeof(*ksyms->syms) * new_cap);
-		if (!tmp)
+
+	close(fd);
+	buf[sz] = '\0';
+	*size = sz;
+	return buf;
+
+err_out:
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Lines are "<hex address> <type> <name>[\t[<module>]]". The names are cut
+ * out in place, so the buffer becomes the strings of the symbols.
+ */
+static int ksyms__parse(struct ksyms *ksyms, char *buf, size_t size)
+{
+	char *p = buf, *end = buf + size, *eol, *name;
+	unsigned long addr;
+	int nr_lines = 0, i, j;
+	unsigned int c;
+
+	for (eol = buf; (eol = memchr(eol, '\n', end - eol)); eol++)
+		nr_lines++;
+
+	ksyms->syms = malloc(sizeof(*ksyms->syms) * (nr_lines + 1));
+	if (!ksyms->syms)
+		return -1;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		for (addr = 0; ; p++) {
+			c = (unsigned char)*p;
+			if (c - '0' < 10)
+				addr = addr << 4 | (c - '0');
+			else if ((c | 0x20) - 'a' < 6)
+				addr = addr << 4 | ((c | 0x20) - 'a' + 10);
+			else
+				break;
+		}
+
+		/* " T name" */
+		if (p + 3 >= eol || p[0] != ' ' || p[2] != ' ')
 			return -1;
-		ksyms->syms = tmp;
-		ksyms->syms_cap = new_cap;
+
+		name = p + 3;
+		p = memchr(name, '\t', eol - name);
+		if (!p)
+			p = eol;
+		*p = '\0';
+
+		ksyms->syms[ksyms->syms_sz].name = name;
+		ksyms->syms[ksyms->syms_sz].addr = addr;
+		ksyms->syms_sz++;
+
+		p = eol + 1;
+	}
+
+	ksyms->strs = buf;
+	ksyms->strs_sz = size + 1;
+
+	/*
+	 * kallsyms lists symbols by address, so only the names of the ones at
+	 * the same address are left to sort. With hidden addresses, that is
+	 * all of them.
+	 */
+	for (i = 1; i < ksyms->syms_sz; i++) {
+		if (ksyms->syms[i - 1].addr > ksyms->syms[i].addr) {
+			qsort(ksyms->syms, ksyms->syms_sz, sizeof(*ksyms->syms),
+			      ksym_cmp);
+			return 0;
+		}
 	}
+	for (i = 0; i < ksyms->syms_sz; i = j) {
+		for (j = i + 1; j < ksyms->syms_sz &&
+		     ksyms->syms[j].addr == ksyms->syms[i].addr; j++)
+			;
+		if (j - i > 1)
+			qsort(ksyms->syms + i, j - i, sizeof(*ksyms->syms),
+			      ksym_cmp);
+	}
+	return 0;
+}
+
+static int ksyms__build_index(struct ksyms *ksyms)
+{
+	unsigned int size = 1, slot;
+	uint32_t hash;
+	int i, j;
 
-	ksym = &ksyms->syms[ksyms->syms_sz];
-	/* while constructing, re-use pointer as just a plain offset */
-	ksym->name = (void *)(unsigned long)ksyms->strs_sz;
-	ksym->addr = addr;
+	while (size < 2 * (unsigned int)ksyms->syms_sz)
+		size <<= 1;
+
+	ksyms->index = calloc(size, sizeof(*ksyms->index));
+	if (!ksyms->index)
+		return -1;
+	ksyms->index_mask = size - 1;
 
-	memcpy(ksyms->strs + ksyms->strs_sz, name, name_len);
-	ksyms->strs_sz += name_len;
-	ksyms->syms_sz++;
+	/* the first one of a name wins, as it did for a linear scan */
+	for (i = 0; i < ksyms->syms_sz; i++) {
+		hash = name_hash(ksyms->syms[i].name);
+		slot = hash & ksyms->index_mask;
+		while ((j = ksyms->index[slot].sym)) {
+			if (ksyms->index[slot].hash == hash &&
+			    !strcmp(ksyms->syms[j - 1].name, ksyms->syms[i].name))
+				break;
+			slot = (slot + 1) & ksyms->index_mask;
+		}
+		if (!j) {
+			ksyms->index[slot].hash = hash;
+			ksyms->index[slot].sym = i + 1;
+		}
+	}
 
 	return 0;
 }
 
-static int ksym_cmp(const void *p1, const void *p2)
+static int ksyms__ensure_index(struct ksyms *ksyms)
 {
-	const struct ksym *s1 = p1, *s2 = p2;
+	int indexed = __atomic_load_n(&ksyms->indexed, __ATOMIC_ACQUIRE);
 
-	if (s1->addr == s2->addr)
-		return strcmp(s1->name, s2->name);
-	return s1->addr < s2->addr ? -1 : 1;
+	if (indexed)
+		return indexed > 0 ? 0 : -1;
+
+	pthread_mutex_lock(&ksyms->index_lock);
+	indexed = ksyms->indexed;
+	if (!indexed) {
+		indexed = ksyms__build_index(ksyms) ? -1 : 1;
+		__atomic_store_n(&ksyms->indexed, indexed, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&ksyms->index_lock);
+
+	return indexed > 0 ? 0 : -1;
 }
 
-struct ksyms *ksyms__load(void)
+/*
+ * The snapshot of /proc/kallsyms is valid as long as the kernel and its
+ * modules are the same, so it is named after the boot ID and a hash of
+ * /proc/modules. Symbols of bpf programs loaded since are not in it.
+ */
+static int get_boot_id(char *boot_id, size_t sz)
 {
-	char sym_type, sym_name[256];
-	struct ksyms *ksyms;
-	unsigned long sym_addr;
-	int i, ret;
+	char *nl;
 	FILE *f;
 
-	f = fopen("/proc/kallsyms", "r");
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
 	if (!f)
-		return NULL;
+		return -1;
+	if (!fgets(boot_id, sz, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	nl = strchr(boot_id, '\n');
+	if (nl)
+		*nl = '\0';
+	return 0;
+}
 
-	ksyms = calloc(1, sizeof(*ksyms));
-	if (!ksyms)
+static int ksyms__cache_path(char *path, size_t path_sz)
+{
+	uint64_t hash = 14695981039346656037ull;
+	char boot_id[64], *modules;
+	size_t size, i;
+
+	if (!sym_cache_dir[0] || get_boot_id(boot_id, sizeof(boot_id)))
+		return -1;
+
+	modules = read_file("/proc/modules", &size);
+	if (modules) {
+		for (i = 0; i < size; i++)
+			hash = (hash ^ (unsigned char)modules[i]) * 1099511628211ull;
+		free(modules);
+	}
+
+	if (snprintf(path, path_sz, "%s/k-%s-%016llx", sym_cache_dir, boot_id,
+		     (unsigned long long)hash) >= (int)path_sz)
+		return -1;
+	return 0;
+}
+
+static int ksyms__load_from_cache(struct ksyms *ksyms, const char *path)
+{
+	const struct ksyms_cache_header *hdr;
+	const struct ksyms_cache_sym *syms;
+	struct stat st;
+	void *map;
+	int fd;
+	uint32_t i;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	syms = (const struct ksyms_cache_sym *)(hdr + 1);
+	if (memcmp(hdr->magic, KSYMS_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != KSYMS_CACHE_VERSION || !hdr->strs_sz ||
+	    sizeof(*hdr) + hdr->syms_sz * sizeof(*syms) + hdr->strs_sz !=
+	    (uint64_t)st.st_size ||
+	    ((char *)map)[st.st_size - 1])
 		goto err_out;
 
-	while (true) {
-		ret = fscanf(f, "%lx %c %s%*[^\n]\n",
-			     &sym_addr, &sym_type, sym_name);
-		if (ret == EOF && feof(f))
-			break;
-		if (ret != 3)
-			goto err_out;
-		if (ksyms__add_symbol(ksyms, sym_name, sym_addr))
+	ksyms->syms = malloc(sizeof(*ksyms->syms) * (hdr->syms_sz + 1));
+	if (!ksyms->syms)
+		goto err_out;
+
+	ksyms->strs = (char *)(syms + hdr->syms_sz);
+	ksyms->strs_sz = hdr->strs_sz;
+	for (i = 0; i < hdr->syms_sz; i++) {
+		if (syms[i].name >= hdr->strs_sz)
 			goto err_out;
+		ksyms->syms[i].name = ksyms->strs + syms[i].name;
+		ksyms->syms[i].addr = syms[i].addr;
+	}
+	ksyms->syms_sz = hdr->syms_sz;
+	ksyms->cache_map = map;
+	ksyms->cache_map_sz = st.st_size;
+	return 0;
+
+err_out:
+	free(ksyms->syms);
+	ksyms->syms = NULL;
+	ksyms->strs = NULL;
+	munmap(map, st.st_size);
+	return -1;
+}
+
+/* written to a temporary file first, so readers never see a partial one */
+static void ksyms__save(const struct ksyms *ksyms, const char *path)
+{
+	struct ksyms_cache_header hdr = {
+		.magic = KSYMS_CACHE_MAGIC,
+		.version = KSYMS_CACHE_VERSION,
+	};
+	struct ksyms_cache_sym *syms = NULL;
+	char tmp[PATH_MAX], *strs = NULL;
+	size_t len;
+	bool ok;
+	int fd, i;
+
+	/* addresses are all zero when kptr_restrict hides them from us */
+	if (!ksyms->syms_sz || !ksyms->syms[ksyms->syms_sz - 1].addr)
+		return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		return;
+
+	/* the names only, without the addresses and types around them */
+	syms = malloc(sizeof(*syms) * ksyms->syms_sz);
+	strs = malloc(ksyms->strs_sz);
+	if (!syms || !strs)
+		goto out;
+
+	for (i = 0; i < ksyms->syms_sz; i++) {
+		len = strlen(ksyms->syms[i].name) + 1;
+		syms[i].addr = ksyms->syms[i].addr;
+		syms[i].name = hdr.strs_sz;
+		memcpy(strs + hdr.strs_sz, ksyms->syms[i].name, len);
+		hdr.strs_sz += len;
 	}
+	hdr.syms_sz = ksyms->syms_sz;
 
-	/* now when strings are finalized, adjust pointers properly */
-	for (i = 0; i < ksyms->syms_sz; i++)
-		ksyms->syms[i].name += (unsigned long)ksyms->strs;
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0)
+		goto out;
 
-	qsort(ksyms->syms, ksyms->syms_sz, sizeof(*ksyms->syms), ksym_cmp);
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	     write(fd, syms, sizeof(*syms) * hdr.syms_sz) ==
+	     (ssize_t)(sizeof(*syms) * hdr.syms_sz) &&
+	     write(fd, strs, hdr.strs_sz) == (ssize_t)hdr.strs_sz;
+	close(fd);
+
+	if (!ok || rename(tmp, path))
+		unlink(tmp);
+
+out:
+	free(syms);
+	free(strs);
+}
+
+struct ksyms *ksyms__load(void)
+{
+	char path[PATH_MAX];
+	struct ksyms *ksyms;
+	bool cached;
+	size_t size;
+	char *buf;
+
+	ksyms = calloc(1, sizeof(*ksyms));
+	if (!ksyms)
+		return NULL;
+	pthread_mutex_init(&ksyms->index_lock, NULL);
+
+	cached = !ksyms__cache_path(path, sizeof(path));
+	if (!cached || ksyms__load_from_cache(ksyms, path)) {
+		buf = read_file("/proc/kallsyms", &size);
+		if (!buf)
+			goto err_out;
+		if (ksyms__parse(ksyms, buf, size)) {
+			/* not owned by ksyms until it is parsed */
+			if (!ksyms->strs)
+				free(buf);
+			goto err_out;
+		}
+		if (cached)
+			ksyms__save(ksyms, path);
+	}
 
-	fclose(f);
 	return ksyms;
 
 err_out:
 	ksyms__free(ksyms);
-	fclose(f);
 	return NULL;
 }
 
@@ -140,8 +468,13 @@ void ksyms__free(struct ksyms *ksyms)
 	if (!ksyms)
 		return;
 
+	if (ksyms->cache_map)
+		munmap(ksyms->cache_map, ksyms->cache_map_sz);
+	else
+		free(ksyms->strs);
 	free(ksyms->syms);
-	free(ksyms->strs);
+	free(ksyms->index);
+	pthread_mutex_destroy(&ksyms->index_lock);
 	free(ksyms);
 }
 
@@ -170,11 +503,20 @@ const struct ksym *ksyms__map_addr(const struct ksyms *ksyms,
 const struct ksym *ksyms__get_symbol(const struct ksyms *ksyms,
 				     const char *name)
 {
+	unsigned int slot;
+	uint32_t hash;
 	int i;
 
-	for (i = 0; i < ksyms->syms_sz; i++) {
-		if (strcmp(ksyms->syms[i].name, name) == 0)
-			return &ksyms->syms[i];
+	if (ksyms__ensure_index((struct ksyms *)ksyms))
+		return NULL;
+
+	hash = name_hash(name);
+	slot = hash & ksyms->index_mask;
+	while ((i = ksyms->index[slot].sym)) {
+		if (ksyms->index[slot].hash == hash &&
+		    strcmp(ksyms->syms[i - 1].name, name) == 0)
+			return &ksyms->syms[i - 1];
+		slot = (slot + 1) & ksyms->index_mask;
 	}
 
 	return NULL;
@@ -194,8 +536,77 @@ enum elf_type {
 	UNKNOWN,
 };
 
+/*
+ * A symbol of a dso. The table is the same in memory and in the symbol
+ * cache files, so a cached one is used right from the mapped file.
+ */
+struct dso_sym {
+	uint64_t start;
+	uint64_t size;
+	/* offset of the name in the strings of the dso */
+	uint64_t name;
+};
+
+#define SYM_CACHE_MAGIC		"MLSYMTAB"
+#define SYM_CACHE_VERSION	1
+
+/* followed by the symbols and then the strings */
+struct sym_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t syms_sz;
+	uint64_t strs_sz;
+};
+
+/* how the CFA of an unwind row is computed, see struct unwind_row */
+enum unwind_cfa {
+	/* no unwind info, frame pointers are assumed */
+	UNWIND_CFA_NONE,
+	UNWIND_CFA_SP,
+	UNWIND_CFA_BP,
+	/* the return address is undefined, the outermost frame */
+	UNWIND_CFA_END,
+};
+
+/*
+ * The rule to unwind one frame of x86_64 code from pc up to the pc of the
+ * next row: the CFA is the value of a register plus an offset, the return
+ * address is right below the CFA and rbp is restored from the CFA plus
+ * rbp_off unless that is 0. Rows are the same in memory and in the cache.
+ */
+struct unwind_row {
+	uint64_t pc;
+	int32_t cfa_off;
+	int16_t rbp_off;
+	uint8_t cfa;
+	uint8_t pad;
+};
+
+#define UNWIND_CACHE_MAGIC	"MLUNWTAB"
+#define UNWIND_CACHE_VERSION	1
+
+/* followed by the rows */
+struct unwind_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t rows_sz;
+};
+
+/* the part of the address space owned by a perf map symbol */
+struct perf_map_region {
+	uint64_t start;
+	uint64_t end;
+	int sym;
+};
+
+struct name_block;
+
 struct dso {
 	char *name;
+	/* the file, to tell a library replaced at the same path apart */
+	uint64_t dev_major;
+	uint64_t dev_minor;
+	uint64_t inode;
 	struct load_range *ranges;
 	int range_sz;
 	/* Dyn's first text section virtual addr at execution */
@@ -204,9 +615,38 @@ struct dso {
 	uint64_t sh_offset;
 	enum elf_type type;
 
-	struct sym *syms;
+	/* sorted by start address */
+	struct dso_sym *syms;
 	int syms_sz;
 	int syms_cap;
+	const char *strs;
+	/* the symbol cache file syms and strs are mapped from, if any */
+	void *cache_map;
+	size_t cache_map_sz;
+	/* 0 until the symbol table is loaded, 1 once it is, -1 if it failed */
+	int loaded;
+
+	/* the unwind rows of .eh_frame sorted by pc, loaded like the symbols */
+	struct unwind_row *unwind_rows;
+	int unwind_rows_sz;
+	int unwind_rows_cap;
+	void *unwind_map;
+	size_t unwind_map_sz;
+	int unwind_loaded;
+
+	/*
+	 * A perf map: its symbols in the order of the file, the regions
+	 * indexing the first indexed_sz of them, and the part read so far.
+	 */
+	struct sym *jit_syms;
+	int jit_syms_sz;
+	int jit_syms_cap;
+	struct perf_map_region *regions;
+	int regions_sz;
+	int indexed_sz;
+	struct name_block *names;
+	uint64_t perf_map_off;
+	unsigned long long perf_map_read_ns;
 
 	/*
 	 * libbpf's struct btf is actually a pretty efficient
@@ -225,9 +665,32 @@ struct map {
 	uint64_t inode;
 };
 
+/* an executable range of a dso in the address index of a process */
+struct range_entry {
+	uint64_t end;
+	/* added to an address in the range to get the offset in the dso */
+	uint64_t adjust;
+	int dso;
+};
+
 struct syms {
+	/* the maps file the dsos were read from, for syms__refresh() */
+	char *maps_path;
+	/* the process, for its perf map, or 0 */
+	int tgid;
 	struct dso *dsos;
 	int dso_sz;
+
+	/*
+	 * All ranges of all dsos sorted by start address. The starts are
+	 * kept apart from the rest so the search touches fewer cache lines.
+	 */
+	uint64_t *range_starts;
+	struct range_entry *ranges;
+	int range_sz;
+
+	/* serializes the lazy loading of dso symbol tables */
+	pthread_mutex_t load_lock;
 };
 
 static bool is_file_backed(const char *mapname)
@@ -245,9 +708,24 @@ static bool is_file_backed(const char *mapname)
 		STARTS_WITH(mapname, "[vsyscall]"));
 }
 
+/* JIT code, which the perf map of the process may have the symbols of */
+static bool is_anon(const char *mapname)
+{
+	return !mapname[0] ||
+		STARTS_WITH(mapname, "//anon") ||
+		STARTS_WITH(mapname, "[anon:");
+}
+
 static bool is_perf_map(const char *path)
 {
-	return false;
+	const char *p = path + sizeof("/tmp/perf-") - 1;
+
+	if (strncmp(path, "/tmp/perf-", sizeof("/tmp/perf-") - 1) ||
+	    !isdigit(*p))
+		return false;
+	while (isdigit(*p))
+		p++;
+	return !strcmp(p, ".map");
 }
 
 static bool is_vdso(const char *path)
@@ -310,10 +788,51 @@ err_out:
 	return err;
 }
 
-static int syms__add_dso(struct syms *syms, struct map *map, const char *name)
+static int dso__init(struct dso *dso, struct map *map, const char *name)
+{
+	int type;
+
+	memset(dso, 0, sizeof(*dso));
+	dso->name = strdup(name);
+	dso->dev_major = map->dev_major;
+	dso->dev_minor = map->dev_minor;
+	dso->inode = map->inode;
+	dso->btf = btf__new_empty();
+	if (!dso->name || !dso->btf)
+		goto err_out;
+
+	type = is_perf_map(name) ? -1 : get_elf_type(name);
+	if (type == ET_EXEC) {
+		dso->type = EXEC;
+	} else if (type == ET_DYN) {
+		dso->type = DYN;
+		if (get_elf_text_scn_info(name, &dso->sh_addr, &dso->sh_offset) < 0)
+			goto err_out;
+	} else if (is_perf_map(name)) {
+		dso->type = PERF_MAP;
+	} else if (is_vdso(name)) {
+		dso->type = VDSO;
+	} else {
+		dso->type = UNKNOWN;
+	}
+	return 0;
+
+err_out:
+	free(dso->name);
+	btf__free(dso->btf);
+	return -1;
+}
+
+/*
+ * Adds a mapping of *name*. A dso new to syms is taken over from *old*, the
+ * dsos before a refresh, if the same file is in there, so its symbol table
+ * is kept rather than loaded again.
+ */
+static int syms__add_dso(struct syms *syms, struct map *map, const char *name,
+			 struct dso *old, int old_sz)
 {
 	struct dso *dso = NULL;
-	int i, type;
+	int i;
 	void *tmp;
 
 	for (i = 0; i < syms->dso_sz; i++) {
@@ -329,10 +848,24 @@ static int syms__add_dso(struct syms *syms, struct map *map, const char *name)
 		if (!tmp)
 			return -1;
 		syms->dsos = tmp;
-		dso = &syms->dsos[syms->dso_sz++];
-		memset(dso, 0, sizeof(*dso));
-		dso->name = strdup(name);
-		dso->btf = btf__new_empty();
+		dso = &syms->dsos[syms->dso_sz];
+
+		for (i = 0; i < old_sz; i++) {
+			if (old[i].name && !strcmp(old[i].name, name) &&
+			    old[i].dev_major == map->dev_major &&
+			    old[i].dev_minor == map->dev_minor &&
+			    old[i].inode == map->inode)
+				break;
+		}
+
+		if (i < old_sz) {
+			*dso = old[i];
+			dso->range_sz = 0;
+			old[i].name = NULL;
+		} else if (dso__init(dso, map, name)) {
+			return -1;
+		}
+		syms->dso_sz++;
 	}
 
 	tmp = realloc(dso->ranges, (dso->range_sz + 1) * sizeof(*dso->ranges));
@@ -343,61 +876,460 @@ static int syms__add_dso(struct syms *syms, struct map *map, const char *name)
 	dso->ranges[dso->range_sz].end = map->end_addr;
 	dso->ranges[dso->range_sz].file_off = map->file_off;
 	dso->range_sz++;
-	type = get_elf_type(name);
-	if (type == ET_EXEC) {
-		dso->type = EXEC;
-	} else if (type == ET_DYN) {
-		dso->type = DYN;
-		if (get_elf_text_scn_info(name, &dso->sh_addr, &dso->sh_offset) < 0)
-			return -1;
-	} else if (is_perf_map(name)) {
-		dso->type = PERF_MAP;
-	} else if (is_vdso(name)) {
-		dso->type = VDSO;
-	} else {
-		dso->type = UNKNOWN;
-	}
 	return 0;
 }
 
-static struct dso *syms__find_dso(const struct syms *syms, unsigned long addr,
-				  uint64_t *offset)
+struct range_sort_entry {
+	uint64_t start;
+	struct range_entry entry;
+};
+
+static int range_cmp(const void *p1, const void *p2)
 {
-	struct load_range *range;
-	struct dso *dso;
-	int i, j;
+	const struct range_sort_entry *r1 = p1, *r2 = p2;
 
-	for (i = 0; i < syms->dso_sz; i++) {
+	if (r1->start == r2->start)
+		return 0;
+	return r1->start < r2->start ? -1 : 1;
+}
+
+/* flattens the ranges of all dsos into the sorted address index */
+static int syms__build_index(struct syms *syms)
+{
+	struct range_sort_entry *sorted;
+	struct load_range *range;
+	struct dso *dso;
+	int i, j, n = 0;
+
+	for (i = 0; i < syms->dso_sz; i++)
+		n += syms->dsos[i].range_sz;
+
+	sorted = calloc(n ? n : 1, sizeof(*sorted));
+	if (!sorted)
+		return -1;
+
+	free(syms->range_starts);
+	free(syms->ranges);
+	syms->range_starts = calloc(n ? n : 1, sizeof(*syms->range_starts));
+	syms->ranges = calloc(n ? n : 1, sizeof(*syms->ranges));
+	syms->range_sz = 0;
+	if (!syms->range_starts || !syms->ranges) {
+		free(sorted);
+		return -1;
+	}
+
+	for (n = 0, i = 0; i < syms->dso_sz; i++) {
 		dso = &syms->dsos[i];
-		for (j = 0; j < dso->range_sz; j++) {
+		for (j = 0; j < dso->range_sz; j++, n++) {
 			range = &dso->ranges[j];
-			if (addr <= range->start || addr >= range->end)
-				continue;
+			sorted[n].start = range->start;
+			sorted[n].entry.end = range->end;
+			sorted[n].entry.dso = i;
 			if (dso->type == DYN || dso->type == VDSO) {
-				/* Offset within the mmap */
-				*offset = addr - range->start + range->file_off;
-				/* Offset within the ELF for dyn symbol lookup */
-				*offset += dso->sh_addr - dso->sh_offset;
+				/* Offset within the mmap, then within the ELF */
+				sorted[n].entry.adjust = range->file_off - range->start +
+							 dso->sh_addr - dso->sh_offset;
 			} else {
-				*offset = addr;
+				sorted[n].entry.adjust = 0;
 			}
+		}
+	}
+
+	qsort(sorted, n, sizeof(*sorted), range_cmp);
+
+	for (i = 0; i < n; i++) {
+		syms->range_starts[i] = sorted[i].start;
+		syms->ranges[i] = sorted[i].entry;
+	}
+	syms->range_sz = n;
+
+	free(sorted);
+	return 0;
+}
+
+static struct dso *syms__find_dso(const struct syms *syms, unsigned long addr,
+				  uint64_t *offset)
+{
+	const uint64_t *base = syms->range_starts;
+	const struct range_entry *range;
+	int n = syms->range_sz;
+
+	if (!n || addr < base[0])
+		return NULL;
+
+	/*
+	 * Find the last range starting at or below addr. The loop has a fixed
+	 * trip count for a given size and the comparison compiles to a
+	 * conditional move, so there are no mispredicted branches.
+	 */
+	while (n > 1) {
+		int half = n / 2;
+
+		base = base[half] <= addr ? base + half : base;
+		n -= half;
+	}
+
+	range = &syms->ranges[base - syms->range_starts];
+	if (addr >= range->end)
+		return NULL;
+
+	*offset = addr + range->adjust;
+	return &syms->dsos[range->dso];
+}
+
+/* perf map names are copied into blocks that never move */
+struct name_block {
+	struct name_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+#define NAME_BLOCK_SIZE		(64 * 1024)
+#define PERF_MAP_READ_NS	(100 * 1000 * 1000ULL)
+
+static const char *dso__add_perf_map_name(struct dso *dso, const char *name,
+					  size_t len)
+{
+	struct name_block *block = dso->names;
+	size_t size;
+	char *p;
+
+	if (!block || block->size - block->used < len + 1) {
+		size = len + 1 > NAME_BLOCK_SIZE ? len + 1 : NAME_BLOCK_SIZE;
+		block = malloc(sizeof(*block) + size);
+		if (!block)
+			return NULL;
+		block->next = dso->names;
+		block->used = 0;
+		block->size = size;
+		dso->names = block;
+	}
+
+	p = block->data + block->used;
+	memcpy(p, name, len);
+	p[len] = '\0';
+	block->used += len + 1;
+	return p;
+}
+
+static int dso__add_perf_map_sym(struct dso *dso, const char *name, size_t len,
+				 uint64_t start, uint64_t size)
+{
+	size_t new_cap;
+	void *tmp;
+
+	if (dso->jit_syms_sz + 1 > dso->jit_syms_cap) {
+		new_cap = dso->jit_syms_cap * 4 / 3;
+		if (new_cap < 1024)
+			new_cap = 1024;
+		tmp = realloc(dso->jit_syms, sizeof(*dso->jit_syms) * new_cap);
+		if (!tmp)
+			return -1;
+		dso->jit_syms = tmp;
+		dso->jit_syms_cap = new_cap;
+	}
+
+	name = dso__add_perf_map_name(dso, name, len);
+	if (!name)
+		return -1;
+
+	dso->jit_syms[dso->jit_syms_sz].name = name;
+	dso->jit_syms[dso->jit_syms_sz].start = start;
+	dso->jit_syms[dso->jit_syms_sz].size = size;
+	dso->jit_syms_sz++;
+	return 0;
+}
+
+static void dso__free_perf_map(struct dso *dso)
+{
+	struct name_block *block, *next;
+
+	for (block = dso->names; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(dso->jit_syms);
+	free(dso->regions);
+
+	dso->names = NULL;
+	dso->jit_syms = NULL;
+	dso->jit_syms_sz = 0;
+	dso->jit_syms_cap = 0;
+	dso->regions = NULL;
+	dso->regions_sz = 0;
+	dso->indexed_sz = 0;
+	dso->perf_map_off = 0;
+}
+
+/*
+ * Reads the lines appended to the perf map since the last call. A JIT
+ * writes a "START SIZE name" line for each function it emits, and code
+ * emitted again at the same addresses simply gets a later line.
+ */
+static int dso__load_sym_table_from_perf_map(struct dso *dso)
+{
+	char *buf = NULL, *p, *end, *eol, *name;
+	uint64_t start, size;
+	size_t len, got = 0;
+	struct stat st;
+	int fd, err = -1;
+	ssize_t ret;
+
+	fd = open(dso->name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st))
+		goto out;
+
+	/* written anew, e.g. by another process that got the same pid */
+	if ((uint64_t)st.st_size < dso->perf_map_off)
+		dso__free_perf_map(dso);
+
+	len = st.st_size - dso->perf_map_off;
+	if (!len) {
+		err = 0;
+		goto out;
+	}
+
+	buf = malloc(len);
+	if (!buf)
+		goto out;
+
+	while (got < len) {
+		ret = pread(fd, buf + got, len - got, dso->perf_map_off + got);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		got += ret;
+	}
+
+	end = buf + got;
+	for (p = buf; (eol = memchr(p, '\n', end - p)); p = eol + 1) {
+		/* strtoull() would skip the newline into the next line */
+		*eol = '\0';
+
+		start = strtoull(p, &name, 16);
+		if (name == p || *name != ' ')
+			continue;
+		p = name;
+		size = strtoull(p, &name, 16);
+		if (name == p || *name != ' ' || !size)
+			continue;
+		while (*name == ' ')
+			name++;
+		if (name >= eol)
+			continue;
+
+		if (dso__add_perf_map_sym(dso, name, eol - name, start, size))
+			goto out;
+	}
+
+	/* a line still being written is read the next time */
+	dso->perf_map_off += p - buf;
+	err = 0;
+
+out:
+	free(buf);
+	close(fd);
+	return err;
+}
+
+static int region_cmp(const void *p1, const void *p2)
+{
+	const struct perf_map_region *r1 = p1, *r2 = p2;
+
+	if (r1->start == r2->start)
+		return 0;
+	return r1->start < r2->start ? -1 : 1;
+}
+
+static int u64_cmp(const void *p1, const void *p2)
+{
+	const uint64_t *v1 = p1, *v2 = p2;
+
+	if (*v1 == *v2)
+		return 0;
+	return *v1 < *v2 ? -1 : 1;
+}
+
+/* a max-heap of regions by symbol, which is newer the higher it is */
+static void region_heap_push(int *heap, int *heap_sz,
+			     const struct perf_map_region *items, int item)
+{
+	int i = (*heap_sz)++, parent;
+
+	while (i && items[heap[parent = (i - 1) / 2]].sym < items[item].sym) {
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = item;
+}
+
+static void region_heap_pop(int *heap, int *heap_sz,
+			    const struct perf_map_region *items)
+{
+	int last = heap[--(*heap_sz)], i = 0, child;
+
+	while ((child = 2 * i + 1) < *heap_sz) {
+		if (child + 1 < *heap_sz &&
+		    items[heap[child + 1]].sym > items[heap[child]].sym)
+			child++;
+		if (items[heap[child]].sym <= items[last].sym)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+}
+
+/*
+ * Rebuilds the regions with the symbols read since the last time, so every
+ * address belongs to the newest symbol covering it. The old regions stand
+ * in for the symbols they came from, which are all older than the new ones.
+ */
+static int dso__index_perf_map(struct dso *dso)
+{
+	struct perf_map_region *items, *regions, *last = NULL;
+	int n, nr_bounds = 0, nr_regions = 0, heap_sz = 0, next = 0, i, j;
+	uint64_t *bounds, *ends, bound;
+	int *heap;
+
+	n = dso->regions_sz + dso->jit_syms_sz - dso->indexed_sz;
+	items = malloc(sizeof(*items) * n);
+	regions = malloc(sizeof(*regions) * 2 * n);
+	bounds = malloc(sizeof(*bounds) * 2 * n);
+	ends = malloc(sizeof(*ends) * n);
+	heap = malloc(sizeof(*heap) * n);
+	if (!items || !regions || !bounds || !ends || !heap) {
+		free(regions);
+		regions = NULL;
+		goto out;
+	}
+
+	memcpy(items, dso->regions, sizeof(*items) * dso->regions_sz);
+	for (i = dso->indexed_sz, j = dso->regions_sz; i < dso->jit_syms_sz; i++, j++) {
+		items[j].start = dso->jit_syms[i].start;
+		items[j].end = dso->jit_syms[i].start + dso->jit_syms[i].size;
+		items[j].sym = i;
+	}
 
-			return dso;
+	/* JITs mostly emit code at increasing addresses, skip sorting then */
+	for (i = 1; i < n && items[i - 1].start <= items[i].start; i++)
+		;
+	if (i < n)
+		qsort(items, n, sizeof(*items), region_cmp);
+
+	for (i = 0; i < n; i++)
+		ends[i] = items[i].end;
+	for (i = 1; i < n && ends[i - 1] <= ends[i]; i++)
+		;
+	if (i < n)
+		qsort(ends, n, sizeof(*ends), u64_cmp);
+
+	/* merge the sorted starts and ends into the distinct bounds */
+	for (i = 0, j = 0; i < n || j < n; ) {
+		if (j == n || (i < n && items[i].start <= ends[j]))
+			bound = items[i++].start;
+		else
+			bound = ends[j++];
+		if (!nr_bounds || bounds[nr_bounds - 1] != bound)
+			bounds[nr_bounds++] = bound;
+	}
+
+	/* sweep the bounds with the symbols covering them in the heap */
+	for (i = 0; i + 1 < nr_bounds; i++) {
+		while (next < n && items[next].start <= bounds[i])
+			region_heap_push(heap, &heap_sz, items, next++);
+		while (heap_sz && items[heap[0]].end <= bounds[i])
+			region_heap_pop(heap, &heap_sz, items);
+		if (!heap_sz)
+			continue;
+
+		if (last && last->sym == items[heap[0]].sym &&
+		    last->end == bounds[i]) {
+			last->end = bounds[i + 1];
+			continue;
 		}
+
+		last = &regions[nr_regions++];
+		last->start = bounds[i];
+		last->end = bounds[i + 1];
+		last->sym = items[heap[0]].sym;
 	}
 
+	free(dso->regions);
+	dso->regions = regions;
+	dso->regions_sz = nr_regions;
+	dso->indexed_sz = dso->jit_syms_sz;
+
+out:
+	free(items);
+	free(bounds);
+	free(ends);
+	free(heap);
+	return regions ? 0 : -1;
+}
+
+static const struct perf_map_region *dso__find_region(const struct dso *dso,
+						      uint64_t addr)
+{
+	int start = 0, end = dso->regions_sz - 1, mid;
+
+	if (!dso->regions_sz)
+		return NULL;
+
+	/* find the last region starting at or below addr */
+	while (start < end) {
+		mid = start + (end - start + 1) / 2;
+		if (dso->regions[mid].start <= addr)
+			start = mid;
+		else
+			end = mid - 1;
+	}
+
+	if (dso->regions[start].start <= addr && addr < dso->regions[start].end)
+		return &dso->regions[start];
 	return NULL;
 }
 
-static int dso__load_sym_table_from_perf_map(struct dso *dso)
+/*
+ * The perf map grows while the JIT runs, so it is read again at most every
+ * PERF_MAP_READ_NS. Its symbols change under lookups, which therefore take
+ * the lock of the syms.
+ */
+static int dso__find_perf_map_sym(struct syms *syms, struct dso *dso,
+				  uint64_t addr, struct sym *sym)
 {
-	return -1;
+	const struct perf_map_region *region;
+	unsigned long long now = get_ktime_ns();
+	int err = -1;
+
+	pthread_mutex_lock(&syms->load_lock);
+
+	if (!dso->perf_map_read_ns || now - dso->perf_map_read_ns >= PERF_MAP_READ_NS) {
+		dso->perf_map_read_ns = now;
+		if (!dso__load_sym_table_from_perf_map(dso) &&
+		    dso->indexed_sz < dso->jit_syms_sz)
+			dso__index_perf_map(dso);
+	}
+
+	region = dso__find_region(dso, addr);
+	if (region) {
+		*sym = dso->jit_syms[region->sym];
+		err = 0;
+	}
+
+	pthread_mutex_unlock(&syms->load_lock);
+	return err;
 }
 
 static int dso__add_sym(struct dso *dso, const char *name, uint64_t start,
 			uint64_t size)
 {
-	struct sym *sym;
+	struct dso_sym *sym;
 	size_t new_cap;
 	void *tmp;
 	int off;
@@ -418,21 +1350,19 @@ static int dso__add_sym(struct dso *dso, const char *name, uint64_t start,
 	}
 
 	sym = &dso->syms[dso->syms_sz++];
-	/* while constructing, re-use pointer as just a plain offset */
-	sym->name = (void*)(unsigned long)off;
 	sym->start = start;
 	sym->size = size;
-	sym->offset = 0;
+	sym->name = off;
 
 	return 0;
 }
 
-static int sym_cmp(const void *p1, const void *p2)
+static int sym_cmp(const void *p1, const void *p2, void *strs)
 {
-	const struct sym *s1 = p1, *s2 = p2;
+	const struct dso_sym *s1 = p1, *s2 = p2;
 
 	if (s1->start == s2->start)
-		return strcmp(s1->name, s2->name);
+		return strcmp((char *)strs + s1->name, (char *)strs + s2->name);
 	return s1->start < s2->start ? -1 : 1;
 }
 
@@ -467,197 +1397,1204 @@ static int dso__add_syms(struct dso *dso, Elf *e, Elf_Scn *section,
 	}
 
 	return 0;
-
-err_out:
-	return -1;
+
+err_out:
+	return -1;
+}
+
+static void dso__free_syms(struct dso *dso)
+{
+	if (dso->cache_map)
+		munmap(dso->cache_map, dso->cache_map_sz);
+	else
+		free(dso->syms);
+
+	dso->syms = NULL;
+	dso->syms_sz = 0;
+	dso->syms_cap = 0;
+	dso->strs = NULL;
+	dso->cache_map = NULL;
+	dso->cache_map_sz = 0;
+}
+
+static void dso__free_unwind_rows(struct dso *dso)
+{
+	if (dso->unwind_map)
+		munmap(dso->unwind_map, dso->unwind_map_sz);
+	else
+		free(dso->unwind_rows);
+
+	dso->unwind_rows = NULL;
+	dso->unwind_rows_sz = 0;
+	dso->unwind_rows_cap = 0;
+	dso->unwind_map = NULL;
+	dso->unwind_map_sz = 0;
+}
+
+static void dso__free_fields(struct dso *dso)
+{
+	if (!dso)
+		return;
+
+	free(dso->name);
+	free(dso->ranges);
+	dso__free_syms(dso);
+	dso__free_unwind_rows(dso);
+	dso__free_perf_map(dso);
+	btf__free(dso->btf);
+}
+
+static int dso__load_sym_table_from_elf(struct dso *dso, Elf *e)
+{
+	Elf_Scn *section = NULL;
+
+	while ((section = elf_nextscn(e, section)) != 0) {
+		GElf_Shdr header;
+
+		if (!gelf_getshdr(section, &header))
+			continue;
+
+		if (header.sh_type != SHT_SYMTAB &&
+		    header.sh_type != SHT_DYNSYM)
+			continue;
+
+		if (dso__add_syms(dso, e, section, header.sh_link,
+				  header.sh_entsize))
+			goto err_out;
+	}
+
+	/* now when strings are finalized, names are offsets from the first */
+	dso->strs = btf__name_by_offset(dso->btf, 0);
+	qsort_r(dso->syms, dso->syms_sz, sizeof(*dso->syms), sym_cmp,
+		(void *)dso->strs);
+	return 0;
+
+err_out:
+	/* the dso stays usable for its name and ranges */
+	dso__free_syms(dso);
+	return -1;
+}
+
+static int dso__load_sym_table_from_file(struct dso *dso)
+{
+	int fd = -1, err;
+	Elf *e;
+
+	e = open_elf(dso->name, &fd);
+	if (!e)
+		return -1;
+
+	err = dso__load_sym_table_from_elf(dso, e);
+	close_elf(e, fd);
+	return err;
+}
+
+void syms__set_cache_dir(const char *dir)
+{
+	snprintf(sym_cache_dir, sizeof(sym_cache_dir), "%s", dir ? dir : "");
+}
+
+/*
+ * The symbol tables of a file are cached under its build ID, and its size
+ * since stripping keeps the build ID. Files without one are cached under
+ * their device, inode, modification time and size.
+ */
+static int dso__sym_cache_path(struct dso *dso, char *path, size_t path_sz)
+{
+	char build_id[2 * 64 + 1] = "";
+	Elf_Scn *section = NULL;
+	struct stat st;
+	int fd = -1, len;
+	Elf *e;
+
+	if (!sym_cache_dir[0])
+		return -1;
+
+	/* the vdso only changes with the kernel */
+	if (dso->type == VDSO) {
+		if (get_boot_id(build_id, sizeof(build_id)))
+			return -1;
+		len = snprintf(path, path_sz, "%s/v-%s", sym_cache_dir, build_id);
+		return len < (int)path_sz ? 0 : -1;
+	}
+
+	if (stat(dso->name, &st))
+		return -1;
+
+	e = open_elf(dso->name, &fd);
+	if (!e)
+		return -1;
+
+	while (!build_id[0] && (section = elf_nextscn(e, section)) != 0) {
+		size_t off = 0, next, name_off, desc_off, i;
+		Elf_Data *data;
+		GElf_Shdr header;
+		GElf_Nhdr note;
+
+		if (!gelf_getshdr(section, &header) || header.sh_type != SHT_NOTE)
+			continue;
+
+		data = elf_getdata(section, NULL);
+		while (data && (next = gelf_getnote(data, off, &note, &name_off,
+						    &desc_off)) > 0) {
+			off = next;
+			if (note.n_type != NT_GNU_BUILD_ID || note.n_namesz != 4 ||
+			    memcmp((char *)data->d_buf + name_off, "GNU", 4) ||
+			    !note.n_descsz || note.n_descsz > 64)
+				continue;
+
+			for (i = 0; i < note.n_descsz; i++)
+				sprintf(build_id + 2 * i, "%02x",
+					((unsigned char *)data->d_buf)[desc_off + i]);
+			break;
+		}
+	}
+
+	close_elf(e, fd);
+
+	if (build_id[0])
+		len = snprintf(path, path_sz, "%s/b-%s-%lld", sym_cache_dir,
+			       build_id, (long long)st.st_size);
+	else
+		len = snprintf(path, path_sz, "%s/i-%llx-%llu-%lld-%lld",
+			       sym_cache_dir, (unsigned long long)st.st_dev,
+			       (unsigned long long)st.st_ino,
+			       (long long)st.st_mtime, (long long)st.st_size);
+	return len < (int)path_sz ? 0 : -1;
+}
+
+static int dso__load_sym_table_from_cache(struct dso *dso, const char *path)
+{
+	const struct sym_cache_header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (memcmp(hdr->magic, SYM_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SYM_CACHE_VERSION || !hdr->strs_sz ||
+	    sizeof(*hdr) + hdr->syms_sz * sizeof(struct dso_sym) + hdr->strs_sz !=
+	    (uint64_t)st.st_size ||
+	    ((char *)map)[st.st_size - 1]) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	dso->cache_map = map;
+	dso->cache_map_sz = st.st_size;
+	dso->syms = (struct dso_sym *)(hdr + 1);
+	dso->syms_sz = hdr->syms_sz;
+	dso->strs = (char *)(dso->syms + dso->syms_sz);
+	return 0;
+}
+
+/* written to a temporary file first, so readers never see a partial one */
+static void dso__save_sym_table(struct dso *dso, const char *path)
+{
+	struct sym_cache_header hdr = {
+		.magic = SYM_CACHE_MAGIC,
+		.version = SYM_CACHE_VERSION,
+	};
+	char tmp[PATH_MAX];
+	uint64_t end;
+	bool ok;
+	int fd, i;
+
+	/* only the referenced part of the string set is saved */
+	hdr.strs_sz = 1;
+	for (i = 0; i < dso->syms_sz; i++) {
+		end = dso->syms[i].name + strlen(dso->strs + dso->syms[i].name) + 1;
+		if (end > hdr.strs_sz)
+			hdr.strs_sz = end;
+	}
+	hdr.syms_sz = dso->syms_sz;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		return;
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	     write(fd, dso->syms, dso->syms_sz * sizeof(*dso->syms)) ==
+	     (ssize_t)(dso->syms_sz * sizeof(*dso->syms)) &&
+	     write(fd, dso->strs, hdr.strs_sz) == (ssize_t)hdr.strs_sz;
+	close(fd);
+
+	if (!ok || rename(tmp, path))
+		unlink(tmp);
+}
+
+/* a copy of the vdso of this process, which is the one of every process */
+static void *get_vdso_image(size_t *size)
+{
+	uint64_t start_addr, end_addr;
+	char buf[PATH_MAX];
+	void *image = NULL;
+	bool found = false;
+	char *name;
+	FILE *f;
+	int ret;
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		return NULL;
+
+	while (true) {
+		ret = fscanf(f, "%lx-%lx %*s %*x %*x:%*x %*u%[^\n]",
+			     &start_addr, &end_addr, buf);
+		if (ret == EOF && feof(f))
+			break;
+		if (ret != 3)
+			goto out;
+
+		name = buf;
+		while (isspace(*name))
+			name++;
+		if (is_vdso(name)) {
+			found = true;
+			break;
+		}
+	}
+
+	if (!found)
+		goto out;
+
+	*size = end_addr - start_addr;
+	image = malloc(*size);
+	if (image)
+		memcpy(image, (void *)start_addr, *size);
+
+out:
+	fclose(f);
+	return image;
+}
+
+static int dso__load_sym_table_from_vdso_image(struct dso *dso)
+{
+	size_t size;
+	void *image;
+	int err = -1;
+	Elf *e;
+
+	image = get_vdso_image(&size);
+	if (!image)
+		return -1;
+
+	if (elf_version(EV_CURRENT) != EV_NONE) {
+		e = elf_memory(image, size);
+		if (e) {
+			err = dso__load_sym_table_from_elf(dso, e);
+			elf_end(e);
+		}
+	}
+
+	free(image);
+	return err;
+}
+
+static int dso__load_sym_table(struct dso *dso)
+{
+	char path[PATH_MAX];
+	bool cached;
+
+	if (dso->type != EXEC && dso->type != DYN && dso->type != VDSO)
+		return -1;
+
+	cached = !dso__sym_cache_path(dso, path, sizeof(path));
+	if (cached && !dso__load_sym_table_from_cache(dso, path))
+		return 0;
+	if (dso->type == VDSO ? dso__load_sym_table_from_vdso_image(dso) :
+				dso__load_sym_table_from_file(dso))
+		return -1;
+	if (cached)
+		dso__save_sym_table(dso, path);
+	return 0;
+}
+
+/*
+ * The vdso is the same in every process for as long as the kernel runs,
+ * so all syms share one symbol table of it, read once from our own.
+ */
+static struct dso vdso_dso = {
+	.name = "[vdso]",
+	.type = VDSO,
+};
+static pthread_once_t vdso_once = PTHREAD_ONCE_INIT;
+
+static void vdso__load(void)
+{
+	vdso_dso.btf = btf__new_empty();
+	vdso_dso.loaded = vdso_dso.btf && !dso__load_sym_table(&vdso_dso) ? 1 : -1;
+}
+
+static struct dso *get_vdso_dso(void)
+{
+	pthread_once(&vdso_once, vdso__load);
+	return &vdso_dso;
+}
+
+/*
+ * Loads the symbol table of a dso on first use. Once loaded the table is
+ * only read, so lookups only take the lock while it is not.
+ */
+static int dso__ensure_sym_table(struct syms *syms, struct dso *dso)
+{
+	int loaded = __atomic_load_n(&dso->loaded, __ATOMIC_ACQUIRE);
+
+	if (loaded)
+		return loaded > 0 ? 0 : -1;
+
+	pthread_mutex_lock(&syms->load_lock);
+	loaded = dso->loaded;
+	if (!loaded) {
+		loaded = dso__load_sym_table(dso) ? -1 : 1;
+		__atomic_store_n(&dso->loaded, loaded, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&syms->load_lock);
+
+	return loaded > 0 ? 0 : -1;
+}
+
+static int dso__find_sym(struct syms *syms, struct dso *dso, uint64_t offset,
+			 struct sym *sym)
+{
+	unsigned long sym_addr;
+	int start, end, mid;
+
+	if (dso->type == PERF_MAP)
+		return dso__find_perf_map_sym(syms, dso, offset, sym);
+	if (dso->type == VDSO)
+		dso = get_vdso_dso();
+
+	if (dso__ensure_sym_table(syms, dso) || !dso->syms_sz)
+		return -1;
+
+	start = 0;
+	end = dso->syms_sz - 1;
+
+	/* find largest sym_addr <= addr using binary search */
+	while (start < end) {
+		mid = start + (end - start + 1) / 2;
+		sym_addr = dso->syms[mid].start;
+
+		if (sym_addr <= offset)
+			start = mid;
+		else
+			end = mid - 1;
+	}
+
+	if (start == end && dso->syms[start].start <= offset) {
+		sym->name = dso->strs + dso->syms[start].name;
+		sym->start = dso->syms[start].start;
+		sym->size = dso->syms[start].size;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Unwind tables from .eh_frame, x86_64 only. Of the CFA program of each
+ * FDE only the rules for the CFA and rbp are kept, the return address is
+ * always right below the CFA.
+ */
+#define DWARF_REG_RBP		6
+#define DWARF_REG_RSP		7
+#define DWARF_REG_RA		16
+
+#define DW_EH_PE_absptr		0x00
+#define DW_EH_PE_uleb128	0x01
+#define DW_EH_PE_udata2		0x02
+#define DW_EH_PE_udata4		0x03
+#define DW_EH_PE_udata8		0x04
+#define DW_EH_PE_sleb128	0x09
+#define DW_EH_PE_sdata2		0x0a
+#define DW_EH_PE_sdata4		0x0b
+#define DW_EH_PE_sdata8		0x0c
+#define DW_EH_PE_pcrel		0x10
+
+enum {
+	DW_CFA_nop			= 0x00,
+	DW_CFA_set_loc			= 0x01,
+	DW_CFA_advance_loc1		= 0x02,
+	DW_CFA_advance_loc2		= 0x03,
+	DW_CFA_advance_loc4		= 0x04,
+	DW_CFA_offset_extended		= 0x05,
+	DW_CFA_restore_extended		= 0x06,
+	DW_CFA_undefined		= 0x07,
+	DW_CFA_same_value		= 0x08,
+	DW_CFA_register			= 0x09,
+	DW_CFA_remember_state		= 0x0a,
+	DW_CFA_restore_state		= 0x0b,
+	DW_CFA_def_cfa			= 0x0c,
+	DW_CFA_def_cfa_register		= 0x0d,
+	DW_CFA_def_cfa_offset		= 0x0e,
+	DW_CFA_def_cfa_expression	= 0x0f,
+	DW_CFA_expression		= 0x10,
+	DW_CFA_offset_extended_sf	= 0x11,
+	DW_CFA_def_cfa_sf		= 0x12,
+	DW_CFA_def_cfa_offset_sf	= 0x13,
+	DW_CFA_val_offset		= 0x14,
+	DW_CFA_val_offset_sf		= 0x15,
+	DW_CFA_val_expression		= 0x16,
+	DW_CFA_GNU_args_size		= 0x2e,
+	DW_CFA_GNU_negative_offset_extended = 0x2f,
+	DW_CFA_advance_loc		= 0x40,
+	DW_CFA_offset			= 0x80,
+	DW_CFA_restore			= 0xc0,
+};
+
+/* the .eh_frame section, and the address it is loaded at */
+struct eh_frame {
+	const uint8_t *data;
+	size_t size;
+	uint64_t addr;
+};
+
+/* what the FDEs of a CIE share */
+struct eh_cie {
+	uint64_t code_align;
+	int64_t data_align;
+	uint8_t fde_enc;
+	/* the FDEs have augmentation data, to be skipped */
+	bool fde_aug;
+	const uint8_t *insns;
+	const uint8_t *end;
+};
+
+/* the rules of a row while the CFA program runs */
+struct cfa_state {
+	int64_t cfa_off;
+	/* where rbp is saved relative to the CFA, 0 if it is not */
+	int64_t rbp_off;
+	uint64_t cfa_reg;
+	bool cfa_expr;
+	bool ra_undefined;
+};
+
+/* deep enough for the nesting compilers emit */
+#define CFA_STATE_STACK		8
+
+static int eh_read(const uint8_t **p, const uint8_t *end, void *val,
+		   size_t size)
+{
+	if ((size_t)(end - *p) < size)
+		return -1;
+	memcpy(val, *p, size);
+	*p += size;
+	return 0;
+}
+
+static int eh_read_uleb(const uint8_t **p, const uint8_t *end, uint64_t *val)
+{
+	unsigned int shift = 0;
+	uint8_t byte;
+
+	*val = 0;
+	do {
+		if (*p >= end || shift >= 64)
+			return -1;
+		byte = *(*p)++;
+		*val |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return 0;
+}
+
+static int eh_read_sleb(const uint8_t **p, const uint8_t *end, int64_t *val)
+{
+	unsigned int shift = 0;
+	uint64_t res = 0;
+	uint8_t byte;
+
+	do {
+		if (*p >= end || shift >= 64)
+			return -1;
+		byte = *(*p)++;
+		res |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	if (shift < 64 && (byte & 0x40))
+		res |= ~0ULL << shift;
+	*val = (int64_t)res;
+	return 0;
+}
+
+/* reads a pointer of encoding enc, pc-relative ones are made absolute */
+static int eh_read_ptr(const struct eh_frame *eh, const uint8_t **p,
+		       const uint8_t *end, uint8_t enc, uint64_t *val)
+{
+	const uint64_t pc = eh->addr + (*p - eh->data);
+	uint16_t u16;
+	uint32_t u32;
+	int err;
+
+	switch (enc & 0x0f) {
+	case DW_EH_PE_absptr:
+	case DW_EH_PE_udata8:
+	case DW_EH_PE_sdata8:
+		err = eh_read(p, end, val, sizeof(*val));
+		break;
+	case DW_EH_PE_udata2:
+	case DW_EH_PE_sdata2:
+		err = eh_read(p, end, &u16, sizeof(u16));
+		*val = (enc & 0x0f) == DW_EH_PE_sdata2 ? (uint64_t)(int16_t)u16 : u16;
+		break;
+	case DW_EH_PE_udata4:
+	case DW_EH_PE_sdata4:
+		err = eh_read(p, end, &u32, sizeof(u32));
+		*val = (enc & 0x0f) == DW_EH_PE_sdata4 ? (uint64_t)(int32_t)u32 : u32;
+		break;
+	case DW_EH_PE_uleb128:
+		err = eh_read_uleb(p, end, val);
+		break;
+	case DW_EH_PE_sleb128:
+		err = eh_read_sleb(p, end, (int64_t *)val);
+		break;
+	default:
+		return -1;
+	}
+	if (err)
+		return -1;
+
+	switch (enc & 0x70) {
+	case 0:
+		return 0;
+	case DW_EH_PE_pcrel:
+		*val += pc;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* reads the length of the entry at *p, leaving *p at its id */
+static int eh_read_entry(const struct eh_frame *eh, const uint8_t **p,
+			 const uint8_t **entry_end)
+{
+	const uint8_t *end = eh->data + eh->size;
+	uint32_t len32;
+	uint64_t len;
+
+	if (eh_read(p, end, &len32, sizeof(len32)) || !len32)
+		return -1;
+	if (len32 != 0xffffffff)
+		len = len32;
+	else if (eh_read(p, end, &len, sizeof(len)))
+		return -1;
+	if (len > (uint64_t)(end - *p))
+		return -1;
+	*entry_end = *p + len;
+	return 0;
+}
+
+static int eh_parse_cie(const struct eh_frame *eh, const uint8_t *entry,
+			struct eh_cie *cie)
+{
+	const uint8_t *p = entry, *end, *aug_end;
+	uint8_t version, enc, ra;
+	uint64_t aug_sz, val;
+	uint32_t id;
+	const char *aug;
+
+	memset(cie, 0, sizeof(*cie));
+	if (eh_read_entry(eh, &p, &end) ||
+	    eh_read(&p, end, &id, sizeof(id)) || id ||
+	    eh_read(&p, end, &version, sizeof(version)) ||
+	    (version != 1 && version != 3))
+		return -1;
+
+	aug = (const char *)p;
+	p = memchr(p, 0, end - p);
+	if (!p)
+		return -1;
+	p++;
+
+	if (eh_read_uleb(&p, end, &cie->code_align) ||
+	    eh_read_sleb(&p, end, &cie->data_align))
+		return -1;
+	if (version == 1 ? eh_read(&p, end, &ra, sizeof(ra)) :
+			   eh_read_uleb(&p, end, &val))
+		return -1;
+
+	cie->fde_enc = DW_EH_PE_absptr;
+	if (aug[0] == 'z') {
+		if (eh_read_uleb(&p, end, &aug_sz) || aug_sz > (uint64_t)(end - p))
+			return -1;
+		aug_end = p + aug_sz;
+		cie->fde_aug = true;
+
+		for (aug++; *aug; aug++) {
+			if (*aug == 'R') {
+				if (eh_read(&p, aug_end, &cie->fde_enc, 1))
+					return -1;
+			} else if (*aug == 'P') {
+				if (eh_read(&p, aug_end, &enc, 1) ||
+				    eh_read_ptr(eh, &p, aug_end, enc, &val))
+					return -1;
+			} else if (*aug == 'L') {
+				if (eh_read(&p, aug_end, &enc, 1))
+					return -1;
+			} else if (*aug != 'S' && *aug != 'B') {
+				/* the data of the rest is unknown, but skipped */
+				break;
+			}
+		}
+		p = aug_end;
+	} else if (aug[0]) {
+		return -1;
+	}
+
+	cie->insns = p;
+	cie->end = end;
+	return 0;
+}
+
+/* adds the row of state at pc, or replaces the one of the same FDE there */
+static int dso__add_unwind_row(struct dso *dso, uint64_t pc,
+			       const struct cfa_state *state, int fde_first)
+{
+	struct unwind_row *row;
+	size_t new_cap;
+	void *tmp;
+
+	if (dso->unwind_rows_sz > fde_first &&
+	    dso->unwind_rows[dso->unwind_rows_sz - 1].pc == pc) {
+		row = &dso->unwind_rows[dso->unwind_rows_sz - 1];
+	} else {
+		if (dso->unwind_rows_sz + 1 > dso->unwind_rows_cap) {
+			new_cap = dso->unwind_rows_cap * 4 / 3;
+			if (new_cap < 1024)
+				new_cap = 1024;
+			tmp = realloc(dso->unwind_rows, sizeof(*dso->unwind_rows) * new_cap);
+			if (!tmp)
+				return -1;
+			dso->unwind_rows = tmp;
+			dso->unwind_rows_cap = new_cap;
+		}
+		row = &dso->unwind_rows[dso->unwind_rows_sz++];
+	}
+
+	memset(row, 0, sizeof(*row));
+	row->pc = pc;
+	row->cfa = UNWIND_CFA_NONE;
+
+	if (state && state->ra_undefined) {
+		row->cfa = UNWIND_CFA_END;
+		return 0;
+	}
+
+	/* anything else, e.g. the CFA expression of a PLT, is left to frame pointers */
+	if (!state || state->cfa_expr ||
+	    (state->cfa_reg != DWARF_REG_RSP && state->cfa_reg != DWARF_REG_RBP) ||
+	    state->cfa_off < INT32_MIN || state->cfa_off > INT32_MAX ||
+	    state->rbp_off < INT16_MIN || state->rbp_off > INT16_MAX)
+		return 0;
+
+	row->cfa = state->cfa_reg == DWARF_REG_RSP ? UNWIND_CFA_SP : UNWIND_CFA_BP;
+	row->cfa_off = state->cfa_off;
+	row->rbp_off = state->rbp_off;
+	return 0;
+}
+
+/*
+ * Runs a CFA program on state. With a dso, the row of every location the
+ * program advances past is added to it, from *loc* on.
+ */
+static int eh_run_cfa(const struct eh_frame *eh, const struct eh_cie *cie,
+		      const uint8_t *p, const uint8_t *end,
+		      const struct cfa_state *initial, struct cfa_state *state,
+		      struct dso *dso, uint64_t *loc, int fde_first)
+{
+	struct cfa_state saved[CFA_STATE_STACK];
+	uint64_t reg, off, new_loc;
+	int nr_saved = 0;
+	uint16_t u16;
+	uint32_t u32;
+	int64_t soff;
+	uint8_t op, u8;
+
+	while (p < end) {
+		op = *p++;
+		new_loc = *loc;
+		reg = op & 0x3f;
+
+		switch (op & 0xc0) {
+		case DW_CFA_advance_loc:
+			new_loc += reg * cie->code_align;
+			goto advance;
+		case DW_CFA_offset:
+			if (eh_read_uleb(&p, end, &off))
+				return -1;
+			if (reg == DWARF_REG_RBP)
+				state->rbp_off = (int64_t)off * cie->data_align;
+			if (reg == DWARF_REG_RA)
+				state->ra_undefined = false;
+			continue;
+		case DW_CFA_restore:
+			if (reg == DWARF_REG_RBP)
+				state->rbp_off = initial->rbp_off;
+			if (reg == DWARF_REG_RA)
+				state->ra_undefined = initial->ra_undefined;
+			continue;
+		}
+
+		switch (op) {
+		case DW_CFA_nop:
+			continue;
+		case DW_CFA_set_loc:
+			if (eh_read_ptr(eh, &p, end, cie->fde_enc, &new_loc))
+				return -1;
+			goto advance;
+		case DW_CFA_advance_loc1:
+			if (eh_read(&p, end, &u8, sizeof(u8)))
+				return -1;
+			new_loc += u8 * cie->code_align;
+			goto advance;
+		case DW_CFA_advance_loc2:
+			if (eh_read(&p, end, &u16, sizeof(u16)))
+				return -1;
+			new_loc += u16 * cie->code_align;
+			goto advance;
+		case DW_CFA_advance_loc4:
+			if (eh_read(&p, end, &u32, sizeof(u32)))
+				return -1;
+			new_loc += u32 * cie->code_align;
+			goto advance;
+		case DW_CFA_offset_extended:
+		case DW_CFA_val_offset:
+			if (eh_read_uleb(&p, end, &reg) || eh_read_uleb(&p, end, &off))
+				return -1;
+			if (reg == DWARF_REG_RBP)
+				state->rbp_off = op == DW_CFA_offset_extended ?
+						 (int64_t)off * cie->data_align : 0;
+			continue;
+		case DW_CFA_offset_extended_sf:
+		case DW_CFA_val_offset_sf:
+			if (eh_read_uleb(&p, end, &reg) || eh_read_sleb(&p, end, &soff))
+				return -1;
+			if (reg == DWARF_REG_RBP)
+				state->rbp_off = op == DW_CFA_offset_extended_sf ?
+						 soff * cie->data_align : 0;
+			continue;
+		case DW_CFA_GNU_negative_offset_extended:
+			if (eh_read_uleb(&p, end, &reg) || eh_read_uleb(&p, end, &off))
+				return -1;
+			if (reg == DWARF_REG_RBP)
+				state->rbp_off = -(int64_t)off * cie->data_align;
+			continue;
+		case DW_CFA_restore_extended:
+			if (eh_read_uleb(&p, end, &reg))
+				return -1;
+			if (reg == DWARF_REG_RBP)
+				state->rbp_off = initial->rbp_off;
+			if (reg == DWARF_REG_RA)
+				state->ra_undefined = initial->ra_undefined;
+			continue;
+		case DW_CFA_undefined:
+		case DW_CFA_same_value:
+			if (eh_read_uleb(&p, end, &reg))
+				return -1;
+			if (reg == DWARF_REG_RBP)
+				state->rbp_off = 0;
+			if (reg == DWARF_REG_RA)
+				state->ra_undefined = op == DW_CFA_undefined;
+			continue;
+		case DW_CFA_register:
+			if (eh_read_uleb(&p, end, &reg) || eh_read_uleb(&p, end, &off))
+				return -1;
+			if (reg == DWARF_REG_RBP)
+				state->rbp_off = 0;
+			continue;
+		case DW_CFA_remember_state:
+			if (nr_saved == CFA_STATE_STACK)
+				return -1;
+			saved[nr_saved++] = *state;
+			continue;
+		case DW_CFA_restore_state:
+			if (!nr_saved)
+				return -1;
+			*state = saved[--nr_saved];
+			continue;
+		case DW_CFA_def_cfa:
+			if (eh_read_uleb(&p, end, &state->cfa_reg) ||
+			    eh_read_uleb(&p, end, &off))
+				return -1;
+			state->cfa_off = off;
+			state->cfa_expr = false;
+			continue;
+		case DW_CFA_def_cfa_sf:
+			if (eh_read_uleb(&p, end, &state->cfa_reg) ||
+			    eh_read_sleb(&p, end, &soff))
+				return -1;
+			state->cfa_off = soff * cie->data_align;
+			state->cfa_expr = false;
+			continue;
+		case DW_CFA_def_cfa_register:
+			if (eh_read_uleb(&p, end, &state->cfa_reg))
+				return -1;
+			state->cfa_expr = false;
+			continue;
+		case DW_CFA_def_cfa_offset:
+			if (eh_read_uleb(&p, end, &off))
+				return -1;
+			state->cfa_off = off;
+			continue;
+		case DW_CFA_def_cfa_offset_sf:
+			if (eh_read_sleb(&p, end, &soff))
+				return -1;
+			state->cfa_off = soff * cie->data_align;
+			continue;
+		case DW_CFA_def_cfa_expression:
+			if (eh_read_uleb(&p, end, &off) || off > (uint64_t)(end - p))
+				return -1;
+			p += off;
+			state->cfa_expr = true;
+			continue;
+		case DW_CFA_expression:
+		case DW_CFA_val_expression:
+			if (eh_read_uleb(&p, end, &reg) || eh_read_uleb(&p, end, &off) ||
+			    off > (uint64_t)(end - p))
+				return -1;
+			p += off;
+			if (reg == DWARF_REG_RBP)
+				state->rbp_off = 0;
+			continue;
+		case DW_CFA_GNU_args_size:
+			if (eh_read_uleb(&p, end, &off))
+				return -1;
+			continue;
+		default:
+			return -1;
+		}
+
+advance:
+		if (dso && dso__add_unwind_row(dso, *loc, state, fde_first))
+			return -1;
+		*loc = new_loc;
+	}
+
+	return 0;
 }
 
-static void dso__free_fields(struct dso *dso)
+static int unwind_row_cmp(const void *p1, const void *p2)
 {
-	if (!dso)
-		return;
+	const struct unwind_row *r1 = p1, *r2 = p2;
 
-	free(dso->name);
-	free(dso->ranges);
-	free(dso->syms);
-	btf__free(dso->btf);
+	if (r1->pc != r2->pc)
+		return r1->pc < r2->pc ? -1 : 1;
+	/* the end of an FDE gives way to the start of the next */
+	return (r1->cfa != UNWIND_CFA_NONE) - (r2->cfa != UNWIND_CFA_NONE);
+}
+
+/* sorts the rows and drops the ones that do not change the rule */
+static void dso__finish_unwind_rows(struct dso *dso)
+{
+	struct unwind_row *rows = dso->unwind_rows;
+	bool sorted = true;
+	int i, n = 0;
+
+	for (i = 1; sorted && i < dso->unwind_rows_sz; i++)
+		sorted = unwind_row_cmp(&rows[i - 1], &rows[i]) <= 0;
+	if (!sorted)
+		qsort(rows, dso->unwind_rows_sz, sizeof(*rows), unwind_row_cmp);
+
+	for (i = 0; i < dso->unwind_rows_sz; i++) {
+		if (n && rows[n - 1].pc == rows[i].pc)
+			rows[n - 1] = rows[i];
+		else if (n && rows[n - 1].cfa == rows[i].cfa &&
+			 rows[n - 1].cfa_off == rows[i].cfa_off &&
+			 rows[n - 1].rbp_off == rows[i].rbp_off)
+			continue;
+		else
+			rows[n++] = rows[i];
+	}
+	dso->unwind_rows_sz = n;
 }
 
-static int dso__load_sym_table_from_elf(struct dso *dso, int fd)
+static int dso__load_unwind_table_from_elf(struct dso *dso, Elf *e)
 {
+	const uint8_t *p, *entry_end, *id_pos, *cie_entry = NULL, *end;
+	struct cfa_state initial, state;
 	Elf_Scn *section = NULL;
-	Elf *e;
-	int i;
+	struct eh_frame eh = {};
+	uint64_t pc, range, aug_sz;
+	struct eh_cie cie;
+	GElf_Shdr header;
+	Elf_Data *data;
+	size_t stridx;
+	int fde_first, err;
+	uint32_t id;
+	char *name;
 
-	e = fd > 0 ? open_elf_by_fd(fd) : open_elf(dso->name, &fd);
-	if (!e)
+	if (elf_getshdrstrndx(e, &stridx))
 		return -1;
 
 	while ((section = elf_nextscn(e, section)) != 0) {
-		GElf_Shdr header;
+		if (!gelf_getshdr(section, &header) || header.sh_type == SHT_NOBITS)
+			continue;
+		name = elf_strptr(e, stridx, header.sh_name);
+		if (!name || strcmp(name, ".eh_frame"))
+			continue;
+		data = elf_getdata(section, NULL);
+		if (!data || !data->d_buf)
+			return -1;
+		eh.data = data->d_buf;
+		eh.size = data->d_size;
+		eh.addr = header.sh_addr;
+		break;
+	}
+	if (!eh.data)
+		return -1;
 
-		if (!gelf_getshdr(section, &header))
+	end = eh.data + eh.size;
+	for (p = eh.data; p < end; p = entry_end) {
+		if (eh_read_entry(&eh, &p, &entry_end))
+			break;
+		id_pos = p;
+		if (eh_read(&p, entry_end, &id, sizeof(id)))
+			break;
+		/* a CIE, parsed when an FDE refers to it */
+		if (!id)
 			continue;
 
-		if (header.sh_type != SHT_SYMTAB &&
-		    header.sh_type != SHT_DYNSYM)
+		if (id > (uint64_t)(id_pos - eh.data))
 			continue;
+		if (id_pos - id != cie_entry) {
+			cie_entry = id_pos - id;
+			memset(&initial, 0, sizeof(initial));
+			pc = 0;
+			if (eh_parse_cie(&eh, cie_entry, &cie) ||
+			    eh_run_cfa(&eh, &cie, cie.insns, cie.end, &initial,
+				       &initial, NULL, &pc, 0)) {
+				cie_entry = NULL;
+				continue;
+			}
+		}
 
-		if (dso__add_syms(dso, e, section, header.sh_link,
-				  header.sh_entsize))
+		if (eh_read_ptr(&eh, &p, entry_end, cie.fde_enc, &pc) ||
+		    eh_read_ptr(&eh, &p, entry_end, cie.fde_enc & 0x0f, &range))
+			continue;
+		if (cie.fde_aug) {
+			if (eh_read_uleb(&p, entry_end, &aug_sz) ||
+			    aug_sz > (uint64_t)(entry_end - p))
+				continue;
+			p += aug_sz;
+		}
+		if (!range)
+			continue;
+
+		/* a program it can't follow leaves the rest of the FDE to frame pointers */
+		state = initial;
+		fde_first = dso->unwind_rows_sz;
+		range += pc;
+		err = eh_run_cfa(&eh, &cie, p, entry_end, &initial, &state, dso,
+				 &pc, fde_first);
+		if (dso__add_unwind_row(dso, pc, err ? NULL : &state, fde_first) ||
+		    dso__add_unwind_row(dso, range, NULL, fde_first))
 			goto err_out;
 	}
 
-	/* now when strings are finalized, adjust pointers properly */
-	for (i = 0; i < dso->syms_sz; i++)
-		dso->syms[i].name =
-			btf__name_by_offset(dso->btf,
-					    (unsigned long)dso->syms[i].name);
-
-	qsort(dso->syms, dso->syms_sz, sizeof(*dso->syms), sym_cmp);
-
-	close_elf(e, fd);
+	dso__finish_unwind_rows(dso);
 	return 0;
 
 err_out:
-	dso__free_fields(dso);
-	close_elf(e, fd);
+	dso__free_unwind_rows(dso);
 	return -1;
 }
 
-static int create_tmp_vdso_image(struct dso *dso)
+static int dso__load_unwind_table_from_file(struct dso *dso)
 {
-	uint64_t start_addr, end_addr;
-	long pid = getpid();
-	char buf[PATH_MAX];
-	void *image = NULL;
-	char tmpfile[128];
-	int ret, fd = -1;
-	uint64_t sz;
-	char *name;
-	FILE *f;
+	int fd = -1, err;
+	Elf *e;
 
-	snprintf(tmpfile, sizeof(tmpfile), "/proc/%ld/maps", pid);
-	f = fopen(tmpfile, "r");
-	if (!f)
+	e = open_elf(dso->name, &fd);
+	if (!e)
 		return -1;
 
-	while (true) {
-		ret = fscanf(f, "%lx-%lx %*s %*x %*x:%*x %*u%[^\n]",
-			     &start_addr, &end_addr, buf);
-		if (ret == EOF && feof(f))
-			break;
-		if (ret != 3)
-			goto err_out;
+	err = dso__load_unwind_table_from_elf(dso, e);
+	close_elf(e, fd);
+	return err;
+}
 
-		name = buf;
-		while (isspace(*name))
-			name++;
-		if (!is_file_backed(name))
-			continue;
-		if (is_vdso(name))
-			break;
-	}
+/* next to the symbol table of the same file */
+static int dso__unwind_cache_path(struct dso *dso, char *path, size_t path_sz)
+{
+	size_t len;
 
-	sz = end_addr - start_addr;
-	image = malloc(sz);
-	if (!image)
-		goto err_out;
-	memcpy(image, (void *)start_addr, sz);
-
-	snprintf(tmpfile, sizeof(tmpfile),
-		 "/tmp/libbpf_%ld_vdso_image_XXXXXX", pid);
-	fd = mkostemp(tmpfile, O_CLOEXEC);
-	if (fd < 0) {
-		fprintf(stderr, "failed to create temp file: %s\n",
-			strerror(errno));
-		goto err_out;
-	}
-	/* Unlink the file to avoid leaking */
-	if (unlink(tmpfile) == -1)
-		fprintf(stderr, "failed to unlink %s: %s\n", tmpfile,
-			strerror(errno));
-	if (write(fd, image, sz) == -1) {
-		fprintf(stderr, "failed to write to vDSO image: %s\n",
-			strerror(errno));
+	if (dso__sym_cache_path(dso, path, path_sz))
+		return -1;
+	len = strlen(path);
+	return snprintf(path + len, path_sz - len, ".unwind") <
+	       (int)(path_sz - len) ? 0 : -1;
+}
+
+static int dso__load_unwind_table_from_cache(struct dso *dso, const char *path)
+{
+	const struct unwind_cache_header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
 		close(fd);
-		fd = -1;
-		goto err_out;
+		return -1;
 	}
 
-err_out:
-	fclose(f);
-	free(image);
-	return fd;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (memcmp(hdr->magic, UNWIND_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != UNWIND_CACHE_VERSION ||
+	    sizeof(*hdr) + hdr->rows_sz * sizeof(struct unwind_row) !=
+	    (uint64_t)st.st_size) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	dso->unwind_map = map;
+	dso->unwind_map_sz = st.st_size;
+	dso->unwind_rows = (struct unwind_row *)(hdr + 1);
+	dso->unwind_rows_sz = hdr->rows_sz;
+	return 0;
 }
 
-static int dso__load_sym_table_from_vdso_image(struct dso *dso)
+static void dso__save_unwind_table(struct dso *dso, const char *path)
 {
-	int fd = create_tmp_vdso_image(dso);
+	struct unwind_cache_header hdr = {
+		.magic = UNWIND_CACHE_MAGIC,
+		.version = UNWIND_CACHE_VERSION,
+		.rows_sz = dso->unwind_rows_sz,
+	};
+	const ssize_t rows_sz = dso->unwind_rows_sz * sizeof(*dso->unwind_rows);
+	char tmp[PATH_MAX];
+	bool ok;
+	int fd;
 
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		return;
+	fd = mkostemp(tmp, O_CLOEXEC);
 	if (fd < 0)
-		return -1;
-	return dso__load_sym_table_from_elf(dso, fd);
+		return;
+
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	     (!rows_sz || write(fd, dso->unwind_rows, rows_sz) == rows_sz);
+	close(fd);
+
+	if (!ok || rename(tmp, path))
+		unlink(tmp);
 }
 
-static int dso__load_sym_table(struct dso *dso)
+static int dso__load_unwind_table(struct dso *dso)
 {
-	if (dso->type == UNKNOWN)
+	char path[PATH_MAX];
+	bool cached;
+
+	if (dso->type != EXEC && dso->type != DYN)
 		return -1;
-	if (dso->type == PERF_MAP)
-		return dso__load_sym_table_from_perf_map(dso);
-	if (dso->type == EXEC || dso->type == DYN)
-		return dso__load_sym_table_from_elf(dso, 0);
-	if (dso->type == VDSO)
-		return dso__load_sym_table_from_vdso_image(dso);
-	return -1;
+
+	cached = !dso__unwind_cache_path(dso, path, sizeof(path));
+	if (cached && !dso__load_unwind_table_from_cache(dso, path))
+		return 0;
+	if (dso__load_unwind_table_from_file(dso))
+		return -1;
+	if (cached)
+		dso__save_unwind_table(dso, path);
+	return 0;
 }
 
-static struct sym *dso__find_sym(struct dso *dso, uint64_t offset)
+/* loads the unwind table of a dso on first use, see dso__ensure_sym_table() */
+static int dso__ensure_unwind_table(struct syms *syms, struct dso *dso)
 {
-	unsigned long sym_addr;
+	int loaded = __atomic_load_n(&dso->unwind_loaded, __ATOMIC_ACQUIRE);
+
+	if (loaded)
+		return loaded > 0 ? 0 : -1;
+
+	pthread_mutex_lock(&syms->load_lock);
+	loaded = dso->unwind_loaded;
+	if (!loaded) {
+		loaded = dso__load_unwind_table(dso) ? -1 : 1;
+		__atomic_store_n(&dso->unwind_loaded, loaded, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&syms->load_lock);
+
+	return loaded > 0 ? 0 : -1;
+}
+
+/* the row covering offset, NULL where there is no unwind info */
+static const struct unwind_row *dso__find_unwind_row(struct syms *syms,
+						     struct dso *dso,
+						     uint64_t offset)
+{
+	const struct unwind_row *rows;
 	int start, end, mid;
 
-	if (!dso->syms && dso__load_sym_table(dso))
+	if (dso__ensure_unwind_table(syms, dso) || !dso->unwind_rows_sz)
 		return NULL;
 
-	start = 0;
-	end = dso->syms_sz - 1;
+	rows = dso->unwind_rows;
+	if (offset < rows[0].pc)
+		return NULL;
 
-	/* find largest sym_addr <= addr using binary search */
+	start = 0;
+	end = dso->unwind_rows_sz - 1;
 	while (start < end) {
 		mid = start + (end - start + 1) / 2;
-		sym_addr = dso->syms[mid].start;
-
-		if (sym_addr <= offset)
+		if (rows[mid].pc <= offset)
 			start = mid;
 		else
 			end = mid - 1;
 	}
 
-	if (start == end && dso->syms[start].start <= offset) {
-		(dso->syms[start]).offset = offset - dso->syms[start].start;
-		return &dso->syms[start];
-	}
-	return NULL;
+	return rows[start].cfa != UNWIND_CFA_NONE ? &rows[start] : NULL;
 }
 
-struct syms *syms__load_file(const char *fname)
+static int user_stack__read(const struct user_stack *stack, uint64_t addr,
+			    uint64_t *val)
 {
-	char buf[PATH_MAX], perm[5];
-	struct syms *syms;
+	if (addr < stack->sp || stack->size < sizeof(*val) ||
+	    addr - stack->sp > stack->size - sizeof(*val))
+		return -1;
+	memcpy(val, (const char *)stack->data + (addr - stack->sp), sizeof(*val));
+	return 0;
+}
+
+/* reads the executable mappings of a maps file into syms, see syms__add_dso() */
+static int syms__read_maps(struct syms *syms, FILE *f, struct dso *old,
+			   int old_sz)
+{
+	char buf[PATH_MAX], perm[5], perf_map[64] = "";
 	struct map map;
 	char *name;
-	FILE *f;
 	int ret;
 
-	f = fopen(fname, "r");
-	if (!f)
-		return NULL;
-
-	syms = calloc(1, sizeof(*syms));
-	if (!syms)
-		goto err_out;
+	if (syms->tgid) {
+		snprintf(perf_map, sizeof(perf_map), "/tmp/perf-%d.map", syms->tgid);
+		if (access(perf_map, R_OK))
+			perf_map[0] = '\0';
+	}
 
 	while (true) {
 		ret = fscanf(f, "%lx-%lx %4s %lx %lx:%lx %lu%[^\n]",
@@ -667,7 +2604,7 @@ struct syms *syms__load_file(const char *fname)
 		if (ret == EOF && feof(f))
 			break;
 		if (ret != 8)	/* perf-<PID>.map */
-			goto err_out;
+			return -1;
 
 		if (perm[2] != 'x')
 			continue;
@@ -675,13 +2612,40 @@ struct syms *syms__load_file(const char *fname)
 		name = buf;
 		while (isspace(*name))
 			name++;
-		if (!is_file_backed(name))
+		if (is_anon(name) && perf_map[0])
+			name = perf_map;
+		else if (!is_file_backed(name))
 			continue;
 
-		if (syms__add_dso(syms, &map, name))
-			goto err_out;
+		if (syms__add_dso(syms, &map, name, old, old_sz))
+			return -1;
 	}
 
+	return 0;
+}
+
+static struct syms *syms__load(const char *fname, int tgid)
+{
+	struct syms *syms;
+	FILE *f;
+
+	f = fopen(fname, "r");
+	if (!f)
+		return NULL;
+
+	syms = calloc(1, sizeof(*syms));
+	if (!syms)
+		goto err_out;
+	pthread_mutex_init(&syms->load_lock, NULL);
+	syms->tgid = tgid;
+
+	syms->maps_path = strdup(fname);
+	if (!syms->maps_path)
+		goto err_out;
+
+	if (syms__read_maps(syms, f, NULL, 0) || syms__build_index(syms))
+		goto err_out;
+
 	fclose(f);
 	return syms;
 
@@ -691,12 +2655,45 @@ err_out:
 	return NULL;
 }
 
+struct syms *syms__load_file(const char *fname)
+{
+	return syms__load(fname, 0);
+}
+
+int syms__refresh(struct syms *syms)
+{
+	struct dso *old = syms->dsos;
+	int old_sz = syms->dso_sz;
+	int i, err;
+	FILE *f;
+
+	f = fopen(syms->maps_path, "r");
+	if (!f)
+		return -1;
+
+	syms->dsos = NULL;
+	syms->dso_sz = 0;
+	err = syms__read_maps(syms, f, old, old_sz);
+	fclose(f);
+
+	/* the dsos that are gone, or all of them if nothing is left */
+	for (i = 0; i < old_sz; i++) {
+		if (old[i].name)
+			dso__free_fields(&old[i]);
+	}
+	free(old);
+
+	if (syms__build_index(syms))
+		err = -1;
+	return err;
+}
+
 struct syms *syms__load_pid(pid_t tgid)
 {
 	char fname[128];
 
 	snprintf(fname, sizeof(fname), "/proc/%ld/maps", (long)tgid);
-	return syms__load_file(fname);
+	return syms__load(fname, tgid);
 }
 
 void syms__free(struct syms *syms)
@@ -709,87 +2706,227 @@ void syms__free(struct syms *syms)
 	for (i = 0; i < syms->dso_sz; i++)
 		dso__free_fields(&syms->dsos[i]);
 	free(syms->dsos);
+	free(syms->maps_path);
+	free(syms->range_starts);
+	free(syms->ranges);
+	pthread_mutex_destroy(&syms->load_lock);
 	free(syms);
 }
 
-const struct sym *syms__map_addr(const struct syms *syms, unsigned long addr)
+int syms__map_addr(const struct syms *syms, unsigned long addr,
+		   struct sym *sym)
 {
 	struct dso *dso;
 	uint64_t offset;
 
 	dso = syms__find_dso(syms, addr, &offset);
 	if (!dso)
-		return NULL;
-	return dso__find_sym(dso, offset);
+		return -1;
+	return dso__find_sym((struct syms *)syms, dso, offset, sym);
 }
 
-const struct sym *syms__map_addr_dso(const struct syms *syms, unsigned long addr,
-				     char **dso_name, unsigned long *dso_offset)
+int syms__map_addr_dso(const struct syms *syms, unsigned long addr,
+		       struct sym_info *sinfo)
 {
+	struct sym sym;
 	struct dso *dso;
 	uint64_t offset;
 
+	memset(sinfo, 0, sizeof(*sinfo));
+
 	dso = syms__find_dso(syms, addr, &offset);
 	if (!dso)
-		return NULL;
+		return -1;
+
+	sinfo->dso_name = dso->name;
+	sinfo->dso_offset = offset;
+
+	if (!dso__find_sym((struct syms *)syms, dso, offset, &sym)) {
+		sinfo->sym_name = sym.name;
+		sinfo->sym_offset = offset - sym.start;
+	}
+
+	return 0;
+}
+
+int syms__unwind(const struct syms *syms, const struct user_stack *stack,
+		 unsigned long *ips, int max_ips)
+{
+	uint64_t ip = stack->ip, sp = stack->sp, bp = stack->bp;
+	const struct unwind_row *row;
+	uint64_t cfa, offset;
+	struct dso *dso;
+	int rbp_off, n = 0;
+
+	while (n < max_ips && ip) {
+		ips[n++] = ip;
+
+		/* a call may be the last instruction of its function */
+		dso = syms__find_dso(syms, ip - 1, &offset);
+		if (!dso && n == 1)
+			return -1;
+		row = dso ? dso__find_unwind_row((struct syms *)syms, dso,
+						 offset) : NULL;
+		if (row && row->cfa == UNWIND_CFA_END) {
+			break;
+		} else if (row) {
+			cfa = (row->cfa == UNWIND_CFA_SP ? sp : bp) + row->cfa_off;
+			rbp_off = row->rbp_off;
+		} else {
+			cfa = bp + 16;
+			rbp_off = -16;
+		}
 
-	*dso_name = dso->name;
-	*dso_offset = offset;
+		if (cfa <= sp || user_stack__read(stack, cfa - 8, &ip))
+			break;
+		if (rbp_off && user_stack__read(stack, cfa + rbp_off, &bp))
+			break;
+		sp = cfa;
+	}
 
-	return dso__find_sym(dso, offset);
+	return n;
 }
 
+/* a process whose symbols are cached, chained in a bucket by tgid */
+struct syms_cache_entry {
+	struct syms *syms;
+	int tgid;
+	/* when the maps were last read, to rate limit refreshes */
+	unsigned long long read_ns;
+	struct syms_cache_entry *next;
+};
+
 struct syms_cache {
-	struct {
-		struct syms *syms;
-		int tgid;
-	} *data;
+	struct syms_cache_entry **buckets;
+	unsigned int nr_buckets;
 	int nr;
 };
 
+#define SYMS_CACHE_REFRESH_NS	NSEC_PER_SEC
+
 struct syms_cache *syms_cache__new(int nr)
 {
 	struct syms_cache *syms_cache;
+	unsigned int nr_buckets = 64;
+
+	while (nr > 0 && nr_buckets < (unsigned int)nr)
+		nr_buckets <<= 1;
 
 	syms_cache = calloc(1, sizeof(*syms_cache));
 	if (!syms_cache)
 		return NULL;
-	if (nr > 0)
-		syms_cache->data = calloc(nr, sizeof(*syms_cache->data));
+	syms_cache->buckets = calloc(nr_buckets, sizeof(*syms_cache->buckets));
+	if (!syms_cache->buckets) {
+		free(syms_cache);
+		return NULL;
+	}
+	syms_cache->nr_buckets = nr_buckets;
 	return syms_cache;
 }
 
 void syms_cache__free(struct syms_cache *syms_cache)
 {
-	int i;
+	struct syms_cache_entry *entry, *next;
+	unsigned int i;
 
 	if (!syms_cache)
 		return;
 
-	for (i = 0; i < syms_cache->nr; i++)
-		syms__free(syms_cache->data[i].syms);
-	free(syms_cache->data);
+	for (i = 0; i < syms_cache->nr_buckets; i++) {
+		for (entry = syms_cache->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			syms__free(entry->syms);
+			free(entry);
+		}
+	}
+	free(syms_cache->buckets);
 	free(syms_cache);
 }
 
-struct syms *syms_cache__get_syms(struct syms_cache *syms_cache, int tgid)
+static unsigned int syms_cache__bucket(const struct syms_cache *syms_cache,
+				       int tgid)
 {
-	void *tmp;
-	int i;
+	/* multiplicative hashing, pids are often close to each other */
+	return ((uint32_t)tgid * 2654435761u) & (syms_cache->nr_buckets - 1);
+}
 
-	for (i = 0; i < syms_cache->nr; i++) {
-		if (syms_cache->data[i].tgid == tgid)
-			return syms_cache->data[i].syms;
+/* doubles the buckets once there are more processes than buckets */
+static void syms_cache__grow(struct syms_cache *syms_cache)
+{
+	struct syms_cache_entry **buckets, **old = syms_cache->buckets;
+	struct syms_cache_entry *entry, *next;
+	unsigned int i, old_nr = syms_cache->nr_buckets, bucket;
+
+	buckets = calloc(old_nr * 2, sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	syms_cache->buckets = buckets;
+	syms_cache->nr_buckets = old_nr * 2;
+	for (i = 0; i < old_nr; i++) {
+		for (entry = old[i]; entry; entry = next) {
+			next = entry->next;
+			bucket = syms_cache__bucket(syms_cache, entry->tgid);
+			entry->next = buckets[bucket];
+			buckets[bucket] = entry;
+		}
 	}
+	free(old);
+}
 
-	tmp = realloc(syms_cache->data, (syms_cache->nr + 1) *
-		      sizeof(*syms_cache->data));
-	if (!tmp)
+static struct syms_cache_entry *
+syms_cache__get_entry(struct syms_cache *syms_cache, int tgid)
+{
+	struct syms_cache_entry *entry;
+	unsigned int bucket;
+
+	bucket = syms_cache__bucket(syms_cache, tgid);
+	for (entry = syms_cache->buckets[bucket]; entry; entry = entry->next) {
+		if (entry->tgid == tgid)
+			return entry;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+	entry->tgid = tgid;
+	entry->syms = syms__load_pid(tgid);
+	entry->read_ns = get_ktime_ns();
+	entry->next = syms_cache->buckets[bucket];
+	syms_cache->buckets[bucket] = entry;
+
+	if (++syms_cache->nr > (int)syms_cache->nr_buckets)
+		syms_cache__grow(syms_cache);
+	return entry;
+}
+
+struct syms *syms_cache__get_syms(struct syms_cache *syms_cache, int tgid)
+{
+	struct syms_cache_entry *entry;
+
+	entry = syms_cache__get_entry(syms_cache, tgid);
+	return entry ? entry->syms : NULL;
+}
+
+struct syms *syms_cache__refresh_syms(struct syms_cache *syms_cache, int tgid)
+{
+	struct syms_cache_entry *entry;
+	unsigned long long now;
+
+	entry = syms_cache__get_entry(syms_cache, tgid);
+	if (!entry)
 		return NULL;
-	syms_cache->data = tmp;
-	syms_cache->data[syms_cache->nr].syms = syms__load_pid(tgid);
-	syms_cache->data[syms_cache->nr].tgid = tgid;
-	return syms_cache->data[syms_cache->nr++].syms;
+
+	now = get_ktime_ns();
+	if (now - entry->read_ns < SYMS_CACHE_REFRESH_NS)
+		return entry->syms;
+	entry->read_ns = now;
+
+	if (!entry->syms)
+		entry->syms = syms__load_pid(tgid);
+	else
+		syms__refresh(entry->syms);
+	return entry->syms;
 }
 
 struct partitions {
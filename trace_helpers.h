@@ -24,22 +24,68 @@ struct sym {
 	const char *name;
 	unsigned long start;
 	unsigned long size;
-	unsigned long offset;
+};
+
+/* the symbolization of an address, filled by value so lookups are reentrant */
+struct sym_info {
+	const char *dso_name;
+	unsigned long dso_offset;
+	const char *sym_name;
+	unsigned long sym_offset;
 };
 
 struct syms;
 
+/*
+ * Lookups in a loaded struct syms may run concurrently from several threads,
+ * the symbol table of each dso is loaded once by whichever gets to it first.
+ * The syms_cache itself is not thread-safe.
+ */
 struct syms *syms__load_pid(int tgid);
 struct syms *syms__load_file(const char *fname);
 void syms__free(struct syms *syms);
-const struct sym *syms__map_addr(const struct syms *syms, unsigned long addr);
-const struct sym *syms__map_addr_dso(const struct syms *syms, unsigned long addr,
-				     char **dso_name, unsigned long *dso_offset);
+/*
+ * Reads the maps again, for libraries mapped or unmapped since. The symbol
+ * tables of the files still mapped are kept. It may not run concurrently
+ * with lookups, and dso names returned before are invalid after it.
+ */
+int syms__refresh(struct syms *syms);
+int syms__map_addr(const struct syms *syms, unsigned long addr,
+		   struct sym *sym);
+int syms__map_addr_dso(const struct syms *syms, unsigned long addr,
+		       struct sym_info *sinfo);
+
+/* a copy of a user stack from sp up, with the registers to unwind it from */
+struct user_stack {
+	unsigned long ip;
+	unsigned long sp;
+	unsigned long bp;
+	const void *data;
+	unsigned long size;
+};
+
+/*
+ * Unwinds an x86_64 user stack with the .eh_frame of the dsos, or frame
+ * pointers where it has no entry, into at most max_ips addresses starting
+ * with ip. Returns how many, or -1 if ip is in none of the mappings. The
+ * unwind tables are loaded like the symbol tables, and cached with them.
+ */
+int syms__unwind(const struct syms *syms, const struct user_stack *stack,
+		 unsigned long *ips, int max_ips);
+
+/*
+ * Keeps the sorted symbol tables of the files, and of the kernel, loaded
+ * from now on in *dir*, to be mapped rather than parsed the next time.
+ * NULL turns it off.
+ */
+void syms__set_cache_dir(const char *dir);
 
 struct syms_cache;
 
 struct syms_cache *syms_cache__new(int nr);
 struct syms *syms_cache__get_syms(struct syms_cache *syms_cache, int tgid);
+/* the same, with the maps read again if they were not within a second */
+struct syms *syms_cache__refresh_syms(struct syms_cache *syms_cache, int tgid);
 void syms_cache__free(struct syms_cache *syms_cache);
 
 struct partition {
@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "uprobe_helpers.h"
+
+/*
+ * Finds where the executable of *pid* is mapped by matching the inode of
+ * /proc/<pid>/exe, which also works when the binary lives in another mount
+ * namespace.
+ */
+int get_pid_exe_base(pid_t pid, uint64_t *base)
+{
+	unsigned long start, off, ino;
+	unsigned int maj, min;
+	char path[64], buf[PATH_MAX];
+	struct stat st;
+	int ret = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+	if (stat(path, &st))
+		return -1;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		if (sscanf(buf, "%lx-%*x %*s %lx %x:%x %lu", &start, &off,
+			   &maj, &min, &ino) != 5)
+			continue;
+		if (ino != st.st_ino || makedev(maj, min) != st.st_dev || off)
+			continue;
+
+		*base = start;
+		ret = 0;
+		break;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+int get_elf_var(const char *path, const char *name, struct elf_var *var)
+{
+	Elf_Scn *scn = NULL;
+	size_t i, nr_phdrs;
+	GElf_Ehdr ehdr;
+	GElf_Phdr phdr;
+	int fd = -1, err = -1;
+	Elf *e;
+
+	e = open_elf(path, &fd);
+	if (!e)
+		return -1;
+
+	memset(var, 0, sizeof(*var));
+
+	if (!gelf_getehdr(e, &ehdr) || elf_getphdrnum(e, &nr_phdrs))
+		goto out;
+
+	var->pie = ehdr.e_type == ET_DYN;
+	var->load_vaddr = UINT64_MAX;
+
+	for (i = 0; i < nr_phdrs; i++) {
+		if (!gelf_getphdr(e, (int)i, &phdr))
+			continue;
+
+		if (phdr.p_type == PT_LOAD && phdr.p_vaddr - phdr.p_offset < var->load_vaddr)
+			var->load_vaddr = phdr.p_vaddr - phdr.p_offset;
+
+		if (phdr.p_type == PT_TLS) {
+			var->tls_memsz = phdr.p_memsz;
+			var->tls_align = phdr.p_align;
+		}
+	}
+
+	while ((scn = elf_nextscn(e, scn))) {
+		Elf_Data *data = NULL;
+		GElf_Shdr shdr;
+
+		if (!gelf_getshdr(scn, &shdr))
+			continue;
+		if (shdr.sh_type != SHT_SYMTAB && shdr.sh_type != SHT_DYNSYM)
+			continue;
+		if (!shdr.sh_entsize)
+			continue;
+
+		while ((data = elf_getdata(scn, data))) {
+			for (i = 0; i < data->d_size / shdr.sh_entsize; i++) {
+				const char *sym_name;
+				GElf_Sym sym;
+				int type;
+
+				if (!gelf_getsym(data, (int)i, &sym))
+					continue;
+
+				type = GELF_ST_TYPE(sym.st_info);
+				if (type != STT_OBJECT && type != STT_TLS)
+					continue;
+
+				sym_name = elf_strptr(e, shdr.sh_link, sym.st_name);
+				if (!sym_name || strcmp(sym_name, name))
+					continue;
+
+				var->addr = sym.st_value;
+				var->size = sym.st_size;
+				var->tls = type == STT_TLS;
+				err = 0;
+				goto out;
+			}
+		}
+	}
+
+out:
+	close_elf(e, fd);
+	return err;
+}
+
+Elf *open_elf_by_fd(int fd)
+{
+	Elf *e;
+
+	if (elf_version(EV_CURRENT) == EV_NONE) {
+		fprintf(stderr, "elf init failed\n");
+		return NULL;
+	}
+
+	e = elf_begin(fd, ELF_C_READ, NULL);
+	if (!e) {
+		fprintf(stderr, "elf_begin failed: %s\n", elf_errmsg(-1));
+		return NULL;
+	}
+
+	if (elf_kind(e) != ELF_K_ELF) {
+		fprintf(stderr, "elf kind %d is not ELF_K_ELF\n", elf_kind(e));
+		elf_end(e);
+		return NULL;
+	}
+
+	return e;
+}
+
+Elf *open_elf(const char *path, int *fd_close)
+{
+	Elf *e;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	e = open_elf_by_fd(fd);
+	if (!e) {
+		close(fd);
+		return NULL;
+	}
+
+	*fd_close = fd;
+	return e;
+}
+
+void close_elf(Elf *e, int fd_close)
+{
+	if (e)
+		elf_end(e);
+	if (fd_close >= 0)
+		close(fd_close);
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+#ifndef __UPROBE_HELPERS_H
+#define __UPROBE_HELPERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <gelf.h>
+
+/* a data symbol, possibly thread-local, as found by get_elf_var() */
+struct elf_var {
+	/* link-time address, or offset within the TLS block for tls */
+	uint64_t addr;
+	uint64_t size;
+	bool tls;
+	/* the PT_TLS segment of the object, only set for tls */
+	uint64_t tls_memsz;
+	uint64_t tls_align;
+	/* ET_DYN object, load_vaddr is the address mapped at file offset 0 */
+	bool pie;
+	uint64_t load_vaddr;
+};
+
+int get_pid_exe_base(pid_t pid, uint64_t *base);
+int get_elf_var(const char *path, const char *name, struct elf_var *var);
+
+Elf *open_elf(const char *path, int *fd_close);
+Elf *open_elf_by_fd(int fd);
+void close_elf(Elf *e, int fd_close);
+
+#endif /* __UPROBE_HELPERS_H */